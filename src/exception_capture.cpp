@@ -68,6 +68,16 @@ namespace WSTM
       m_thrower_v.Set (exc.m_thrower_v.Get (at), at);
    }
 
+   void WExceptionCapture::Capture (const std::exception_ptr& exc)
+   {
+      m_thrower_v.Set ([exc](){std::rethrow_exception (exc);});
+   }
+   
+   void WExceptionCapture::Capture (const std::exception_ptr& exc, WAtomic& at)
+   {
+      m_thrower_v.Set ([exc](){std::rethrow_exception (exc);}, at);
+   }
+
    void WExceptionCapture::Reset ()
    {
       m_thrower_v.Set (Thrower ());
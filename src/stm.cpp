@@ -29,6 +29,7 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "stm.h"
+#include "probes.h"
 
 #include <boost/format.hpp>
 using boost::format;
@@ -40,13 +41,20 @@ using boost::str;
 
 #include <condition_variable>
 #include <unordered_map>
+#include <map>
+#include <deque>
+#include <functional>
 #include <atomic>
 #include <mutex>
 #include <list>
 #include <thread>
-
-//Define this to turn on stm profiling
-//#define STM_PROFILING
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <array>
+#include <cmath>
+#include <fstream>
 
 namespace  WSTM
 {
@@ -67,87 +75,32 @@ namespace  WSTM
       }
    }
    
-   namespace
-   {
-#ifdef STM_PROFILING
-      std::mutex s_profileMutex;
-      std::chrono::high_resolution_clock::time_point s_profileStart;   
-      std::atomic<unsigned int> s_numConflicts;
-      std::atomic<unsigned int> s_numReadCommits;
-      std::atomic<unsigned int> s_numWriteCommits;
-#endif //STM_PROFILING
-
-      void IncrementNumConflicts ()
-      {
-#ifdef STM_PROFILING
-         ++s_numConflicts;
-#endif
-      }
-   
-      void IncrementNumReadCommits ()
-      {
-#ifdef STM_PROFILING
-         ++s_numReadCommits;
-#endif
-      }
-
-      void IncrementNumWriteCommits ()
-      {
-#ifdef STM_PROFILING
-         ++s_numWriteCommits;
-#endif
-      }
-   }
-
-   void StartProfiling ()
-   {
-#ifdef STM_PROFILING
-      std::unique_lock<std::mutex> lock (s_profileMutex);
-      s_profileStart = std::chrono::high_resolution_clock::now ();
-      s_numConflicts = 0;
-      s_numReadCommits = 0;
-      s_numWriteCommits = 0;      
-#endif
-   }
-
-   std::string WProfileData::FormatData () const
-   {
-#ifdef STM_PROFILING
-      const auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(m_end - m_start).count ();
-      return str (format ("\ttime = %1%secs\n"
-                          "\tconflicts = %2%/sec (%3% total)\n"
-                          "\treads = %4%/sec (%5% total)\n"
-                          "\twrites = %6%/sec (%7% total)")
-                  % elapsed
-                  % (static_cast<double>(m_numConflicts)/elapsed)
-                  % m_numConflicts
-                  % (static_cast<double>(m_numReadCommits)/elapsed)
-                  % m_numReadCommits
-                  % (static_cast<double>(m_numWriteCommits)/elapsed)
-                  % m_numWriteCommits);
-#else
-      return "\tProfiling not active";
-#endif 
-   }
-
-   WProfileData Checkpoint ()
-   {
-      WProfileData data;
-#ifdef STM_PROFILING
-      data.m_numConflicts = s_numConflicts;
-      data.m_numReadCommits = s_numReadCommits;
-      data.m_numWriteCommits = s_numWriteCommits;
-      data.m_end = std::chrono::high_resolution_clock::now ();
-      std::unique_lock<std::mutex> lock (s_profileMutex);
-      data.m_start = s_profileStart;
-#endif      
-      return data;
-   }
-
    const unsigned int UNLIMITED = std::numeric_limits<unsigned int>::max();
 
    namespace
    {
+#ifdef WSTM_CLOCK_ENGINE
+      //This "mutex" is only locked when a transaction explicitly asks
+      //for a read lock or is running with other commits locked
+      //out. Normal reads and commits don't touch it, they use the
+      //global version clock and the per-variable version locks
+      //instead. 
+      Internal::WCommitGate s_readMutex;
+
+      //The global version clock, incremented by every commit that
+      //writes. Kept on its own cache line since every writer hits it.
+      alignas (64) std::atomic<uint64_t> s_clock (0);
+
+#ifdef WSTM_STRIPED_LOCKS
+      //The version locks ("ownership records"), each variable is
+      //hashed to one of these by its address. Variables that share a
+      //stripe can cause false conflicts so there needs to be a lot of
+      //them, the locks are not padded out to cache lines for the same
+      //reason.
+      const unsigned int LOCK_STRIPE_BITS = 16;
+      std::atomic<uint64_t> s_lockStripes[1 << LOCK_STRIPE_BITS];
+#endif //WSTM_STRIPED_LOCKS
+#else
       //This mutex locks out commits while a STM::Var is reading its own
       //value, while commiting this mutex is write locked so that all
       //var reads are held until the commit finishes. It is also
@@ -155,6 +108,16 @@ namespace  WSTM
       //commits locked out.
       boost::upgrade_mutex s_readMutex;
 
+      //Odd while a commit is writing and even otherwise, each commit
+      //that writes adds two. Read-only transactions use this to
+      //tell whether anything could have changed since they last
+      //checked that their reads are a consistent snapshot.
+      alignas (64) std::atomic<uint64_t> s_commitSequence (0);
+
+      //Whether commits are combined, see SetCommitCombining.
+      std::atomic<bool> s_combineCommits (false);
+#endif //WSTM_CLOCK_ENGINE
+
 #ifdef NO_THREAD_LOCAL
 
       //Some compilers don't support thread_local (e.g. apple clang), on those platforms we resort
@@ -231,992 +194,4525 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_readMutexUpgradeLocked, false);
 THREAD_LOCAL_WITH_INIT_VALUE (bool, s_readMutexWriteLocked, false);
 THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
 #endif //_DEBUG
-      
-      //This signal is notified when a commit succeeds. s_readMutex
-      //must be used with this signal. A read lock lock should be
-      //used when waiting. A write lock shoudl be held when
-      //notifiying.
-      std::condition_variable_any s_commitSignal;
-         
-      //exception thrown by Retry() to signal AtomicallyImpl that it should
-      //"retry" the current operation. 
-      struct WRetryException
-      {
-         WRetryException(const WTimeArg& timeout):
-            m_timeout(timeout)
-         {}
 
-         const WTimeArg m_timeout;
-      };   
-   }
-   
-   WCantContinueException::WCantContinueException(const std::string& msg):
-      WException(msg)
-   {}
-   
-   WMaxConflicts::WMaxConflicts ():
-      m_max (UNLIMITED),
-      m_resolution (WConflictResolution::THROW)
-   {}
-   
-   WMaxConflicts::WMaxConflicts (const unsigned int m, const WConflictResolution res) :
-      m_max(m),
-      m_resolution (res)
-   {}
+      //The things that are counted while profiling is on
+      enum WProfileCounter
+      {
+         PROFILE_CONFLICTS,
+         PROFILE_READ_COMMITS,
+         PROFILE_WRITE_COMMITS,
+         PROFILE_CHILD_RESTARTS,
+         PROFILE_SAVED_READS,
+         PROFILE_RETRIES,
+         PROFILE_RUN_LOCKED,
+         PROFILE_RUN_INEVITABLE,
+         PROFILE_COMBINED_COMMITS,
+         PROFILE_SERIALIZED,
+         PROFILE_READS,
+         PROFILE_WRITES,
+         PROFILE_RETRY_WAIT_NS,
+         PROFILE_COMMIT_WAIT_NS,
+         PROFILE_CONTENTION_WAIT_NS,
+         NUM_PROFILE_COUNTERS
+      };
 
-   WMaxRetries::WMaxRetries ():
-      m_value (UNLIMITED)
-   {}
-   
-   WMaxRetries::WMaxRetries (const unsigned int max):
-      m_value (max)
-   {}
+      using WProfileCounts = std::array<uint64_t, NUM_PROFILE_COUNTERS>;
 
-   WMaxRetryWait::WMaxRetryWait ()
-   {}
-   
-   WMaxRetryWait::WMaxRetryWait (const WTimeArg wait):
-      m_value (wait)
-   {}
+      std::atomic<bool> s_profiling (false);
 
-   namespace
-   {
-      
-      struct WReadLockTraits
+      //Gets a record that isn't owned by any thread from the given list, making a new one if they
+      //are all in use. Records are never freed, once the owning thread exits the record gets
+      //reused by the next thread that wants one.
+      template <typename Record_t>
+      Record_t* AcquireRecord (std::atomic<Record_t*>& records)
       {
-         using LockType = boost::shared_lock<boost::upgrade_mutex>;
-
-         static void DoLock ()
-         {
-#ifdef _DEBUG            
-            s_readMutexReadLocked = true;
-#endif //_DEBUG
-         }         
-
-         static void DoUnlock ()
+         for (auto rec_p = records.load (); rec_p; rec_p = rec_p->m_next_p)
          {
-#ifdef _DEBUG            
-            s_readMutexReadLocked = false;
-#endif //_DEBUG
+            auto inUse = false;
+            if (!rec_p->m_inUse.load (std::memory_order_relaxed) && rec_p->m_inUse.compare_exchange_strong (inUse, true))
+            {
+               return rec_p;
+            }
          }
-      };
 
-      struct WUpgradeableLockTraits
+         auto rec_p = new Record_t;
+         rec_p->m_inUse.store (true);
+         rec_p->m_next_p = records.load ();
+         while (!records.compare_exchange_weak (rec_p->m_next_p, rec_p))
+         {}
+         return rec_p;
+      }
+
+      //Owns a thread's record from the given list, the record isn't acquired until it is first
+      //needed and is released when the thread exits.
+      template <typename Record_t, std::atomic<Record_t*>& records_>
+      class WRecordOwner
       {
-         using LockType = boost::upgrade_lock<boost::upgrade_mutex>;
+      public:
+         WRecordOwner (): m_record_p (nullptr), m_released (false) {}
 
-         static void DoLock ()
+         ~WRecordOwner ()
          {
-#ifdef _DEBUG            
-            s_readMutexUpgradeLocked = true;
-#endif //_DEBUG
-         }         
+            if (m_record_p)
+            {
+               m_record_p->m_inUse.store (false);
+               m_record_p = nullptr;
+            }
+            m_released = true;
+         }
 
-         static void DoUnlock ()
+         WRecordOwner (const WRecordOwner&) = delete;
+         WRecordOwner& operator=(const WRecordOwner&) = delete;
+
+         //Null once the thread has started exiting, anything recorded after that is dropped.
+         Record_t* Get ()
          {
-#ifdef _DEBUG            
-            s_readMutexUpgradeLocked = false;
-#endif //_DEBUG
+            if (!m_record_p && !m_released)
+            {
+               m_record_p = AcquireRecord (records_);
+            }
+            return m_record_p;
          }
-      };
 
-      template <typename LockTraits_t>
-      struct WLockImpl
-      {
-         explicit WLockImpl(bool doLock = true);
-            
-         //these methods must match the boost locking convention
-         void lock();
-         bool try_lock();
-         bool locked() const {return m_lock.owns_lock ();}
-         void unlock(const int i = 1);
-         
-         void UnlockAll ();
-         bool WaitForCommit(const WTimeArg& timeout);
-            
-         int m_count;
-         using Lock = typename LockTraits_t::LockType;
-         Lock m_lock;
-
-#ifdef _DEBUG
-         std::thread::id m_threadId;
-         bool m_writeLocked;
-#endif //_DEBUG
+      private:
+         Record_t* m_record_p;
+         bool m_released;
       };
 
-      template <typename LockTraits_t>
-      WLockImpl<LockTraits_t>::WLockImpl (bool doLock):
-         m_count(0),
-         m_lock(s_readMutex, boost::defer_lock_t())
-#ifdef _DEBUG
-         ,m_threadId (std::this_thread::get_id ())
-         ,m_writeLocked(false)
-#endif //_DEBUG
+      //Only the owning thread writes to its record so there's no need for a locked add.
+      void AddToCount (std::atomic<uint64_t>& count, const uint64_t n)
       {
-         if(doLock)
-         {
-            lock();
-         }
+         count.store (count.load (std::memory_order_relaxed) + n, std::memory_order_relaxed);
       }
 
-      template <typename LockTraits_t>
-      void WLockImpl<LockTraits_t>::lock()
+      //Each thread counts into its own record so that profiling doesn't add any contention of its
+      //own, Checkpoint adds the records up. A thread that reuses a record just carries on adding
+      //to the old counts. The counts are padded on both sides so that they don't share a cache
+      //line with anything else.
+      struct WProfileRecord
       {
-         assert (m_threadId == std::this_thread::get_id ());
-         if(m_count == 0)
+         char m_padBefore[64];
+         std::array<std::atomic<uint64_t>, NUM_PROFILE_COUNTERS> m_counts;
+         std::atomic<bool> m_inUse;
+         WProfileRecord* m_next_p;
+         char m_padAfter[64];
+
+         WProfileRecord ()
          {
-            if(m_lock.owns_lock())
+            for (auto& count: m_counts)
             {
-               throw boost::lock_error();
+               count.store (0, std::memory_order_relaxed);
             }
-            m_lock.lock();
-            LockTraits_t::DoLock ();
          }
-         ++m_count;
-      }
+      };
+      std::atomic<WProfileRecord*> s_profileRecords (nullptr);
 
-      template <typename LockTraits_t>
-      bool WLockImpl<LockTraits_t>::try_lock()
+      WProfileCounts SumProfileRecords ()
       {
-         assert (m_threadId == std::this_thread::get_id ());
-         if(m_count == 0)
+         WProfileCounts sums;
+         sums.fill (0);
+         for (auto rec_p = s_profileRecords.load (); rec_p; rec_p = rec_p->m_next_p)
          {
-            if(m_lock.owns_lock())
-            {
-               throw boost::lock_error();
-            }
-            if(!m_lock.try_lock())
+            for (auto i = size_t (0); i < sums.size (); ++i)
             {
-               return false;
+               sums[i] += rec_p->m_counts[i].load (std::memory_order_relaxed);
             }
-            LockTraits_t::DoLock ();
          }
-         ++m_count;
-         return true;
+         return sums;
       }
 
-      template <typename LockTraits_t>
-      void WLockImpl<LockTraits_t>::unlock(const int i)
+      class WProfileThread
       {
-         assert (m_threadId == std::this_thread::get_id ());
-         if (m_count == 0)
+      public:
+         void Count (const WProfileCounter counter, const uint64_t n)
          {
-            return;
+            if (const auto rec_p = m_owner.Get ())
+            {
+               AddToCount (rec_p->m_counts[counter], n);
+            }
          }
 
-         if(!m_lock.owns_lock())
-         {
-            throw boost::lock_error();
-         }
+      private:
+         WRecordOwner<WProfileRecord, s_profileRecords> m_owner;
+      };
+      THREAD_LOCAL (WProfileThread, s_profileThread);
 
-         assert(m_count >= i);
-         m_count -= i;
-         assert(m_count >= 0);
-         if(m_count == 0)
+      void Count (const WProfileCounter counter, const uint64_t n = 1)
+      {
+         if (s_profiling.load (std::memory_order_relaxed))
          {
-            m_lock.unlock();
-            LockTraits_t::DoUnlock ();
+            s_profileThread->Count (counter, n);
          }
       }
 
-      template <typename LockTraits_t>
-      void WLockImpl<LockTraits_t>::UnlockAll ()
+      //Counts a commit along with the sizes of what it read and wrote
+      void CountCommit (const size_t numReads, const size_t numWrites)
       {
-         assert (m_threadId == std::this_thread::get_id ());
-         unlock (m_count);
+         if (s_profiling.load (std::memory_order_relaxed))
+         {
+            s_profileThread->Count (numWrites > 0 ? PROFILE_WRITE_COMMITS : PROFILE_READ_COMMITS, 1);
+            s_profileThread->Count (PROFILE_READS, numReads);
+            s_profileThread->Count (PROFILE_WRITES, numWrites);
+         }
       }
-      
-      template <typename LockTraits_t>
-      bool WLockImpl<LockTraits_t>::WaitForCommit(const WTimeArg& timeout)
+
+      //savedReads is the number of reads done by the ancestors of the restarted transaction, which
+      //would have had to be done again if the whole transaction had been restarted.
+      void CountChildRestart (const size_t savedReads)
       {
-         assert (m_threadId == std::this_thread::get_id ());
-         if(!m_lock.owns_lock())
+         if (s_profiling.load (std::memory_order_relaxed))
          {
-            throw boost::lock_error();
+            s_profileThread->Count (PROFILE_CHILD_RESTARTS, 1);
+            s_profileThread->Count (PROFILE_SAVED_READS, savedReads);
          }
+      }
 
-         if(timeout.IsUnlimited ())
+      //Adds the time between its creation and destruction to the given counter, as long as
+      //profiling was on when it was created.
+      class WProfileTimer
+      {
+      public:
+         explicit WProfileTimer (const WProfileCounter counter):
+            m_counter (counter),
+            m_on (s_profiling.load (std::memory_order_relaxed))
          {
-            s_commitSignal.wait(m_lock);
-            return true;
+            if (m_on)
+            {
+               m_start = std::chrono::steady_clock::now ();
+            }
          }
-         else
+
+         ~WProfileTimer ()
          {
-            return (s_commitSignal.wait_until (m_lock, *timeout.m_time_o) != std::cv_status::timeout);
+            if (m_on)
+            {
+               const auto elapsed = std::chrono::steady_clock::now () - m_start;
+               s_profileThread->Count (m_counter, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count ());
+            }
          }
-      }
 
-      using WReadLock = WLockImpl<WReadLockTraits>;
-      using WUpgradeableLock = WLockImpl<WUpgradeableLockTraits>;
-      
-      class WWriteLock
-      {
-      public:
-         WWriteLock(WUpgradeableLock& readLock);
-         ~WWriteLock();
-         
+         WProfileTimer (const WProfileTimer&) = delete;
+         WProfileTimer& operator=(const WProfileTimer&) = delete;
+
       private:
-#ifdef _DEBUG
-         WUpgradeableLock& m_readLock;
-#endif //_DEBUG
-         boost::upgrade_to_unique_lock<boost::upgrade_mutex> m_lock;
+         const WProfileCounter m_counter;
+         const bool m_on;
+         std::chrono::steady_clock::time_point m_start;
       };
 
-      WWriteLock::WWriteLock(WUpgradeableLock& readLock):
-#ifdef _DEBUG
-         m_readLock (readLock),
-#endif //_DEBUG
-         m_lock (readLock.m_lock)
-      {
-#ifdef _DEBUG
-         assert(!m_readLock.m_writeLocked);
-         m_readLock.m_writeLocked = true;
-         s_readMutexWriteLocked = true;
-#endif //_DEBUG
-      }
-      
-      WWriteLock::~WWriteLock()
+      std::mutex s_profileMutex;
+      std::chrono::high_resolution_clock::time_point s_profileStart;
+      //the counts when the profiling run started
+      WProfileCounts s_profileBase = {};
+   }
+
+   void StartProfiling ()
+   {
+      std::unique_lock<std::mutex> lock (s_profileMutex);
+      s_profileStart = std::chrono::high_resolution_clock::now ();
+      s_profileBase = SumProfileRecords ();
+      s_profiling.store (true);
+   }
+
+   void StopProfiling ()
+   {
+      s_profiling.store (false);
+   }
+
+   std::string WProfileData::FormatData () const
+   {
+      const auto elapsed = std::chrono::duration<double>(m_end - m_start).count ();
+      const auto numCommits = std::max (m_numReadCommits + m_numWriteCommits, 1l);
+      const auto toMs = [](const std::chrono::nanoseconds& time)
+         {
+            return std::chrono::duration<double, std::milli>(time).count ();
+         };
+      return str (format ("\ttime = %1%secs\n"
+                          "\tconflicts = %2%/sec (%3% total)\n"
+                          "\tread commits = %4%/sec (%5% total)\n"
+                          "\twrite commits = %6%/sec (%7% total)\n"
+                          "\tchild restarts = %8%/sec (%9% total, saving %10% outer reads)\n"
+                          "\tretries = %11% total\n"
+                          "\tescalations = %12% run locked, %13% run inevitable\n"
+                          "\tcombined commits = %14% total\n"
+                          "\tserialized = %15% total\n"
+                          "\tread set = %16% per commit (%17% total)\n"
+                          "\twrite set = %18% per commit (%19% total)\n"
+                          "\twaiting = %20%ms in retry, %21%ms to commit, %22%ms in contention policies")
+                  % elapsed
+                  % (m_numConflicts/elapsed)
+                  % m_numConflicts
+                  % (m_numReadCommits/elapsed)
+                  % m_numReadCommits
+                  % (m_numWriteCommits/elapsed)
+                  % m_numWriteCommits
+                  % (m_numChildRestarts/elapsed)
+                  % m_numChildRestarts
+                  % m_numSavedReads
+                  % m_numRetries
+                  % m_numRunLocked
+                  % m_numRunInevitable
+                  % m_numCombinedCommits
+                  % m_numSerialized
+                  % (static_cast<double>(m_numReads)/numCommits)
+                  % m_numReads
+                  % (static_cast<double>(m_numWrites)/numCommits)
+                  % m_numWrites
+                  % toMs (m_retryWaitTime)
+                  % toMs (m_commitWaitTime)
+                  % toMs (m_contentionWaitTime));
+   }
+
+   WProfileData Checkpoint ()
+   {
+      std::unique_lock<std::mutex> lock (s_profileMutex);
+      auto counts = SumProfileRecords ();
+      for (auto i = size_t (0); i < counts.size (); ++i)
       {
-#ifdef _DEBUG
-         assert(m_readLock.m_writeLocked);
-         m_readLock.m_writeLocked = false;
-         s_readMutexWriteLocked = false;
-#endif //_DEBUG
+         counts[i] -= s_profileBase[i];
       }
+      WProfileData data;
+      data.m_start = s_profileStart;
+      data.m_end = std::chrono::high_resolution_clock::now ();
+      data.m_numConflicts = static_cast<long>(counts[PROFILE_CONFLICTS]);
+      data.m_numReadCommits = static_cast<long>(counts[PROFILE_READ_COMMITS]);
+      data.m_numWriteCommits = static_cast<long>(counts[PROFILE_WRITE_COMMITS]);
+      data.m_numChildRestarts = static_cast<long>(counts[PROFILE_CHILD_RESTARTS]);
+      data.m_numSavedReads = static_cast<long>(counts[PROFILE_SAVED_READS]);
+      data.m_numRetries = static_cast<long>(counts[PROFILE_RETRIES]);
+      data.m_numRunLocked = static_cast<long>(counts[PROFILE_RUN_LOCKED]);
+      data.m_numRunInevitable = static_cast<long>(counts[PROFILE_RUN_INEVITABLE]);
+      data.m_numCombinedCommits = static_cast<long>(counts[PROFILE_COMBINED_COMMITS]);
+      data.m_numSerialized = static_cast<long>(counts[PROFILE_SERIALIZED]);
+      data.m_numReads = static_cast<long>(counts[PROFILE_READS]);
+      data.m_numWrites = static_cast<long>(counts[PROFILE_WRITES]);
+      data.m_retryWaitTime = std::chrono::nanoseconds (counts[PROFILE_RETRY_WAIT_NS]);
+      data.m_commitWaitTime = std::chrono::nanoseconds (counts[PROFILE_COMMIT_WAIT_NS]);
+      data.m_contentionWaitTime = std::chrono::nanoseconds (counts[PROFILE_CONTENTION_WAIT_NS]);
+      return data;
+   }
 
-      struct WValueCoreBaseHash
+   namespace
+   {
+      //Latency tracking, see SetLatencyTracking. The phases are in the same order as the
+      //histograms in WCallSiteLatencies.
+      enum WLatencyPhase
       {
-         size_t operator()(const std::shared_ptr<Internal::WVarCoreBase>& p) const
-         {
-            return m_hash (p.get ());
-         }
-
-         std::hash<Internal::WVarCoreBase*> m_hash;
+         LATENCY_TOTAL,
+         LATENCY_RUN,
+         LATENCY_VALIDATION,
+         LATENCY_LOCK,
+         LATENCY_COMMIT,
+         LATENCY_AFTERS,
+         LATENCY_RETRY_WAIT,
+         NUM_LATENCY_PHASES
       };
 
-      using VarMap =  std::unordered_map<std::shared_ptr<Internal::WVarCoreBase>,
-                                         std::shared_ptr<Internal::WValueBase>,
-                                         WValueCoreBaseHash>;
-   }
-   
-   namespace Internal
-   {
-      //Data used for each transaction
-      struct WTransactionData
+      WLatencyHistogram WCallSiteLatencies::* const LATENCY_HISTOGRAMS[NUM_LATENCY_PHASES] =
       {
-         explicit WTransactionData (WUpgradeableLock& lock);
+         &WCallSiteLatencies::m_total,
+         &WCallSiteLatencies::m_run,
+         &WCallSiteLatencies::m_validation,
+         &WCallSiteLatencies::m_lock,
+         &WCallSiteLatencies::m_commit,
+         &WCallSiteLatencies::m_afters,
+         &WCallSiteLatencies::m_retryWait
+      };
 
-         WTransactionData* CreateChild ();
+      std::atomic<bool> s_trackLatency (false);
 
-         //Don't use this directly, call CreateChild instead
-         explicit WTransactionData (WTransactionData* parent);
+      //A thread's histograms for one call site
+      struct WLatencySite
+      {
+         std::array<std::array<std::atomic<uint64_t>, WLatencyHistogram::NUM_BUCKETS>, NUM_LATENCY_PHASES> m_counts;
+         std::array<std::atomic<uint64_t>, NUM_LATENCY_PHASES> m_totals;
 
-         WTransactionData (const WTransactionData&) = delete;
-         WTransactionData& operator=(const WTransactionData&) = delete;
+         WLatencySite ()
+         {
+            for (auto& phase: m_counts)
+            {
+               for (auto& count: phase)
+               {
+                  count.store (0, std::memory_order_relaxed);
+               }
+            }
+            for (auto& total: m_totals)
+            {
+               total.store (0, std::memory_order_relaxed);
+            }
+         }
 
-         void Activate ();
-         bool IsActive () const;
-         
-         WTransactionData* GetParent () const;
-         WTransactionData* GetChild () const;
+         void Add (const WLatencyPhase phase, const std::chrono::nanoseconds time)
+         {
+            AddToCount (m_counts[phase][WLatencyHistogram::GetBucket (time)], 1);
+            AddToCount (m_totals[phase], static_cast<uint64_t>(time.count ()));
+         }
+      };
 
-         int GetLevel () const;
+      //Each thread keeps its histograms in one of these, keyed by call site. The owning thread
+      //looks up sites without locking since it is the only one that changes the map, it locks
+      //m_mutex when it adds a site so that GetLatencies can walk the map.
+      struct WLatencyRecord
+      {
+         std::mutex m_mutex;
+         std::unordered_map<const char*, std::unique_ptr<WLatencySite>> m_sites;
+         std::atomic<bool> m_inUse;
+         WLatencyRecord* m_next_p;
+      };
+      std::atomic<WLatencyRecord*> s_latencyRecords (nullptr);
 
-         WReadLock& GetReadLock ();
-         WUpgradeableLock& GetUpgradeLock ();
+      using WLatencyThread = WRecordOwner<WLatencyRecord, s_latencyRecords>;
+      THREAD_LOCAL (WLatencyThread, s_latencyThread);
 
-         VarMap& GetGot ();
-         VarMap& GetSet ();
+      WLatencySite* GetLatencySite (const char* callSite)
+      {
+         const auto rec_p = s_latencyThread->Get ();
+         if (!rec_p)
+         {
+            return nullptr;
+         }
+         const auto it = rec_p->m_sites.find (callSite);
+         if (it != rec_p->m_sites.end ())
+         {
+            return it->second.get ();
+         }
+         auto site_p = std::make_unique<WLatencySite>();
+         std::lock_guard<std::mutex> lock (rec_p->m_mutex);
+         return rec_p->m_sites.emplace (callSite, std::move (site_p)).first->second.get ();
+      }
 
-         Internal::WLocalValueBase* GetLocalValue (uint64_t key);
-         void SetLocalValue (uint64_t key, std::unique_ptr<Internal::WLocalValueBase>&& value_p);
+      //The histograms of the top-level transaction that the thread is running, null if its
+      //latencies aren't being tracked.
+      THREAD_LOCAL_WITH_INIT_VALUE (WLatencySite*, s_latencySite_p, nullptr);
 
-         void AddBeforeCommit (WAtomic::WBeforeCommitFunc& after);
-         using WBeforeCommitList = std::list<WAtomic::WBeforeCommitFunc> ;
-         void GetBeforeCommits (WBeforeCommitList& beforeCommit);
+      //Adds the time between its creation and destruction (or Stop) to the given phase of the
+      //current transaction.
+      class WLatencyTimer
+      {
+      public:
+         explicit WLatencyTimer (const WLatencyPhase phase):
+            m_site_p (s_latencySite_p),
+            m_phase (phase)
+         {
+            if (m_site_p)
+            {
+               m_start = std::chrono::steady_clock::now ();
+            }
+         }
 
-         void AddAfter (WAtomic::WAfterFunc& after);
-         using WAfterList = std::list<WAtomic::WAfterFunc>;
-         void GetAfters (WAfterList& afters);
+         ~WLatencyTimer ()
+         {
+            Stop ();
+         }
 
-         void AddOnFail (WAtomic::WOnFailFunc& after);
-         using WOnFailList = std::list<WAtomic::WOnFailFunc>;
-         void RunOnFails ();
-         
-         void MergeToParent ();
-         void MergeGetsToRoot ();
-         void Clear ();
-         void ClearWrites ();
+         WLatencyTimer (const WLatencyTimer&) = delete;
+         WLatencyTimer& operator=(const WLatencyTimer&) = delete;
 
-#ifdef _DEBUG
-         static void* const MARKER_VALUE;
-         void* GetMarker () const;
-#endif //_DEBUG
-         
-      private:         
-#ifdef _DEBUG
-         void* const m_marker;
-#endif //_DEBUG
-         
-         bool m_active;
+         void Stop ()
+         {
+            if (m_site_p)
+            {
+               m_site_p->Add (m_phase, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now () - m_start));
+               m_site_p = nullptr;
+            }
+         }
 
-         //The transaction's level (1 = root transaction)
-         int m_level;
+      private:
+         WLatencySite* m_site_p;
+         const WLatencyPhase m_phase;
+         std::chrono::steady_clock::time_point m_start;
+      };
 
-         WTransactionData* m_parent_p;
-         std::unique_ptr<WTransactionData> m_child_p;         
+      //Adds up the histograms of all the threads, call sites with the same name are merged.
+      std::map<std::string, WCallSiteLatencies> SumLatencies ()
+      {
+         auto sums = std::map<std::string, WCallSiteLatencies>();
+         for (auto rec_p = s_latencyRecords.load (); rec_p; rec_p = rec_p->m_next_p)
+         {
+            std::lock_guard<std::mutex> lock (rec_p->m_mutex);
+            for (const auto& site: rec_p->m_sites)
+            {
+               const auto name = site.first ? site.first : "unknown";
+               auto& sum = sums[name];
+               sum.m_callSite = name;
+               for (auto phase = size_t (0); phase < NUM_LATENCY_PHASES; ++phase)
+               {
+                  auto& histogram = sum.*LATENCY_HISTOGRAMS[phase];
+                  for (auto i = size_t (0); i < WLatencyHistogram::NUM_BUCKETS; ++i)
+                  {
+                     histogram.m_counts[i] += site.second->m_counts[phase][i].load (std::memory_order_relaxed);
+                  }
+                  histogram.m_total += std::chrono::nanoseconds (site.second->m_totals[phase].load (std::memory_order_relaxed));
+               }
+            }
+         }
+         return sums;
+      }
 
-         //locks for this thread.
-         WReadLock m_readLock;
-         WUpgradeableLock& m_upgradeLock;
-         
-         //The WVar's that have been read.
-         VarMap m_got;
-         //The WVar's that have been set.
-         VarMap m_set;
-         
-         //The "transaction local" values
-         std::unordered_map<uint64_t, std::unique_ptr<Internal::WLocalValueBase>> m_locals;
-         
-         //list of functions to run just before the top-level
-         //transaction commits.
-         WBeforeCommitList m_beforeCommits;
+      std::mutex s_latencyMutex;
+      //the histograms when ResetLatencies was last called
+      std::map<std::string, WCallSiteLatencies> s_latencyBase;
+   }
 
-         //list of functions to run after the top-level transaction
-         //commits.
-         WAfterList m_afters;
+   const size_t WLatencyHistogram::NUM_BUCKETS;
 
-         //list of functions to run if transaction fails
-         WOnFailList m_onFails;
-      };
+   WLatencyHistogram::WLatencyHistogram ():
+      m_counts (NUM_BUCKETS, 0),
+      m_total (0)
+   {}
 
-#ifdef _DEBUG
-      void* const WTransactionData::MARKER_VALUE = (void*)0xdeadbeefdeadbeef;
-#endif //_DEBUG
+   uint64_t WLatencyHistogram::GetCount () const
+   {
+      return std::accumulate (m_counts.begin (), m_counts.end (), uint64_t (0));
+   }
 
-      WTransactionData::WTransactionData (WUpgradeableLock& lock):
-#ifdef _DEBUG
-         m_marker (MARKER_VALUE),
-#endif //_DEBUG
-         m_active (false),
-         m_level (1),
-         m_parent_p (nullptr),
-         m_readLock (false),
-         m_upgradeLock (lock)
-      {}
+   std::chrono::nanoseconds WLatencyHistogram::GetMean () const
+   {
+      const auto count = GetCount ();
+      return count > 0 ? m_total/static_cast<std::chrono::nanoseconds::rep>(count) : std::chrono::nanoseconds (0);
+   }
 
-      WTransactionData* WTransactionData::CreateChild ()
+   std::chrono::nanoseconds WLatencyHistogram::GetPercentile (const double percentile) const
+   {
+      const auto count = GetCount ();
+      if (count == 0)
       {
-         if (!m_child_p)
+         return std::chrono::nanoseconds (0);
+      }
+      const auto wanted = std::max (static_cast<uint64_t>(std::ceil (percentile/100.0*count)), uint64_t (1));
+      auto seen = uint64_t (0);
+      for (auto i = size_t (0); i < NUM_BUCKETS; ++i)
+      {
+         seen += m_counts[i];
+         if (seen >= wanted)
          {
-            m_child_p = std::make_unique<WTransactionData>(this);
+            return GetBucketMax (i);
          }
-         
-         return m_child_p.get ();
       }
+      return GetBucketMax (NUM_BUCKETS - 1);
+   }
 
-      WTransactionData::WTransactionData (WTransactionData* parent_p):
-#ifdef _DEBUG
-         m_marker (MARKER_VALUE),
-#endif //_DEBUG
-         m_active (false),
-         m_level (parent_p->m_level + 1),
-         m_parent_p (parent_p),
-         m_readLock (false),
-         m_upgradeLock (parent_p->m_upgradeLock)
-      {}
-      
-      void WTransactionData::Activate ()
+   //Times below SUB_BUCKETS nanoseconds get a bucket each, above that each power of two is split
+   //into SUB_BUCKETS buckets so times are only off by about 6%.
+   namespace
+   {
+      const unsigned int LATENCY_SUB_BUCKET_BITS = 4;
+      const uint64_t LATENCY_SUB_BUCKETS = 1 << LATENCY_SUB_BUCKET_BITS;
+   }
+
+   size_t WLatencyHistogram::GetBucket (const std::chrono::nanoseconds time)
+   {
+      const auto ns = static_cast<uint64_t>(std::max (time.count (), decltype (time.count ()) (0)));
+      if (ns < LATENCY_SUB_BUCKETS)
       {
-         m_active = true;
+         return static_cast<size_t>(ns);
       }
-      
-      bool WTransactionData::IsActive () const
+      auto msb = 0u;
+      auto v = ns;
+      for (auto shift = 32u; shift > 0; shift /= 2)
       {
-         return m_active;
+         if (v >> shift)
+         {
+            v >>= shift;
+            msb += shift;
+         }
       }
-         
-      WTransactionData* WTransactionData::GetParent () const
+      const auto shift = msb - LATENCY_SUB_BUCKET_BITS;
+      const auto bucket = (shift + 1)*LATENCY_SUB_BUCKETS + ((ns >> shift) - LATENCY_SUB_BUCKETS);
+      return static_cast<size_t>(std::min (bucket, uint64_t (NUM_BUCKETS - 1)));
+   }
+
+   std::chrono::nanoseconds WLatencyHistogram::GetBucketMax (const size_t bucket)
+   {
+      if (bucket < LATENCY_SUB_BUCKETS)
       {
-         return m_parent_p;
+         return std::chrono::nanoseconds (bucket);
       }
-      
-      WTransactionData* WTransactionData::GetChild () const
+      const auto shift = bucket/LATENCY_SUB_BUCKETS - 1;
+      const auto sub = bucket%LATENCY_SUB_BUCKETS;
+      return std::chrono::nanoseconds (((LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1);
+   }
+
+   void SetLatencyTracking (const bool on)
+   {
+      s_trackLatency.store (on);
+   }
+
+   std::vector<WCallSiteLatencies> GetLatencies ()
+   {
+      auto sums = SumLatencies ();
+      std::lock_guard<std::mutex> lock (s_latencyMutex);
+      auto latencies = std::vector<WCallSiteLatencies>();
+      for (auto& sum: sums)
       {
-         return m_child_p.get ();
+         const auto base = s_latencyBase.find (sum.first);
+         if (base != s_latencyBase.end ())
+         {
+            for (const auto histogram: LATENCY_HISTOGRAMS)
+            {
+               auto& h = sum.second.*histogram;
+               const auto& b = base->second.*histogram;
+               for (auto i = size_t (0); i < WLatencyHistogram::NUM_BUCKETS; ++i)
+               {
+                  h.m_counts[i] -= b.m_counts[i];
+               }
+               h.m_total -= b.m_total;
+            }
+         }
+         if (sum.second.m_total.GetCount () > 0)
+         {
+            latencies.push_back (std::move (sum.second));
+         }
       }
+      return latencies;
+   }
 
-      int WTransactionData::GetLevel () const
+   std::string FormatLatencies (const std::vector<WCallSiteLatencies>& latencies)
+   {
+      static const char* const names[NUM_LATENCY_PHASES] =
+         {"total", "run", "validation", "lock", "commit", "afters", "retry wait"};
+      const auto toUs = [](const std::chrono::nanoseconds& time)
+         {
+            return std::chrono::duration<double, std::micro>(time).count ();
+         };
+      auto out = std::string ();
+      for (const auto& site: latencies)
       {
-         return m_level;
+         out += str (format ("\t%1%\n") % site.m_callSite);
+         for (auto phase = size_t (0); phase < NUM_LATENCY_PHASES; ++phase)
+         {
+            const auto& h = site.*LATENCY_HISTOGRAMS[phase];
+            if (h.GetCount () == 0)
+            {
+               continue;
+            }
+            out += str (format ("\t\t%1%: count = %2%, mean = %3%us, p50 = %4%us, p90 = %5%us, p99 = %6%us, p99.9 = %7%us\n")
+                        % names[phase]
+                        % h.GetCount ()
+                        % toUs (h.GetMean ())
+                        % toUs (h.GetPercentile (50))
+                        % toUs (h.GetPercentile (90))
+                        % toUs (h.GetPercentile (99))
+                        % toUs (h.GetPercentile (99.9)));
+         }
       }
+      return out;
+   }
 
-      WReadLock& WTransactionData::GetReadLock ()
+   void ResetLatencies ()
+   {
+      auto sums = SumLatencies ();
+      std::lock_guard<std::mutex> lock (s_latencyMutex);
+      s_latencyBase = std::move (sums);
+   }
+
+   namespace
+   {
+      //Tracing, see SetTracing. Each thread writes its events into its own ring buffer, once the
+      //buffer is full the oldest events are overwritten.
+      enum WTraceEventType : uint64_t
       {
-         assert (m_active);
-         return m_readLock;
-      }
-      
-      WUpgradeableLock& WTransactionData::GetUpgradeLock ()
+         //a run of a top-level transaction that committed
+         TRACE_COMMIT,
+         //a run that had a conflict
+         TRACE_ABORT,
+         //a run that called Retry
+         TRACE_RETRY,
+         //validation that passed or failed
+         TRACE_VALIDATE,
+         TRACE_INVALID,
+         //waiting in Retry, that was woken by a change or timed out
+         TRACE_WAKE,
+         TRACE_TIMEOUT
+      };
+
+      const size_t TRACE_EVENTS = 4096;
+
+      std::atomic<bool> s_tracing (false);
+      const auto s_traceClockStart = std::chrono::steady_clock::now ();
+
+      //Nanoseconds since the library was loaded
+      uint64_t TraceNow ()
       {
-         assert (m_active);
-         return m_upgradeLock;
+         return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now () - s_traceClockStart).count ());
       }
 
-      VarMap& WTransactionData::GetGot ()
+      //Only the owning thread writes to an event, WriteTrace uses m_seq to tell whether the event
+      //changed while it was being read. m_seq is odd while the event is being written.
+      struct WTraceEvent
       {
-         assert (m_active);
-         return m_got;
-      }
-      
-      VarMap& WTransactionData::GetSet ()
-      {
-         assert (m_active);
-         return m_set;
-      }      
+         std::atomic<uint64_t> m_seq;
+         std::atomic<uint64_t> m_type;
+         std::atomic<uint64_t> m_start;
+         std::atomic<uint64_t> m_end;
+         std::atomic<uint64_t> m_reads;
+         std::atomic<uint64_t> m_writes;
+         std::atomic<const char*> m_callSite;
+      };
 
-      Internal::WLocalValueBase* WTransactionData::GetLocalValue (uint64_t key)
+      struct WTraceRecord
       {
-         assert (m_active);
-         
-         WTransactionData* data_p = this;
-         while (data_p)
+         std::array<WTraceEvent, TRACE_EVENTS> m_events;
+         //the number of events written so far
+         std::atomic<uint64_t> m_written;
+         std::atomic<bool> m_inUse;
+         WTraceRecord* m_next_p;
+
+         WTraceRecord (): m_written (0)
          {
-            const auto it = data_p->m_locals.find (key);
-            if (it != data_p->m_locals.end ())
+            for (auto& event: m_events)
             {
-               return it->second.get ();
+               event.m_seq.store (0, std::memory_order_relaxed);
             }
-            data_p = data_p->m_parent_p;
          }
-         
-         return nullptr;         
+      };
+      std::atomic<WTraceRecord*> s_traceRecords (nullptr);
+
+      using WTraceThread = WRecordOwner<WTraceRecord, s_traceRecords>;
+      THREAD_LOCAL (WTraceThread, s_traceThread);
+
+      //The call site of the top-level transaction that the thread is running and when its current
+      //run started.
+      THREAD_LOCAL_WITH_INIT_VALUE (const char*, s_traceSite_p, nullptr);
+      THREAD_LOCAL_WITH_INIT_VALUE (uint64_t, s_traceRunStart, 0);
+
+      void Trace (const WTraceEventType type, const uint64_t start, const size_t reads, const size_t writes)
+      {
+         const auto rec_p = s_traceThread->Get ();
+         if (!rec_p)
+         {
+            return;
+         }
+         const auto index = rec_p->m_written.load (std::memory_order_relaxed);
+         auto& event = rec_p->m_events[index%TRACE_EVENTS];
+         event.m_seq.store (2*index + 1, std::memory_order_relaxed);
+         std::atomic_thread_fence (std::memory_order_release);
+         event.m_type.store (type, std::memory_order_relaxed);
+         event.m_start.store (start, std::memory_order_relaxed);
+         event.m_end.store (TraceNow (), std::memory_order_relaxed);
+         event.m_reads.store (reads, std::memory_order_relaxed);
+         event.m_writes.store (writes, std::memory_order_relaxed);
+         event.m_callSite.store (s_traceSite_p, std::memory_order_relaxed);
+         event.m_seq.store (2*index + 2, std::memory_order_release);
+         rec_p->m_written.store (index + 1, std::memory_order_release);
       }
-      
-      void WTransactionData::SetLocalValue (uint64_t key, std::unique_ptr<Internal::WLocalValueBase>&& value_p)
+
+      //Traces the end of the current run of the top-level transaction
+      void TraceRun (const WTraceEventType type, const size_t reads, const size_t writes)
       {
-         assert (m_active);
-         m_locals[key] = std::move (value_p);
+         //the run could have started before tracing was turned on
+         if (s_tracing.load (std::memory_order_relaxed) && s_traceRunStart != 0)
+         {
+            Trace (type, s_traceRunStart, reads, writes);
+         }
       }
 
-      void WTransactionData::AddBeforeCommit (WAtomic::WBeforeCommitFunc& beforeCommit)
+      //Gets the time that something being traced started, 0 if tracing is off.
+      uint64_t TraceStart ()
       {
-         assert (m_active);
-         m_beforeCommits.push_back (beforeCommit);
+         return s_tracing.load (std::memory_order_relaxed) ? TraceNow () : 0;
       }
 
-      void WTransactionData::GetBeforeCommits (WBeforeCommitList& beforeCommits)
+      std::string EscapeJson (const char* str)
       {
-         assert (m_active);
-         beforeCommits.swap (m_beforeCommits);
+         auto escaped = std::string ();
+         for (auto c_p = str; *c_p; ++c_p)
+         {
+            if (*c_p == '"' || *c_p == '\\')
+            {
+               escaped += '\\';
+            }
+            escaped += *c_p;
+         }
+         return escaped;
       }
+   }
+
+   void SetTracing (const bool on)
+   {
+      s_tracing.store (on);
+   }
 
-      void WTransactionData::AddAfter (WAtomic::WAfterFunc& after)
+   void WriteTrace (std::ostream& out)
+   {
+      static const char* const names[] = {"commit", "abort", "retry", "validate", "validate", "retry wait", "retry wait"};
+      static const char* const results[] = {"commit", "abort", "retry", "valid", "invalid", "woken", "timed out"};
+      const auto toUs = [](const uint64_t ns) {return str (format ("%.3f") % (ns/1000.0));};
+      
+      out << "{\"traceEvents\":[";
+      auto first = true;
+      auto tid = 0;
+      for (auto rec_p = s_traceRecords.load (); rec_p; rec_p = rec_p->m_next_p)
       {
-         assert (m_active);
-         m_afters.push_back (after);
+         ++tid;
+         out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+             << ",\"args\":{\"name\":\"STM thread " << tid << "\"}}";
+         first = false;
+         const auto written = rec_p->m_written.load (std::memory_order_acquire);
+         for (auto index = (written > TRACE_EVENTS ? written - TRACE_EVENTS : 0); index < written; ++index)
+         {
+            const auto& event = rec_p->m_events[index%TRACE_EVENTS];
+            const auto seq = event.m_seq.load (std::memory_order_acquire);
+            const auto type = event.m_type.load (std::memory_order_relaxed);
+            const auto start = event.m_start.load (std::memory_order_relaxed);
+            const auto end = event.m_end.load (std::memory_order_relaxed);
+            const auto reads = event.m_reads.load (std::memory_order_relaxed);
+            const auto writes = event.m_writes.load (std::memory_order_relaxed);
+            const auto callSite_p = event.m_callSite.load (std::memory_order_relaxed);
+            std::atomic_thread_fence (std::memory_order_acquire);
+            //skip events that have been overwritten
+            if (seq != 2*index + 2 || event.m_seq.load (std::memory_order_relaxed) != seq)
+            {
+               continue;
+            }
+            const auto isRun = (type == TRACE_COMMIT || type == TRACE_ABORT || type == TRACE_RETRY);
+            out << ",\n{\"name\":\"" << (isRun ? (callSite_p ? EscapeJson (callSite_p) : std::string ("transaction")) : names[type])
+                << "\",\"cat\":\"stm\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                << ",\"ts\":" << toUs (start) << ",\"dur\":" << toUs (end - start)
+                << ",\"args\":{\"result\":\"" << results[type] << "\"";
+            if (type != TRACE_WAKE && type != TRACE_TIMEOUT)
+            {
+               out << ",\"reads\":" << reads;
+            }
+            if (isRun)
+            {
+               out << ",\"writes\":" << writes;
+            }
+            out << "}}";
+         }
       }
+      out << "\n]}\n";
+   }
 
-      void WTransactionData::GetAfters (WAfterList& afters)
+   bool WriteTrace (const std::string& fileName)
+   {
+      std::ofstream out (fileName);
+      if (!out)
       {
-         assert (m_active);
-         afters.swap (m_afters);
+         return false;
       }
+      WriteTrace (out);
+      return static_cast<bool>(out);
+   }
 
-      void WTransactionData::AddOnFail (WAtomic::WOnFailFunc& onFail)
+   namespace
+   {
+      
+      //exception thrown by Retry() to signal AtomicallyImpl that it should
+      //"retry" the current operation. 
+      struct WRetryException
       {
-         assert (m_active);
-         m_onFails.push_back (onFail);
+         WRetryException(const WTimeArg& timeout):
+            m_timeout(timeout)
+         {}
+
+         const WTimeArg m_timeout;
+      };   
+   }
+   
+   WCantContinueException::WCantContinueException(const std::string& msg):
+      WException(msg)
+   {}
+   
+   WMaxConflicts::WMaxConflicts ():
+      m_max (UNLIMITED),
+      m_resolution (WConflictResolution::THROW)
+   {}
+   
+   WMaxConflicts::WMaxConflicts (const unsigned int m, const WConflictResolution res) :
+      m_max(m),
+      m_resolution (res)
+   {}
+
+   WMaxRetries::WMaxRetries ():
+      m_value (UNLIMITED)
+   {}
+   
+   WMaxRetries::WMaxRetries (const unsigned int max):
+      m_value (max)
+   {}
+
+   WMaxRetryWait::WMaxRetryWait ()
+   {}
+   
+   WMaxRetryWait::WMaxRetryWait (const WTimeArg wait):
+      m_value (wait)
+   {}
+
+   WReadOnly::WReadOnly ():
+      m_value (false)
+   {}
+   
+   WReadOnly::WReadOnly (const bool readOnly):
+      m_value (readOnly)
+   {}
+
+   WElastic::WElastic ():
+      m_value (0)
+   {}
+   
+   WElastic::WElastic (const unsigned int window):
+      m_value (window)
+   {}
+
+   WCallSite::WCallSite ():
+      m_value (nullptr)
+   {}
+   
+   WCallSite::WCallSite (const char* name):
+      m_value (name)
+   {}
+
+   WVarHistory::WVarHistory (const size_t maxVersions):
+      m_maxVersions (maxVersions)
+   {}
+
+   WContentionPolicy::~WContentionPolicy ()
+   {}
+
+   void WContentionPolicy::OnFinish (WContentionInfo&)
+   {}
+
+   namespace
+   {
+      //Hands out the timestamps for transactions that use a contention policy
+      std::atomic<uint64_t> s_contentionTimestamp (1);
+
+      //The variable that caused the current thread's last conflict, set wherever validation fails
+      //(see WContentionInfo::m_conflict).
+      THREAD_LOCAL_WITH_INIT_VALUE (const Internal::WVarCoreBase*, s_conflict_p, nullptr);
+
+      void NoteConflict (const Internal::WVarCoreBase* core_p)
+      {
+         s_conflict_p = core_p;
       }
 
-      void WTransactionData::RunOnFails ()
+      const Internal::WVarCoreBase* TakeConflict ()
       {
-         if (m_active)
+         const Internal::WVarCoreBase* const core_p = s_conflict_p;
+         s_conflict_p = nullptr;
+         return core_p;
+      }
+
+      //The names of the variables that have been given one, see WVar::SetName.
+      std::mutex s_varNamesMutex;
+      std::unordered_map<const Internal::WVarCoreBase*, std::string> s_varNames;
+
+      //Conflict attribution, see SetConflictAttribution. The call sites are keyed by their
+      //pointers, call sites with the same name are only merged when reporting.
+      struct WConflictCounts
+      {
+         std::string m_name;
+         long m_aborts;
+         std::unordered_map<const char*, long> m_callSites;
+      };
+      std::atomic<bool> s_attributeConflicts (false);
+      std::mutex s_hotVarsMutex;
+      std::unordered_map<const void*, WConflictCounts> s_hotVars;
+      //The counts of the variables that have been destroyed, by name. Keeping them under their
+      //addresses would mix them up with later variables at the same address.
+      std::unordered_map<std::string, WConflictCounts> s_destroyedHotVars;
+
+      void AddCounts (WConflictCounts& to, const WConflictCounts& from)
+      {
+         to.m_aborts += from.m_aborts;
+         for (const auto& site: from.m_callSites)
          {
-            for (const WAtomic::WOnFailFunc& func: m_onFails)
-            {
-               func ();
-            }
+            to.m_callSites[site.first] += site.second;
          }
-         m_onFails.clear ();
       }
 
-      void WTransactionData::MergeToParent ()
+      //Records an abort caused by the given variable (null if that isn't known) of the transaction
+      //started from the given call site.
+      void AttributeConflict (const Internal::WVarCoreBase* core_p, const WCallSite& callSite)
       {
-         assert (m_active);
-         assert (m_parent_p);
-
-         for (VarMap::value_type& value: m_got)
+         if (!s_attributeConflicts.load (std::memory_order_relaxed))
          {
-            m_parent_p->m_got[std::get<0>(value)] = std::move (std::get<1>(value));
+            return;
          }
-         for (VarMap::value_type& value: m_set)
+         auto name = std::string ();
+         if (core_p)
          {
-            m_parent_p->m_set[std::get<0>(value)] = std::move (std::get<1>(value));
+            std::lock_guard<std::mutex> lock (s_varNamesMutex);
+            const auto it = s_varNames.find (core_p);
+            if (it != s_varNames.end ())
+            {
+               name = it->second;
+            }
          }
-         for (auto& val: m_locals)
+         std::lock_guard<std::mutex> lock (s_hotVarsMutex);
+         auto& counts = s_hotVars.emplace (core_p, WConflictCounts {std::string (), 0, {}}).first->second;
+         if (core_p)
          {
-            m_parent_p->m_locals[val.first] = std::move (val.second);
+            core_p->m_attributed = true;
+         }
+         if (!name.empty ())
+         {
+            counts.m_name = std::move (name);
          }
+         ++counts.m_aborts;
+         ++counts.m_callSites[callSite.m_value];
+      }
+   }
 
-         m_parent_p->m_beforeCommits.splice (m_parent_p->m_beforeCommits.end (), m_beforeCommits);
-         m_parent_p->m_afters.splice (m_parent_p->m_afters.end (), m_afters);
-         m_parent_p->m_onFails.splice (m_parent_p->m_onFails.end (), m_onFails);
-         
-         Clear ();
+   namespace Internal
+   {
+      void SetVarName (WVarCoreBase& core, const std::string& name)
+      {
+         std::lock_guard<std::mutex> lock (s_varNamesMutex);
+         s_varNames[&core] = name;
+         core.m_named = true;
       }
 
-      void WTransactionData::MergeGetsToRoot ()
+      std::string GetVarName (const WVarCoreBase& core)
       {
-         assert (m_active);
-         assert (m_parent_p);
+         std::lock_guard<std::mutex> lock (s_varNamesMutex);
+         const auto it = s_varNames.find (&core);
+         return it != s_varNames.end () ? it->second : std::string ();
+      }
+   }
 
-         WTransactionData* root_p = m_parent_p;
-         while (root_p->m_parent_p)
-         {
-            root_p = root_p->m_parent_p;
-         }
-         
-         for (VarMap::value_type& value: m_got)
-         {
-            m_parent_p->m_got[std::get<0>(value)] = std::move (std::get<1>(value));
-         }
+   void SetConflictAttribution (const bool on)
+   {
+      s_attributeConflicts.store (on);
+   }
 
-         Clear ();
-      }
-      
-      void WTransactionData::Clear ()
+   std::vector<WHotVariable> GetHotVariables ()
+   {
+      auto vars = std::vector<WHotVariable>();
+      const auto addVar = [&](const void* var_p, const std::string& name, const WConflictCounts& counts, const bool destroyed)
+         {
+            auto callSites = std::map<std::string, long>();
+            for (const auto& site: counts.m_callSites)
+            {
+               callSites[site.first ? site.first : "unknown"] += site.second;
+            }
+            vars.push_back (WHotVariable {var_p, name, counts.m_aborts, destroyed, std::vector<std::pair<std::string, long>> (callSites.begin (), callSites.end ())});
+         };
       {
-         if (!m_got.empty ())
+         std::lock_guard<std::mutex> lock (s_hotVarsMutex);
+         vars.reserve (s_hotVars.size () + s_destroyedHotVars.size ());
+         for (const auto& hot: s_hotVars)
          {
-            m_got.clear ();
+            addVar (hot.first, hot.second.m_name, hot.second, false);
          }
-         ClearWrites ();
-         if (!m_onFails.empty ())
+         for (const auto& hot: s_destroyedHotVars)
          {
-            m_onFails.clear ();
+            addVar (nullptr, hot.first, hot.second, true);
          }
-         m_active = false;
-      }      
-
-      void WTransactionData::ClearWrites()
+      }
+      for (auto& var: vars)
       {
-         if (!m_set.empty ())
-         {
-            m_set.clear ();
-         }
+         std::stable_sort (var.m_callSites.begin (), var.m_callSites.end (),
+                           [](const std::pair<std::string, long>& a, const std::pair<std::string, long>& b)
+                           {
+                              return a.second > b.second;
+                           });
+      }
+      std::sort (vars.begin (), vars.end (),
+                 [](const WHotVariable& a, const WHotVariable& b)
+                 {
+                    return a.m_aborts > b.m_aborts;
+                 });
+      return vars;
+   }
 
-         //For some reason we are getting random crashes when clearing
-         //the after list when the list is empty so only clear it when it
-         //is non-empty. 
-         if (!m_beforeCommits.empty ())
+   std::string FormatHotVariables (const std::vector<WHotVariable>& vars)
+   {
+      auto out = std::string ();
+      for (const auto& var: vars)
+      {
+         const auto name = (var.m_destroyed ? (var.m_name.empty () ? std::string ("destroyed variables") : var.m_name + " (destroyed)") :
+                            !var.m_name.empty () ? var.m_name :
+                            var.m_var ? str (format ("%1%") % var.m_var) : std::string ("unknown"));
+         out += str (format ("\t%1%: %2% aborts\n") % name % var.m_aborts);
+         for (const auto& site: var.m_callSites)
          {
-            m_beforeCommits.clear();
+            out += str (format ("\t\t%1%: %2%\n") % site.first % site.second);
          }
+      }
+      return out;
+   }
 
-         if (!m_afters.empty ())
-         {
-            m_afters.clear();
-         }
+   void ResetHotVariables ()
+   {
+      std::lock_guard<std::mutex> lock (s_hotVarsMutex);
+      s_hotVars.clear ();
+      s_destroyedHotVars.clear ();
+   }
 
-         if (!m_locals.empty ())
-         {
-            m_locals.clear ();
-         }
+   namespace
+   {
+      
+      THREAD_LOCAL_WITH_INIT_VALUE (uint32_t, s_backoffRandom, 0);
 
-         if (!m_upgradeLock.locked ())
-         {
-            m_readLock.UnlockAll ();
-         }
-         else if (m_level == 1)
+      //xorshift, good enough for spreading out backoff times
+      uint32_t GetBackoffRandom ()
+      {
+         auto x = s_backoffRandom;
+         if (x == 0)
          {
-            m_upgradeLock.UnlockAll ();
+            x = static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id ())) | 1;
          }
+         x ^= x << 13;
+         x ^= x >> 17;
+         x ^= x << 5;
+         s_backoffRandom = x;
+         return x;
       }
 
-#ifdef _DEBUG
-      void* WTransactionData::GetMarker () const
+      //The longest wait (in microseconds) after the given number of conflicts, doubling with each
+      //conflict.
+      int64_t GetBackoffLimit (const unsigned int conflicts, const int64_t minDelay, const int64_t maxDelay)
       {
-         return m_marker;
+         const auto shift = std::min (conflicts ? conflicts - 1 : 0, 20u);
+         return std::min (minDelay << shift, maxDelay);
       }
-#endif //_DEBUG
-   }
-   
 
-   namespace 
-   {      
-      //Stores the transaction data for each thread
-      class WTransactionDataList
+      class WRandomBackoffPolicy : public WContentionPolicy
       {
       public:
-         WTransactionDataList ();
-         
-         Internal::WTransactionData* Get ();
-         Internal::WTransactionData* GetNew ();
+         WRandomBackoffPolicy (const std::chrono::microseconds minDelay, const std::chrono::microseconds maxDelay):
+            m_minDelay (std::max (minDelay.count (), int64_t (1))),
+            m_maxDelay (std::max (maxDelay.count (), m_minDelay))
+         {}
 
-         class WPushGuard
+         void OnConflict (WContentionInfo& info) override
          {
-         public:
-            WPushGuard (std::unique_ptr<Internal::WTransactionData>&& root_p, Internal::WTransactionData* cur_p);
-            WPushGuard (WPushGuard&& g);
-            ~WPushGuard ();
-            
-         private:
-            std::unique_ptr<Internal::WTransactionData> m_root_p;
-            Internal::WTransactionData* m_cur_p;
-         };
-         friend WPushGuard;
-         WPushGuard Push ();
-         
-         void MergeToParent ();
-         void Abandon ();
+            const auto limit = GetBackoffLimit (info.m_conflicts, m_minDelay, m_maxDelay);
+            std::this_thread::sleep_for (std::chrono::microseconds (GetBackoffRandom () % (limit + 1)));
+         }
 
-         void CheckIntegrity () const;
-         
       private:
-         Internal::WTransactionData* GetNewNoActivate ();
-
-         std::unique_ptr<Internal::WTransactionData> m_root_p;
-         Internal::WTransactionData* m_cur_p;
-         WUpgradeableLock m_lock;
+         const int64_t m_minDelay;
+         const int64_t m_maxDelay;
       };
 
-      THREAD_LOCAL (WTransactionDataList, s_transData_p);
-
-      WTransactionDataList::WTransactionDataList ():
-         m_cur_p (nullptr),
-         m_lock (false)
-      {}
-
-      Internal::WTransactionData* WTransactionDataList::Get ()
+      //Base for the policies where conflicting transactions defer to the one with the highest
+      //priority. We can't tell which transaction caused a conflict so the winner is the highest
+      //priority transaction that is currently having conflicts. It runs again straight away while
+      //everyone else that conflicts waits for it to finish (or for a while, in case it is blocked).
+      class WPriorityPolicy : public WContentionPolicy
       {
-         if (m_cur_p)
+      public:
+         WPriorityPolicy ():
+            m_winner (0)
+         {}
+
+         void OnConflict (WContentionInfo& info) override
          {
-            return m_cur_p;
+            //m_policyData holds the priority that we claimed the win with
+            const auto priority = GetPriority (info);
+            auto winner = m_winner.load ();
+            while (winner == info.m_policyData || priority > winner)
+            {
+               if (m_winner.compare_exchange_weak (winner, priority))
+               {
+                  info.m_policyData = priority;
+                  return;
+               }
+            }
+
+            info.m_policyData = 0;
+            const auto limit = std::chrono::microseconds (GetBackoffLimit (info.m_conflicts, 1, 1000));
+            const auto end = std::chrono::steady_clock::now () + limit;
+            while (m_winner.load (std::memory_order_relaxed) == winner && std::chrono::steady_clock::now () < end)
+            {
+               std::this_thread::yield ();
+            }
          }
-         else
+
+         void OnFinish (WContentionInfo& info) override
          {
-            return GetNewNoActivate ();
+            if (info.m_policyData)
+            {
+               auto winner = info.m_policyData;
+               m_winner.compare_exchange_strong (winner, 0);
+            }
          }
-      }
 
-      Internal::WTransactionData* WTransactionDataList::GetNew ()
-      {
-         Internal::WTransactionData* data_p = GetNewNoActivate ();
-         data_p->Activate();
-         return data_p;
-      }
+      private:
+         //Higher values win, must not return 0.
+         virtual uint64_t GetPriority (const WContentionInfo& info) const = 0;
 
-      Internal::WTransactionData* WTransactionDataList::GetNewNoActivate ()
+         std::atomic<uint64_t> m_winner;
+      };
+
+      class WKarmaPolicy : public WPriorityPolicy
       {
-         CheckIntegrity ();
-         if (!m_cur_p)
-         {
-            assert (!m_root_p);
-            m_root_p = std::make_unique<Internal::WTransactionData>(m_lock);
-            m_cur_p = m_root_p.get ();
-         }
-         else if (m_cur_p->IsActive ())
+         uint64_t GetPriority (const WContentionInfo& info) const override
          {
-            m_cur_p = m_cur_p->CreateChild ();
-            assert (!m_cur_p->IsActive ());
+            //ties go to the older transaction
+            const auto maxKarma = (uint64_t (1) << 40) - 1;
+            const auto karma = std::min (static_cast<uint64_t>(info.m_karma), maxKarma);
+            return (karma << 24) | (0xffffff - (info.m_timestamp & 0xffffff)) | 1;
          }
-         //Note: if m_cur_p wasn't active above then we just use it
-         CheckIntegrity ();
-         
-         return m_cur_p;
-      }
-
-      WTransactionDataList::WPushGuard::WPushGuard (std::unique_ptr<Internal::WTransactionData>&& root_p, Internal::WTransactionData* cur_p):
-         m_root_p (std::move (root_p)),
-         m_cur_p (cur_p)
-      {}
-      
-      WTransactionDataList::WPushGuard::WPushGuard (WPushGuard&& g):
-         m_root_p (std::move (g.m_root_p)),
-         m_cur_p (g.m_cur_p)
-      {}
-      
-      WTransactionDataList::WPushGuard::~WPushGuard ()
-      {
-         s_transData_p->m_root_p = std::move (m_root_p);
-         s_transData_p->m_cur_p = m_cur_p;
-      }
+      };
 
-      WTransactionDataList::WPushGuard WTransactionDataList::Push ()
+      class WTimestampPolicy : public WPriorityPolicy
       {
-         CheckIntegrity ();
-         auto oldRoot_p = std::move (m_root_p);
-         auto oldCur_p = m_cur_p;
-         m_root_p.reset ();
-         m_cur_p = nullptr;
-         return WPushGuard (std::move (oldRoot_p), oldCur_p);
-      }
+         uint64_t GetPriority (const WContentionInfo& info) const override
+         {
+            return std::numeric_limits<uint64_t>::max () - info.m_timestamp;
+         }
+      };
 
-      void WTransactionDataList::MergeToParent ()
+      //Runs transactions that keep conflicting over the same variable one at a time. The variables
+      //that conflicts are over are hashed into lanes and the policy keeps track of how often each
+      //lane has had conflicts lately. Once a lane is hot, a transaction that conflicts over one of
+      //its variables takes the lane and the rest wait for it to finish before running again.
+      //Transactions with conflicts over other variables carry on in parallel. The wait is limited
+      //(like WPriorityPolicy) since the transaction holding the lane could be waiting in Retry.
+      class WSerializePolicy : public WContentionPolicy
       {
-         CheckIntegrity ();
-         assert (m_cur_p->IsActive ());
-         assert (m_cur_p->GetParent ());
-         if (m_cur_p->GetParent ())
+      public:
+         void OnConflict (WContentionInfo& info) override
          {
-            m_cur_p->MergeToParent ();
-            m_cur_p = m_cur_p->GetParent ();
-            CheckIntegrity ();
+            if (!info.m_conflict)
+            {
+               //We don't know what the conflict was over. Any lane that we hold is kept, we'll
+               //probably conflict over the same thing again.
+               return;
+            }
+            const auto index = std::hash<const void*>()(info.m_conflict) % NUM_LANES;
+            auto& lane = m_lanes[index];
+            if (info.m_policyData == index + 1)
+            {
+               //we already hold the lane
+               return;
+            }
+            Release (info);
+            if (!IsHot (lane))
+            {
+               return;
+            }
+
+            const auto limit = std::chrono::microseconds (GetBackoffLimit (info.m_conflicts, 10, 10000));
+            const auto end = std::chrono::steady_clock::now () + limit;
+            for (;;)
+            {
+               auto owner = uint64_t (0);
+               if (lane.m_owner.compare_exchange_strong (owner, info.m_timestamp))
+               {
+                  info.m_policyData = index + 1;
+                  Count (PROFILE_SERIALIZED);
+                  return;
+               }
+               if (std::chrono::steady_clock::now () >= end)
+               {
+                  //run anyway, without the lane
+                  return;
+               }
+               std::this_thread::yield ();
+            }
          }
-      }
 
-      void WTransactionDataList::Abandon ()
-      {
-         assert (m_cur_p);
-         if (!m_cur_p)
+         void OnFinish (WContentionInfo& info) override
          {
-            return;
+            Release (info);
          }
-         m_cur_p->Clear ();
+
+      private:
+         static const size_t NUM_LANES = 64;
+         //A lane is hot once it has had this many conflicts without a quiet period between them.
+         static const unsigned int HOT_CONFLICTS = 4;
+         static const int64_t QUIET_PERIOD_US = 1000;
          
-         if (m_cur_p->GetParent ())
+         struct alignas (64) WLane
          {
-            m_cur_p = m_cur_p->GetParent ();
-            CheckIntegrity ();
-         }         
-      }
-
-//#define CHECK_TLS_INTEGRITY
-#ifdef CHECK_TLS_INTEGRITY
-
-      void WTransactionDataList::CheckIntegrity () const
-      {
-         if (m_cur_p)
-         {            
-            Internal::WTransactionData* cur_p = m_cur_p;
-            Internal::WTransactionData* parent_p = cur_p->GetParent ();
-            assert (cur_p->GetMarker () == Internal::WTransactionData::MARKER_VALUE);
+            WLane (): m_owner (0), m_lastConflict (0), m_heat (0) {}
             
-            while (parent_p)
+            //the timestamp of the transaction that holds the lane, 0 if nobody does
+            std::atomic<uint64_t> m_owner;
+            //in microseconds since the steady clock's epoch
+            std::atomic<int64_t> m_lastConflict;
+            std::atomic<unsigned int> m_heat;
+         };
+         std::array<WLane, NUM_LANES> m_lanes;
+
+         //Records a conflict in the given lane and returns whether the lane is hot. The counts are
+         //only approximate when several threads conflict at once, which is fine for this.
+         static bool IsHot (WLane& lane)
+         {
+            const auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+            const auto last = lane.m_lastConflict.exchange (now, std::memory_order_relaxed);
+            if (now - last > QUIET_PERIOD_US)
             {
-               assert (parent_p->GetMarker () == Internal::WTransactionData::MARKER_VALUE);
-               assert (parent_p->GetChild () == cur_p);
-               assert (parent_p->GetLevel () == (cur_p->GetLevel () - 1));
-               cur_p = parent_p;
-               parent_p = cur_p->GetParent ();
+               lane.m_heat.store (1, std::memory_order_relaxed);
+               return false;
+            }
+            const auto heat = lane.m_heat.load (std::memory_order_relaxed);
+            if (heat < HOT_CONFLICTS)
+            {
+               lane.m_heat.store (heat + 1, std::memory_order_relaxed);
+               return false;
             }
+            return true;
+         }
 
-            cur_p = m_cur_p;
-            Internal::WTransactionData* child_p = cur_p->GetChild ();
-            while (child_p)
+         void Release (WContentionInfo& info)
+         {
+            if (info.m_policyData)
             {
-               assert (child_p->GetMarker () == Internal::WTransactionData::MARKER_VALUE);
-               assert (child_p->GetParent () == cur_p);
-               assert (child_p->GetLevel () == (cur_p->GetLevel () + 1));
-               cur_p = child_p;
-               child_p = cur_p->GetChild ();
+               auto owner = info.m_timestamp;
+               m_lanes[info.m_policyData - 1].m_owner.compare_exchange_strong (owner, 0);
+               info.m_policyData = 0;
             }
          }
-      }
-      
-#else
-      void WTransactionDataList::CheckIntegrity () const
-      {}
-#endif //CHECK_TLS_INTEGRITY
+      };
 
+      //The built in priority policies are shared by everyone that uses them, the returned pointers
+      //don't own them so that copying them doesn't touch a shared reference count.
+      template <typename Policy_t>
+      std::shared_ptr<WContentionPolicy> GetSharedPolicy ()
+      {
+         static Policy_t policy;
+         return std::shared_ptr<WContentionPolicy>(std::shared_ptr<WContentionPolicy>(), &policy);
+      }
    }
-
-   WTimeArg::WTimeArg ()
+   
+   WContentionManager::WContentionManager ()
    {}
    
-   WTimeArg::WTimeArg (const time_point& t):
-      m_time_o (t)
+   WContentionManager::WContentionManager (std::shared_ptr<WContentionPolicy> policy_p):
+      m_policy_p (std::move (policy_p))
    {}
 
-   WTimeArg WTimeArg::Unlimited ()
+   WContentionManager WContentionManager::Backoff (const std::chrono::microseconds minDelay, const std::chrono::microseconds maxDelay)
    {
-      return WTimeArg ();
+      return WContentionManager (std::make_shared<WRandomBackoffPolicy>(minDelay, maxDelay));
    }
-
-   bool WTimeArg::IsUnlimited () const
+   
+   WContentionManager WContentionManager::Karma ()
    {
-      return !m_time_o;
+      return WContentionManager (GetSharedPolicy<WKarmaPolicy>());
    }
-
-   bool WTimeArg::operator<(const WTimeArg& t) const
+   
+   WContentionManager WContentionManager::Timestamp ()
    {
-      if (IsUnlimited ())
-      {
-         //nothing is less than unlimited
-         return false;
-      }
-      else if (!t.IsUnlimited ())
-      {
-         return (*m_time_o < *t.m_time_o);
-      }
-      else
-      {
-         //something limited is always less than an unlimited value
-         return true;
-      }
+      return WContentionManager (GetSharedPolicy<WTimestampPolicy>());
    }
 
-   namespace Internal
+   WContentionManager WContentionManager::Serialize ()
    {
-      
-#ifdef _DEBUG
+      return WContentionManager (GetSharedPolicy<WSerializePolicy>());
+   }
 
-      bool ReadLocked()
-      {
-         return s_readMutexReadLocked;
-      }
-      
-      bool UpgradeLocked()
-      {
-         return s_readMutexUpgradeLocked;
-      }
+   namespace
+   {
       
-      bool WriteLocked()
+      struct WReadLockTraits
       {
-         return s_readMutexWriteLocked;
-      }      
+         using LockType = boost::shared_lock<Internal::WReadMutex>;
+
+         static void DoLock ()
+         {
+#ifdef _DEBUG            
+            s_readMutexReadLocked = true;
 #endif //_DEBUG
+         }         
 
-      WValueBase::WValueBase (const size_t version):
-         m_version (version)
-      {}
+         static void DoUnlock ()
+         {
+#ifdef _DEBUG            
+            s_readMutexReadLocked = false;
+#endif //_DEBUG
+         }
+      };
 
-      WValueBase::~WValueBase ()
+      struct WUpgradeableLockTraits
       {
-      }
+         using LockType = boost::upgrade_lock<Internal::WReadMutex>;
 
-      WVarCoreBase::~WVarCoreBase ()
-      {
-      }
+         static void DoLock ()
+         {
+#ifdef _DEBUG            
+            s_readMutexUpgradeLocked = true;
+#endif //_DEBUG
+         }         
 
-   }
+         static void DoUnlock ()
+         {
+#ifdef _DEBUG            
+            s_readMutexUpgradeLocked = false;
+#endif //_DEBUG
+         }
+      };
+
+      template <typename LockTraits_t>
+      struct WLockImpl
+      {
+         explicit WLockImpl(bool doLock = true);
+            
+         //these methods must match the boost locking convention
+         void lock();
+         bool try_lock();
+         bool locked() const {return m_lock.owns_lock ();}
+         void unlock(const int i = 1);
+         
+         void UnlockAll ();
+            
+         int m_count;
+         using Lock = typename LockTraits_t::LockType;
+         Lock m_lock;
+
+#ifdef _DEBUG
+         std::thread::id m_threadId;
+         bool m_writeLocked;
+#endif //_DEBUG
+      };
+
+      template <typename LockTraits_t>
+      WLockImpl<LockTraits_t>::WLockImpl (bool doLock):
+         m_count(0),
+         m_lock(s_readMutex, boost::defer_lock_t())
+#ifdef _DEBUG
+         ,m_threadId (std::this_thread::get_id ())
+         ,m_writeLocked(false)
+#endif //_DEBUG
+      {
+         if(doLock)
+         {
+            lock();
+         }
+      }
+
+      template <typename LockTraits_t>
+      void WLockImpl<LockTraits_t>::lock()
+      {
+         assert (m_threadId == std::this_thread::get_id ());
+         if(m_count == 0)
+         {
+            if(m_lock.owns_lock())
+            {
+               throw boost::lock_error();
+            }
+            m_lock.lock();
+            LockTraits_t::DoLock ();
+         }
+         ++m_count;
+      }
+
+      template <typename LockTraits_t>
+      bool WLockImpl<LockTraits_t>::try_lock()
+      {
+         assert (m_threadId == std::this_thread::get_id ());
+         if(m_count == 0)
+         {
+            if(m_lock.owns_lock())
+            {
+               throw boost::lock_error();
+            }
+            if(!m_lock.try_lock())
+            {
+               return false;
+            }
+            LockTraits_t::DoLock ();
+         }
+         ++m_count;
+         return true;
+      }
+
+      template <typename LockTraits_t>
+      void WLockImpl<LockTraits_t>::unlock(const int i)
+      {
+         assert (m_threadId == std::this_thread::get_id ());
+         if (m_count == 0)
+         {
+            return;
+         }
+
+         if(!m_lock.owns_lock())
+         {
+            throw boost::lock_error();
+         }
+
+         assert(m_count >= i);
+         m_count -= i;
+         assert(m_count >= 0);
+         if(m_count == 0)
+         {
+            m_lock.unlock();
+            LockTraits_t::DoUnlock ();
+         }
+      }
+
+      template <typename LockTraits_t>
+      void WLockImpl<LockTraits_t>::UnlockAll ()
+      {
+         assert (m_threadId == std::this_thread::get_id ());
+         unlock (m_count);
+      }
+      
+      using WReadLock = WLockImpl<WReadLockTraits>;
+      using WUpgradeableLock = WLockImpl<WUpgradeableLockTraits>;
+
+#ifndef WSTM_CLOCK_ENGINE
+      class WWriteLock
+      {
+      public:
+         WWriteLock(WUpgradeableLock& readLock);
+         ~WWriteLock();
+         
+      private:
+#ifdef _DEBUG
+         WUpgradeableLock& m_readLock;
+#endif //_DEBUG
+         boost::upgrade_to_unique_lock<boost::upgrade_mutex> m_lock;
+      };
+
+      WWriteLock::WWriteLock(WUpgradeableLock& readLock):
+#ifdef _DEBUG
+         m_readLock (readLock),
+#endif //_DEBUG
+         m_lock (readLock.m_lock)
+      {
+#ifdef _DEBUG
+         assert(!m_readLock.m_writeLocked);
+         m_readLock.m_writeLocked = true;
+         s_readMutexWriteLocked = true;
+#endif //_DEBUG
+      }
+      
+      WWriteLock::~WWriteLock()
+      {
+#ifdef _DEBUG
+         assert(m_readLock.m_writeLocked);
+         m_readLock.m_writeLocked = false;
+         s_readMutexWriteLocked = false;
+#endif //_DEBUG
+      }
+#endif //!WSTM_CLOCK_ENGINE
+
+      //Spins for a bit and then starts yielding, used while waiting for a commit to get out of the
+      //way.
+      class WBackoff
+      {
+      public:
+         WBackoff (): m_count (0) {}
+
+         void operator()()
+         {
+            if (m_count < SPIN_LIMIT)
+            {
+               ++m_count;
+            }
+            else
+            {
+               std::this_thread::yield ();
+            }
+         }
+
+      private:
+         static const unsigned int SPIN_LIMIT = 64;
+         unsigned int m_count;
+      };
+
+#ifdef WSTM_CLOCK_ENGINE
+      //Helpers for the version locks, the low bit of the lock word is the lock bit and the rest is
+      //the version.
+      bool IsLocked (const uint64_t word)
+      {
+         return (word & 1) != 0;
+      }
+
+      uint64_t GetVersion (const uint64_t word)
+      {
+         return word >> 1;
+      }
+
+      uint64_t MakeLockWord (const uint64_t version)
+      {
+         return version << 1;
+      }
+
+      //Gets the version lock that covers the given core.
+      std::atomic<uint64_t>& GetVersionLock (const Internal::WVarCoreBase& core)
+      {
+#ifdef WSTM_STRIPED_LOCKS
+         //fibonacci hashing, the low bits of the address are dropped since they are the same for
+         //every core
+         const auto hash = (reinterpret_cast<uintptr_t>(&core) >> 4)*uint64_t (0x9E3779B97F4A7C15);
+         return s_lockStripes[static_cast<size_t>(hash >> (64 - LOCK_STRIPE_BITS))];
+#else
+         return core.m_versionLock;
+#endif //WSTM_STRIPED_LOCKS
+      }
+
+      //Takes the given version lock, returning the lock word from before the lock was taken.
+      uint64_t LockVersion (std::atomic<uint64_t>& versionLock)
+      {
+         auto word = versionLock.load (std::memory_order_relaxed);
+         WBackoff backoff;
+         for (;;)
+         {
+            if (!IsLocked (word) && versionLock.compare_exchange_weak (word, word | 1))
+            {
+               return word;
+            }
+            backoff ();
+            word = versionLock.load (std::memory_order_relaxed);
+         }
+      }
+
+      //Checks that a variable read by a transaction with the given read version hasn't changed
+      //since it was read. Anything committed after the read would have a version greater than the
+      //read version. If the variable is locked then a commit is in the middle of changing it.
+      bool IsReadValid (const Internal::WVarCoreBase& core, const uint64_t readVersion)
+      {
+         const auto word = GetVersionLock (core).load (std::memory_order_acquire);
+         return (!IsLocked (word) && GetVersion (word) <= readVersion);
+      }
+
+      //Checks if a variable that compares values (see WCompareValues) still has the value that was
+      //read even though it has been committed to since. Comparisons of different variables are
+      //done at different times so they can only be trusted if nothing was committed while they
+      //were being done, see ValidateReads.
+      bool HasSameValue (const Internal::WVarCoreBase& core, const Internal::WValueBase& val)
+      {
+         if (!core.m_isCurrentValue_p)
+         {
+            return false;
+         }
+         const auto& versionLock = GetVersionLock (core);
+         const auto pre = versionLock.load (std::memory_order_acquire);
+         if (IsLocked (pre))
+         {
+            return false;
+         }
+         const auto same = core.m_isCurrentValue_p (core, val);
+         std::atomic_thread_fence (std::memory_order_acquire);
+         return (same && versionLock.load (std::memory_order_relaxed) == pre);
+      }
+
+      //Gets a consistent snapshot of the core's value, returns the value and the version lock word
+      //it was committed with. Inline values are copied into slot_p.
+      std::pair<const Internal::WValueBase*, uint64_t> LoadValue (const Internal::WVarCoreBase& core, void* slot_p)
+      {
+         const auto& versionLock = GetVersionLock (core);
+         WBackoff backoff;
+         for (;;)
+         {
+            const auto pre = versionLock.load (std::memory_order_acquire);
+            if (IsLocked (pre))
+            {
+               //a commit is in progress
+               backoff ();
+               continue;
+            }
+            const auto value_p = core.m_inline ? core.ReadInline (slot_p) : core.m_value_p.load (std::memory_order_acquire);
+            std::atomic_thread_fence (std::memory_order_acquire);
+            if (versionLock.load (std::memory_order_relaxed) == pre)
+            {
+               return std::make_pair (value_p, pre);
+            }
+         }
+      }
+#endif //WSTM_CLOCK_ENGINE
+
+      //The read and write sets of a transaction. Most transactions only touch a handful of
+      //variables so the entries are kept in a flat array, in the order that they were added, that
+      //is searched linearly. Once there are more than LINEAR_LIMIT entries an open addressing index
+      //(with linear probing) is built over the array. Clearing the map keeps its storage so that
+      //once a thread's transactions have grown their sets they don't need to allocate anymore.
+      template <typename Key_t, typename Value_t>
+      class WVarMap
+      {
+      public:
+         using key_type = Key_t;
+         using value_type = std::pair<key_type, Value_t>;
+         using iterator = typename std::vector<value_type>::iterator;
+         using const_iterator = typename std::vector<value_type>::const_iterator;
+
+         WVarMap ();
+
+         WVarMap (const WVarMap&) = delete;
+         WVarMap& operator=(const WVarMap&) = delete;
+         
+         iterator begin () {return m_entries.begin ();}
+         iterator end () {return m_entries.end ();}
+         const_iterator begin () const {return m_entries.begin ();}
+         const_iterator end () const {return m_entries.end ();}
+
+         bool empty () const {return m_entries.empty ();}
+         size_t size () const {return m_entries.size ();}
+
+         iterator find (const Internal::WVarCoreBase* core_p);
+         //Inserts a default constructed value if the key isn't in the map yet.
+         Value_t& operator[](const key_type& key);
+         //Removes the entry for the given core if there is one, the last entry takes its place.
+         void erase (const Internal::WVarCoreBase* core_p);
+         void clear ();
+
+      private:
+         static const Internal::WVarCoreBase* GetCore (const Internal::WVarCoreBase* core_p) {return core_p;}
+         static const Internal::WVarCoreBase* GetCore (const std::shared_ptr<Internal::WVarCoreBase>& core_p) {return core_p.get ();}
+         
+         static const size_t LINEAR_LIMIT = 16;
+         //Maps that grew larger than this give their storage back when they are cleared so that one
+         //huge transaction doesn't tie up memory forever.
+         static const size_t MAX_RETAINED = 1024;
+         static const uint32_t EMPTY_SLOT = std::numeric_limits<uint32_t>::max ();
+
+         size_t GetSlot (const Internal::WVarCoreBase* core_p) const;
+         size_t FindSlot (const uint32_t entry) const;
+         void AddToIndex (const uint32_t entry);
+         void BuildIndex (const unsigned int bits);
+
+         std::vector<value_type> m_entries;
+         //Indexes into m_entries, only used when m_indexBits is non-zero.
+         std::vector<uint32_t> m_index;
+         unsigned int m_indexBits;
+      };
+
+      template <typename Key_t, typename Value_t>
+      const uint32_t WVarMap<Key_t, Value_t>::EMPTY_SLOT;
+
+      template <typename Key_t, typename Value_t>
+      WVarMap<Key_t, Value_t>::WVarMap ():
+         m_indexBits (0)
+      {}
+      
+      template <typename Key_t, typename Value_t>
+      typename WVarMap<Key_t, Value_t>::iterator WVarMap<Key_t, Value_t>::find (const Internal::WVarCoreBase* core_p)
+      {
+         if (m_indexBits == 0)
+         {
+            return std::find_if (m_entries.begin (), m_entries.end (),
+                                 [&](const value_type& v){return GetCore (v.first) == core_p;});
+         }
+
+         const auto mask = m_index.size () - 1;
+         for (auto slot = GetSlot (core_p); m_index[slot] != EMPTY_SLOT; slot = (slot + 1) & mask)
+         {
+            if (GetCore (m_entries[m_index[slot]].first) == core_p)
+            {
+               return m_entries.begin () + m_index[slot];
+            }
+         }
+         return m_entries.end ();
+      }
+
+      template <typename Key_t, typename Value_t>
+      Value_t& WVarMap<Key_t, Value_t>::operator[](const key_type& key)
+      {
+         const auto it = find (GetCore (key));
+         if (it != m_entries.end ())
+         {
+            return it->second;
+         }
+
+         m_entries.emplace_back (key, Value_t ());
+         if (m_indexBits > 0 && m_entries.size ()*2 <= m_index.size ())
+         {
+            AddToIndex (static_cast<uint32_t>(m_entries.size () - 1));
+         }
+         else if (m_entries.size () > LINEAR_LIMIT)
+         {
+            //keep the index at most half full
+            BuildIndex (std::max (m_indexBits + 1, 6u));
+         }
+         return m_entries.back ().second;
+      }
+
+      template <typename Key_t, typename Value_t>
+      void WVarMap<Key_t, Value_t>::erase (const Internal::WVarCoreBase* core_p)
+      {
+         const auto it = find (core_p);
+         if (it == m_entries.end ())
+         {
+            return;
+         }
+         const auto entry = static_cast<uint32_t>(it - m_entries.begin ());
+         const auto last = static_cast<uint32_t>(m_entries.size () - 1);
+         
+         if (m_indexBits > 0)
+         {
+            //Backward shift deletion: entries after the removed slot that would no longer be found
+            //by probing from their home slot are moved back into the gap.
+            const auto mask = m_index.size () - 1;
+            auto gap = FindSlot (entry);
+            for (auto slot = (gap + 1) & mask; m_index[slot] != EMPTY_SLOT; slot = (slot + 1) & mask)
+            {
+               const auto home = GetSlot (GetCore (m_entries[m_index[slot]].first));
+               //the distance that each of them is from their home slot
+               if (((slot - home) & mask) >= ((slot - gap) & mask))
+               {
+                  m_index[gap] = m_index[slot];
+                  gap = slot;
+               }
+            }
+            m_index[gap] = EMPTY_SLOT;
+            if (entry != last)
+            {
+               m_index[FindSlot (last)] = entry;
+            }
+         }
+
+         if (entry != last)
+         {
+            *it = std::move (m_entries.back ());
+         }
+         m_entries.pop_back ();
+      }
+
+      template <typename Key_t, typename Value_t>
+      void WVarMap<Key_t, Value_t>::clear ()
+      {
+         if (m_entries.capacity () > MAX_RETAINED)
+         {
+            std::vector<value_type>().swap (m_entries);
+            std::vector<uint32_t>().swap (m_index);
+         }
+         else
+         {
+            m_entries.clear ();
+         }
+         m_indexBits = 0;
+      }
+
+      template <typename Key_t, typename Value_t>
+      size_t WVarMap<Key_t, Value_t>::GetSlot (const Internal::WVarCoreBase* core_p) const
+      {
+         //fibonacci hashing, the low bits of the address are dropped since they are the same for
+         //every core
+         const auto hash = (reinterpret_cast<uintptr_t>(core_p) >> 4)*uint64_t (0x9E3779B97F4A7C15);
+         return static_cast<size_t>(hash >> (64 - m_indexBits));
+      }
+
+      template <typename Key_t, typename Value_t>
+      size_t WVarMap<Key_t, Value_t>::FindSlot (const uint32_t entry) const
+      {
+         const auto mask = m_index.size () - 1;
+         auto slot = GetSlot (GetCore (m_entries[entry].first));
+         while (m_index[slot] != entry)
+         {
+            slot = (slot + 1) & mask;
+         }
+         return slot;
+      }
+
+      template <typename Key_t, typename Value_t>
+      void WVarMap<Key_t, Value_t>::AddToIndex (const uint32_t entry)
+      {
+         const auto mask = m_index.size () - 1;
+         auto slot = GetSlot (GetCore (m_entries[entry].first));
+         while (m_index[slot] != EMPTY_SLOT)
+         {
+            slot = (slot + 1) & mask;
+         }
+         m_index[slot] = entry;
+      }
+      
+      template <typename Key_t, typename Value_t>
+      void WVarMap<Key_t, Value_t>::BuildIndex (const unsigned int bits)
+      {
+         m_indexBits = bits;
+         m_index.assign (size_t (1) << bits, EMPTY_SLOT);
+         for (auto i = uint32_t (0); i < m_entries.size (); ++i)
+         {
+            AddToIndex (i);
+         }
+      }
+      
+      //The values that a transaction has read, and their cores, are kept alive by the reclamation
+      //epoch that the transaction is pinned in so the read set doesn't touch the cores' reference
+      //counts. The values that it has set belong to the transaction until it commits and it holds
+      //a reference to the cores that it writes.
+      using GotMap = WVarMap<Internal::WVarCoreBase*, const Internal::WValueBase*>;
+      using SetMap = WVarMap<std::shared_ptr<Internal::WVarCoreBase>, std::unique_ptr<Internal::WValueBase>>;
+
+      //Memory for the transaction's copies of inline values (see Internal::WVarCore). Slots are
+      //handed out from blocks that are kept from one transaction to the next so that once a thread
+      //has warmed up reading and writing inline variables doesn't allocate. The values in the slots
+      //are never destroyed, WInlineValue objects don't own anything.
+      class WInlineValueArena
+      {
+      public:
+         WInlineValueArena ();
+
+         WInlineValueArena (const WInlineValueArena&) = delete;
+         WInlineValueArena& operator=(const WInlineValueArena&) = delete;
+
+         void* Allocate ();
+         //Makes all the slots available again, nothing can be using them anymore.
+         void Reset ();
+
+      private:
+         static const size_t SLOTS_PER_BLOCK = 64;
+         //Blocks past this are freed by Reset so that one huge transaction doesn't tie up memory
+         //forever.
+         static const size_t MAX_KEPT_BLOCKS = 16;
+         
+         struct WSlot
+         {
+            alignas (std::max_align_t) unsigned char m_bytes[Internal::INLINE_VALUE_SLOT_SIZE];
+         };
+         using WBlock = std::array<WSlot, SLOTS_PER_BLOCK>;
+         
+         std::vector<std::unique_ptr<WBlock>> m_blocks;
+         size_t m_block;
+         size_t m_slot;
+      };
+
+      WInlineValueArena::WInlineValueArena ():
+         m_block (0),
+         m_slot (0)
+      {}
+
+      void* WInlineValueArena::Allocate ()
+      {
+         if (m_slot == SLOTS_PER_BLOCK)
+         {
+            ++m_block;
+            m_slot = 0;
+         }
+         if (m_block == m_blocks.size ())
+         {
+            m_blocks.push_back (std::make_unique<WBlock>());
+         }
+         return (*m_blocks[m_block])[m_slot++].m_bytes;
+      }
+
+      void WInlineValueArena::Reset ()
+      {
+         m_block = 0;
+         m_slot = 0;
+         if (m_blocks.size () > MAX_KEPT_BLOCKS)
+         {
+            m_blocks.resize (MAX_KEPT_BLOCKS);
+         }
+      }
+   }
+
+   namespace Internal
+   {
+      //A thread that is blocked in Retry. It is added to the waiter table for all the variables
+      //that its transaction read and any commit that writes one of those variables sets m_notified
+      //and signals it.
+      struct WCommitWaiter
+      {
+         WCommitWaiter (): m_notified (false) {}
+
+         std::mutex m_mutex;
+         std::condition_variable m_signal;
+         bool m_notified;
+         //Set for transactions run by AtomicallyAsync, which don't have a thread waiting for them.
+         //Commits call this instead of signalling. It is called with the waiter table's stripe mutex
+         //held so it mustn't do much.
+         std::function<void ()> m_onNotify;
+      };
+   }
+
+   namespace
+   {
+      //The waiters for all the variables are kept in a fixed size table that the variables are
+      //hashed into by their address. Waiting is rare enough that sharing the lists is cheaper than
+      //every variable carrying its own list and mutex.
+      struct WWaiterStripe
+      {
+         using Entry = std::pair<const Internal::WVarCoreBase*, Internal::WCommitWaiter*>;
+         
+         std::mutex m_mutex;
+         std::vector<Entry> m_waiters;
+      };
+      const size_t NUM_WAITER_STRIPES = 256;
+      std::array<WWaiterStripe, NUM_WAITER_STRIPES> s_waiterStripes;
+
+      WWaiterStripe& GetWaiterStripe (const Internal::WVarCoreBase& core)
+      {
+         const auto hash = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&core) >> 4)*0x9E3779B97F4A7C15ull;
+         return s_waiterStripes[static_cast<size_t>(hash >> 56)];
+      }
+      
+      //Wakes up the threads that are waiting for any of the given variables to change. Must be
+      //called after the new values have been installed.
+      void NotifyCommit (const SetMap& set)
+      {
+         //Pairs with the fence in WWaitRegistration. Either the waiter sees the new value when it
+         //validates or we see the waiter here.
+         std::atomic_thread_fence (std::memory_order_seq_cst);
+         for (const SetMap::value_type& val: set)
+         {
+            auto& core = *val.first;
+            if (core.m_numWaiters.load (std::memory_order_relaxed) > 0)
+            {
+               auto& stripe = GetWaiterStripe (core);
+               std::lock_guard<std::mutex> lock (stripe.m_mutex);
+               for (const auto& entry: stripe.m_waiters)
+               {
+                  if (entry.first != &core)
+                  {
+                     continue;
+                  }
+                  const auto waiter_p = entry.second;
+                  if (waiter_p->m_onNotify)
+                  {
+                     waiter_p->m_onNotify ();
+                  }
+                  else
+                  {
+                     {
+                        std::lock_guard<std::mutex> waiterLock (waiter_p->m_mutex);
+                        waiter_p->m_notified = true;
+                     }
+                     waiter_p->m_signal.notify_one ();
+                  }
+               }
+            }
+         }
+      }
+
+      //Adds a waiter to the waiter table for the variables in a read set for as long as it exists.
+      class WWaitRegistration
+      {
+      public:
+         using Cores = std::vector<std::shared_ptr<Internal::WVarCoreBase>>;
+         
+         WWaitRegistration (Internal::WCommitWaiter& waiter, const GotMap& got);
+         WWaitRegistration (Internal::WCommitWaiter& waiter, Cores cores);
+         ~WWaitRegistration ();
+
+         WWaitRegistration (const WWaitRegistration&) = delete;
+         WWaitRegistration& operator=(const WWaitRegistration&) = delete;
+         
+      private:
+         Internal::WCommitWaiter& m_waiter;
+         //The read set only has raw pointers to the cores, which are only good while the
+         //transaction is pinned.
+         Cores m_cores;
+
+         static Cores GetCores (const GotMap& got);
+      };
+
+      WWaitRegistration::Cores WWaitRegistration::GetCores (const GotMap& got)
+      {
+         auto cores = Cores ();
+         cores.reserve (got.size ());
+         for (const GotMap::value_type& val: got)
+         {
+            cores.push_back (val.first->shared_from_this ());
+         }
+         return cores;
+      }
+      
+      WWaitRegistration::WWaitRegistration (Internal::WCommitWaiter& waiter, const GotMap& got):
+         WWaitRegistration (waiter, GetCores (got))
+      {}
+
+      WWaitRegistration::WWaitRegistration (Internal::WCommitWaiter& waiter, Cores cores):
+         m_waiter (waiter),
+         m_cores (std::move (cores))
+      {
+         for (const auto& core_p: m_cores)
+         {
+            auto& stripe = GetWaiterStripe (*core_p);
+            std::lock_guard<std::mutex> lock (stripe.m_mutex);
+            stripe.m_waiters.push_back (WWaiterStripe::Entry (core_p.get (), &m_waiter));
+            core_p->m_numWaiters.fetch_add (1, std::memory_order_relaxed);
+         }
+         //pairs with the fence in NotifyCommit, the caller validates after this
+         std::atomic_thread_fence (std::memory_order_seq_cst);
+      }
+
+      WWaitRegistration::~WWaitRegistration ()
+      {
+         for (const auto& core_p: m_cores)
+         {
+            auto& stripe = GetWaiterStripe (*core_p);
+            std::lock_guard<std::mutex> lock (stripe.m_mutex);
+            auto& waiters = stripe.m_waiters;
+            waiters.erase (std::find (waiters.begin (), waiters.end (), WWaiterStripe::Entry (core_p.get (), &m_waiter)));
+            core_p->m_numWaiters.fetch_sub (1, std::memory_order_relaxed);
+         }
+      }
+
+      //Old variable values are freed using epoch based reclamation. Transactions read values
+      //without taking any locks so a value that has been replaced by a commit can't be freed until
+      //every transaction that might have read it is done. Root transactions "pin" the current epoch
+      //while they run. Each commit retires the values it replaced along with the epoch and the
+      //values get freed once there are no transactions pinned at or before that epoch.
+      const uint64_t UNPINNED = std::numeric_limits<uint64_t>::max ();
+
+#ifdef WSTM_CLOCK_ENGINE
+      //The version clock doubles as the epoch since every commit that writes already moves it on,
+      //that saves commits from a second write to a global.
+      std::atomic<uint64_t>& s_epoch = s_clock;
+#else
+      alignas (64) std::atomic<uint64_t> s_epoch (0);
+#endif //WSTM_CLOCK_ENGINE
+      //Once a thread has this many retired lists waiting behind the current epoch it moves the
+      //epoch on itself, see WEpochThread::Reclaim.
+      const size_t EPOCH_ADVANCE_BACKLOG = 64;
+      //Cores retired outside of transactions are reclaimed once this many have built up, see
+      //WEpochThread::RetireCore.
+      const size_t CORE_BATCH_SIZE = 64;
+
+      //Each thread that runs transactions owns one of these. They are never freed, once the owning
+      //thread exits the record gets reused by the next new thread.
+      struct WEpochRecord
+      {
+         //The epoch that the thread is pinned at, or UNPINNED
+         std::atomic<uint64_t> m_epoch;
+         //The time that the thread's read-only transaction is reading at, or UNPINNED. Variables
+         //that keep history need to keep the values that were current at this time.
+         std::atomic<uint64_t> m_snapshot;
+         std::atomic<bool> m_inUse;
+         WEpochRecord* m_next_p;
+      };
+      std::atomic<WEpochRecord*> s_epochRecords (nullptr);
+
+      //An old value of a variable that keeps history
+      struct WVersion
+      {
+         std::unique_ptr<Internal::WValueBase> m_value_p;
+         //The next older value
+         std::atomic<WVersion*> m_older_p;
+      };
+   }
+
+   namespace Internal
+   {
+      //The old values of a variable, newest first. Only the thread committing the variable changes
+      //the list, readers walk it without any locks. Old values that are trimmed off the end are
+      //retired like any other replaced value since readers could still be looking at them.
+      struct WHistory
+      {
+         explicit WHistory (const size_t maxVersions);
+         ~WHistory ();
+
+         WHistory (const WHistory&) = delete;
+         WHistory& operator=(const WHistory&) = delete;
+
+         const size_t m_maxVersions;
+         std::atomic<WVersion*> m_newest_p;
+         std::atomic<size_t> m_length;
+      };
+
+      WHistory::WHistory (const size_t maxVersions):
+         m_maxVersions (maxVersions),
+         m_newest_p (nullptr),
+         m_length (0)
+      {}
+
+      WHistory::~WHistory ()
+      {
+         auto v_p = m_newest_p.load (std::memory_order_relaxed);
+         while (v_p)
+         {
+            const auto older_p = v_p->m_older_p.load (std::memory_order_relaxed);
+            delete v_p;
+            v_p = older_p;
+         }
+      }
+   }
+
+   namespace
+   {
+      //What a single commit retired
+      struct WRetired
+      {
+         uint64_t m_epoch;
+         std::vector<std::unique_ptr<Internal::WValueBase>> m_values;
+         //old values trimmed from the history of variables
+         std::vector<std::unique_ptr<WVersion>> m_versions;
+         //cores of WVars that have been destroyed
+         std::vector<std::shared_ptr<Internal::WVarCoreBase>> m_cores;
+         //after functions that have to outlive the values (see WAtomic::AfterOutlivingValues)
+         std::list<WAtomic::WAfterFunc> m_afters;
+         WRetired* m_next_p;
+
+         explicit WRetired (const uint64_t epoch = 0): m_epoch (epoch), m_next_p (nullptr) {}
+
+         ~WRetired ()
+         {
+            //The after functions are freed after the values, WChannelReader relies on this to
+            //release long chains of channel nodes without overflowing the stack.
+            m_values.clear ();
+            m_versions.clear ();
+            m_cores.clear ();
+            m_afters.clear ();
+         }
+      };
+
+      //Makes the WRetired for a commit of the given writes. Inline values are written in place so
+      //if those are all that the transaction set (and none of them keep history) then there is
+      //nothing to retire and no need to allocate.
+      std::unique_ptr<WRetired> MakeRetired (const SetMap& set)
+      {
+         const auto numValues = std::count_if (set.begin (), set.end (),
+                                               [](const SetMap::value_type& val)
+                                               {
+                                                  return !val.first->m_inline || val.first->m_history_p;
+                                               });
+         if (numValues == 0)
+         {
+            return nullptr;
+         }
+         auto retired_p = std::make_unique<WRetired>();
+         retired_p->m_values.reserve (numValues);
+         return retired_p;
+      }
+
+      //Only one transaction can be inevitable (WConflictResolution::RUN_INEVITABLE) at a time, it
+      //holds s_inevitableMutex while it runs. Before it reads a variable it marks the variable in
+      //s_inevitableReads (a bitmap indexed by a hash of the variable, or of its version lock with
+      //the clock engine since variables can share those). Other transactions won't commit changes
+      //to marked variables so the inevitable transaction can't have any conflicts.
+      std::mutex s_inevitableMutex;
+      std::atomic<bool> s_inevitableActive (false);
+      const size_t INEVITABLE_READ_BITS = 4096;
+      std::array<std::atomic<uint64_t>, INEVITABLE_READ_BITS/64> s_inevitableReads;
+      //transactions that have to wait for the inevitable transaction to finish wait on this
+      std::mutex s_inevitableWaitMutex;
+      std::condition_variable s_inevitableDone;
+
+      std::pair<size_t, uint64_t> GetInevitableBit (const Internal::WVarCoreBase& core)
+      {
+#ifdef WSTM_CLOCK_ENGINE
+         const void* key_p = &GetVersionLock (core);
+#else
+         const void* key_p = &core;
+#endif //WSTM_CLOCK_ENGINE
+         const auto hash = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key_p) >> 4)*0x9E3779B97F4A7C15ull;
+         const auto bit = static_cast<size_t>(hash >> 52);
+         return std::make_pair (bit/64, uint64_t (1) << (bit%64));
+      }
+
+      void BeginInevitable ()
+      {
+         s_inevitableMutex.lock ();
+         s_inevitableActive.store (true);
+      }
+
+      void EndInevitable ()
+      {
+         for (auto& word: s_inevitableReads)
+         {
+            word.store (0, std::memory_order_relaxed);
+         }
+         s_inevitableActive.store (false);
+         //makes sure that a waiter that just checked the marks is actually waiting before we notify
+         {
+            std::lock_guard<std::mutex> lock (s_inevitableWaitMutex);
+         }
+         s_inevitableDone.notify_all ();
+         s_inevitableMutex.unlock ();
+      }
+      
+      //Called by the inevitable transaction before it reads a variable.
+      void MarkInevitableRead (const Internal::WVarCoreBase& core)
+      {
+         const auto bit = GetInevitableBit (core);
+         auto& word = s_inevitableReads[bit.first];
+         if (!(word.load (std::memory_order_relaxed) & bit.second))
+         {
+            word.fetch_or (bit.second);
+            //Committers lock the variables that they are writing before they check the marks, so
+            //either they will see our mark or our read will see that they are committing (and wait
+            //for them to finish).
+            std::atomic_thread_fence (std::memory_order_seq_cst);
+         }
+      }
+
+      //Checks whether committing the given set would change anything that the inevitable
+      //transaction has read. The caller must have already locked the variables it is writing using
+      //sequentially consistent operations.
+      bool WritesInevitableRead (const SetMap& set)
+      {
+         if (!s_inevitableActive.load ())
+         {
+            return false;
+         }
+         for (const SetMap::value_type& val: set)
+         {
+            const auto bit = GetInevitableBit (*val.first);
+            if (s_inevitableReads[bit.first].load () & bit.second)
+            {
+               return true;
+            }
+         }
+         return false;
+      }
+
+      //Waits until the given set doesn't change anything that the inevitable transaction has read
+      //(normally that means waiting for it to finish).
+      void WaitForInevitable (const SetMap& set)
+      {
+         WProfileTimer timer (PROFILE_COMMIT_WAIT_NS);
+         WLatencyTimer latencyTimer (LATENCY_LOCK);
+         std::unique_lock<std::mutex> lock (s_inevitableWaitMutex);
+         s_inevitableDone.wait (lock, [&](){return !WritesInevitableRead (set);});
+      }
+
+      //Retired values that were left by threads that exited or went idle before they could free
+      //them, picked up by the next thread that reclaims. These are left as plain pointers so that
+      //they can still be used during static destruction.
+      std::mutex s_orphanMutex;
+      WRetired* s_orphanHead_p = nullptr;
+      WRetired* s_orphanTail_p = nullptr;
+      std::atomic<bool> s_haveOrphans (false);
+
+      void AddOrphans (WRetired* first_p, WRetired* last_p)
+      {
+         std::lock_guard<std::mutex> lock (s_orphanMutex);
+         if (s_orphanTail_p)
+         {
+            s_orphanTail_p->m_next_p = first_p;
+         }
+         else
+         {
+            s_orphanHead_p = first_p;
+         }
+         s_orphanTail_p = last_p;
+         s_haveOrphans.store (true);
+      }
+
+      //Whether this thread's WEpochThread has been created yet (1) or has already been destroyed
+      //(2). WVars can be destroyed after that during thread or static destruction.
+      THREAD_LOCAL_WITH_INIT_VALUE (int, s_epochThreadState, 0);
+
+      //The per-thread side of the reclamation epoch
+      class WEpochThread
+      {
+      public:
+         WEpochThread ();
+         ~WEpochThread ();
+
+         WEpochThread (const WEpochThread&) = delete;
+         WEpochThread& operator=(const WEpochThread&) = delete;
+
+         //Pins can nest, the thread is unpinned when the outermost pin is unpinned.
+         void Pin ();
+         void Unpin ();
+
+         //Hands the given values over to be freed once no transaction can be reading them. 
+         void Retire (std::unique_ptr<WRetired>&& retired_p);
+         //Hands over the core of a WVar that has been destroyed, transactions that are still running
+         //could have read it.
+         void RetireCore (std::shared_ptr<Internal::WVarCoreBase>&& core_p);
+         //Frees whatever retired values it is safe to free, anything left waits for the next
+         //Reclaim. Freeing values can run transactions so this must not be called while there is
+         //an active transaction.
+         void Reclaim ();
+         //Hands whatever is still waiting to be freed over to the other threads, for when this
+         //thread is about to block and might not reclaim again for a long time.
+         void HandOff ();
+
+         static uint64_t GetMinPinnedEpoch ();
+
+         //Read-only transactions publish the time that they are reading at so that variables
+         //that keep history know which old values to keep.
+         void PublishSnapshot (const uint64_t time);
+         void ClearSnapshot ();
+         static uint64_t GetMinSnapshot ();
+
+      private:
+         void Append (WRetired* first_p, WRetired* last_p, size_t count);
+         //Moves the epoch on if it hasn't moved since our newest retired values were retired.
+         void AdvanceEpoch ();
+         //Gives the cores collected by RetireCore an epoch and adds them to the retired lists.
+         void RetireCores ();
+         
+         WEpochRecord* m_record_p;
+         unsigned int m_pinCount;
+         WRetired* m_head_p;
+         WRetired* m_tail_p;
+         //the number of retired lists from m_head_p to m_tail_p
+         size_t m_numRetired;
+         //cores that haven't been given an epoch yet
+         WRetired* m_cores_p;
+         bool m_reclaiming;
+      };
+
+      WEpochThread::WEpochThread ():
+         m_record_p (nullptr),
+         m_pinCount (0),
+         m_head_p (nullptr),
+         m_tail_p (nullptr),
+         m_numRetired (0),
+         m_cores_p (nullptr),
+         m_reclaiming (false)
+      {
+         s_epochThreadState = 1;
+         for (auto rec_p = s_epochRecords.load (); rec_p; rec_p = rec_p->m_next_p)
+         {
+            auto inUse = false;
+            if (!rec_p->m_inUse.load (std::memory_order_relaxed) && rec_p->m_inUse.compare_exchange_strong (inUse, true))
+            {
+               m_record_p = rec_p;
+               return;
+            }
+         }
+
+         m_record_p = new WEpochRecord;
+         m_record_p->m_epoch.store (UNPINNED);
+         m_record_p->m_snapshot.store (UNPINNED);
+         m_record_p->m_inUse.store (true);
+         m_record_p->m_next_p = s_epochRecords.load ();
+         while (!s_epochRecords.compare_exchange_weak (m_record_p->m_next_p, m_record_p))
+         {}
+      }
+
+      WEpochThread::~WEpochThread ()
+      {
+         assert (m_pinCount == 0);
+         m_record_p->m_epoch.store (UNPINNED);
+         m_record_p->m_snapshot.store (UNPINNED);
+         m_record_p->m_inUse.store (false);
+
+         //Freeing the values here could run transactions on a thread that is being torn down so
+         //leave them to some other thread.
+         RetireCores ();
+         HandOff ();
+         s_epochThreadState = 2;
+      }
+
+      void WEpochThread::Pin ()
+      {
+         if (m_pinCount++ == 0)
+         {
+            m_record_p->m_epoch.store (s_epoch.load ());
+            //Makes sure that either a reclaiming thread sees our epoch or we see the values that
+            //were published before it started reclaiming.
+            std::atomic_thread_fence (std::memory_order_seq_cst);
+         }
+      }
+      
+      void WEpochThread::Unpin ()
+      {
+         assert (m_pinCount > 0);
+         if (--m_pinCount == 0)
+         {
+            m_record_p->m_epoch.store (UNPINNED, std::memory_order_release);
+         }
+      }
+
+      void WEpochThread::Retire (std::unique_ptr<WRetired>&& retired_p)
+      {
+         //The values must already be unreachable when the epoch is taken, any transaction that pins
+         //a later epoch can't see them.
+#ifdef WSTM_CLOCK_ENGINE
+         //Our commit has already moved the clock on. The fence makes sure that a transaction that
+         //pins a later time than the one we read here sees our commit's writes.
+         std::atomic_thread_fence (std::memory_order_seq_cst);
+         retired_p->m_epoch = s_epoch.load ();
+#else
+         retired_p->m_epoch = s_epoch.fetch_add (1);
+#endif //WSTM_CLOCK_ENGINE
+         auto r_p = retired_p.release ();
+         Append (r_p, r_p, 1);
+      }
+
+      void WEpochThread::RetireCore (std::shared_ptr<Internal::WVarCoreBase>&& core_p)
+      {
+         //Channels destroy a WVar for every message so this needs to be cheap. The cores are
+         //collected here and only given an epoch when the next transaction finishes (or once
+         //enough of them have built up), taking the epoch late just keeps them around a little
+         //longer.
+         if (!m_cores_p)
+         {
+            m_cores_p = new WRetired (0);
+            m_cores_p->m_cores.reserve (CORE_BATCH_SIZE);
+         }
+         m_cores_p->m_cores.push_back (std::move (core_p));
+         if (m_pinCount == 0 && m_cores_p->m_cores.size () >= CORE_BATCH_SIZE)
+         {
+            Reclaim ();
+         }
+      }
+
+      void WEpochThread::RetireCores ()
+      {
+         if (m_cores_p)
+         {
+            //Makes sure that a transaction that pins a later epoch than the one read here can't
+            //find the cores (see Retire).
+            std::atomic_thread_fence (std::memory_order_seq_cst);
+            m_cores_p->m_epoch = s_epoch.load ();
+            Append (m_cores_p, m_cores_p, 1);
+            m_cores_p = nullptr;
+         }
+      }
+
+      void WEpochThread::Append (WRetired* first_p, WRetired* last_p, const size_t count)
+      {
+         m_numRetired += count;
+         if (m_tail_p)
+         {
+            m_tail_p->m_next_p = first_p;
+         }
+         else
+         {
+            m_head_p = first_p;
+         }
+         m_tail_p = last_p;
+      }
+
+      uint64_t WEpochThread::GetMinPinnedEpoch ()
+      {
+         //pairs with the fence in Pin
+         std::atomic_thread_fence (std::memory_order_seq_cst);
+         auto minEpoch = UNPINNED;
+         for (auto rec_p = s_epochRecords.load (); rec_p; rec_p = rec_p->m_next_p)
+         {
+            minEpoch = std::min (minEpoch, rec_p->m_epoch.load ());
+         }
+         return minEpoch;
+      }
+      
+      void WEpochThread::PublishSnapshot (const uint64_t time)
+      {
+         m_record_p->m_snapshot.store (time);
+         //Makes sure that either a committing thread sees our snapshot or we see its commit time.
+         std::atomic_thread_fence (std::memory_order_seq_cst);
+      }
+
+      void WEpochThread::ClearSnapshot ()
+      {
+         m_record_p->m_snapshot.store (UNPINNED, std::memory_order_release);
+      }
+
+      uint64_t WEpochThread::GetMinSnapshot ()
+      {
+         //pairs with the fence in PublishSnapshot
+         std::atomic_thread_fence (std::memory_order_seq_cst);
+         auto minSnapshot = UNPINNED;
+         for (auto rec_p = s_epochRecords.load (); rec_p; rec_p = rec_p->m_next_p)
+         {
+            minSnapshot = std::min (minSnapshot, rec_p->m_snapshot.load ());
+         }
+         return minSnapshot;
+      }
+      
+      void WEpochThread::Reclaim ()
+      {
+         //Freeing values can run transactions that retire more values, those will be picked up by
+         //the loop below.
+         if (m_reclaiming)
+         {
+            return;
+         }
+         m_reclaiming = true;
+         RetireCores ();
+
+         //The orphans go ahead of our own values since they are usually older
+         if (s_haveOrphans.load (std::memory_order_relaxed))
+         {
+            std::lock_guard<std::mutex> lock (s_orphanMutex);
+            if (s_orphanHead_p)
+            {
+               for (auto r_p = s_orphanHead_p; r_p; r_p = r_p->m_next_p)
+               {
+                  ++m_numRetired;
+               }
+               s_orphanTail_p->m_next_p = m_head_p;
+               if (!m_head_p)
+               {
+                  m_tail_p = s_orphanTail_p;
+               }
+               m_head_p = s_orphanHead_p;
+               s_orphanHead_p = nullptr;
+               s_orphanTail_p = nullptr;
+               s_haveOrphans.store (false);
+            }
+         }
+         
+         while (m_head_p)
+         {
+            const auto minEpoch = GetMinPinnedEpoch ();
+            if (m_head_p->m_epoch >= minEpoch)
+            {
+               break;
+            }
+            //values are freed oldest first so that anything retired with after functions goes away
+            //in the order it was retired
+            while (m_head_p && m_head_p->m_epoch < minEpoch)
+            {
+               auto retired_p = std::unique_ptr<WRetired>(m_head_p);
+               m_head_p = retired_p->m_next_p;
+               if (!m_head_p)
+               {
+                  m_tail_p = nullptr;
+               }
+               --m_numRetired;
+               retired_p.reset ();
+            }
+         }
+
+         //Whatever is left is waiting on transactions in other threads, it stays with us until we
+         //reclaim again (or HandOff is called) so that commits don't have to touch the orphans.
+         //Normally other threads' commits move the epoch on, but if they're only reading they can
+         //keep pinning the epoch that our values were retired in.
+         if (m_numRetired >= EPOCH_ADVANCE_BACKLOG)
+         {
+            AdvanceEpoch ();
+         }
+         m_reclaiming = false;
+      }
+
+      void WEpochThread::HandOff ()
+      {
+         if (m_head_p && !m_reclaiming)
+         {
+            //nobody else would move the epoch on for these
+            AdvanceEpoch ();
+            AddOrphans (m_head_p, m_tail_p);
+            m_head_p = nullptr;
+            m_tail_p = nullptr;
+            m_numRetired = 0;
+         }
+      }
+
+      void WEpochThread::AdvanceEpoch ()
+      {
+         //With the clock engine this moves the version clock on without a commit, which is harmless
+         //since transactions just see a newer time.
+         auto epoch = m_tail_p->m_epoch;
+         if (s_epoch.load (std::memory_order_relaxed) == epoch)
+         {
+            s_epoch.compare_exchange_strong (epoch, epoch + 1);
+         }
+      }
+
+      //Drops the old values that no read-only transaction could still want, newerTime is the commit
+      //time of the variable's current value. 
+      void TrimHistory (Internal::WHistory& history, uint64_t newerTime, WRetired& retired)
+      {
+         const auto minSnapshot = WEpochThread::GetMinSnapshot ();
+         auto length = size_t (0);
+         auto link_p = &history.m_newest_p;
+         auto v_p = link_p->load (std::memory_order_relaxed);
+         //An old value can only be read by a snapshot taken before the value that replaced it was
+         //committed. 
+         while (v_p && newerTime > minSnapshot && length < history.m_maxVersions)
+         {
+            newerTime = v_p->m_value_p->m_version;
+            link_p = &v_p->m_older_p;
+            v_p = link_p->load (std::memory_order_relaxed);
+            ++length;
+         }
+         if (v_p)
+         {
+            link_p->store (nullptr, std::memory_order_release);
+            while (v_p)
+            {
+               const auto older_p = v_p->m_older_p.load (std::memory_order_relaxed);
+               retired.m_versions.emplace_back (v_p);
+               v_p = older_p;
+            }
+         }
+         history.m_length.store (length, std::memory_order_relaxed);
+      }
+      
+      //Installs the transaction's value for a variable, the caller must be holding whatever lock
+      //the commit engine needs for writing it. The replaced value is retired, or added to the
+      //variable's history if it keeps one.
+      void CommitValue (SetMap::value_type& val, WRetired* retired_p)
+      {
+         auto& core = *val.first;
+         if (core.m_history_p)
+         {
+            //The old value has to be in the history before the new value is visible so that
+            //readers that see the new value can find it.
+            const auto time = val.second->m_version;
+            auto& history = *core.m_history_p;
+            auto version_p = std::make_unique<WVersion>();
+            version_p->m_older_p.store (history.m_newest_p.load (std::memory_order_relaxed), std::memory_order_relaxed);
+            if (core.m_inline)
+            {
+               version_p->m_value_p = core.CopyInline ();
+               history.m_newest_p.store (version_p.release (), std::memory_order_release);
+               core.CommitInline (*val.second);
+            }
+            else
+            {
+               version_p->m_value_p.reset (core.m_value_p.load (std::memory_order_relaxed));
+               history.m_newest_p.store (version_p.release (), std::memory_order_release);
+               //the history owns the old value now
+               core.Commit (std::move (val.second)).release ();
+            }
+            TrimHistory (history, time, *retired_p);
+         }
+         else if (core.m_inline)
+         {
+            core.CommitInline (*val.second);
+         }
+         else
+         {
+            //old values are retired once we're done committing
+            retired_p->m_values.push_back (core.Commit (std::move (val.second)));
+         }
+      }
+
+      //A write that doesn't change the value of a variable that compares values (see
+      //WCompareValues) is dropped so that the variable's version doesn't change. The caller must be
+      //holding whatever lock the commit engine needs for writing the variable.
+      bool IsSilentStore (const SetMap::value_type& val)
+      {
+         const auto& core = *val.first;
+         return (core.m_isCurrentValue_p && core.m_isCurrentValue_p (core, *val.second));
+      }
+      
+      //Finds the newest old value of the variable that was committed at or before the given time,
+      //returns null if the variable doesn't keep history or its history doesn't go back that far.
+      const Internal::WValueBase* FindOldValue (const Internal::WVarCoreBase& core, const uint64_t time)
+      {
+         if (!core.m_history_p)
+         {
+            return nullptr;
+         }
+         for (auto v_p = core.m_history_p->m_newest_p.load (std::memory_order_acquire);
+              v_p;
+              v_p = v_p->m_older_p.load (std::memory_order_acquire))
+         {
+            if (v_p->m_value_p->m_version <= time)
+            {
+               return v_p->m_value_p.get ();
+            }
+         }
+         return nullptr;
+      }
+   }
+   
+   namespace Internal
+   {
+      //Data used for each transaction
+      struct WTransactionData
+      {
+         WTransactionData (WUpgradeableLock& lock, WEpochThread& epoch);
+
+         WTransactionData* CreateChild ();
+
+         //Don't use this directly, call CreateChild instead
+         explicit WTransactionData (WTransactionData* parent);
+
+         WTransactionData (const WTransactionData&) = delete;
+         WTransactionData& operator=(const WTransactionData&) = delete;
+
+         void Activate ();
+         bool IsActive () const;
+         
+         WTransactionData* GetParent () const;
+         WTransactionData* GetChild () const;
+
+         int GetLevel () const;
+
+         WReadLock& GetReadLock ();
+         WUpgradeableLock& GetUpgradeLock ();
+         WEpochThread& GetEpoch ();
+
+#ifdef WSTM_CLOCK_ENGINE
+         //The clock value that the transaction's reads are consistent with, this is kept in the
+         //root transaction.
+         uint64_t& GetReadVersion ();
+#else
+         //The commit sequence number that the reads of a read-only transaction were last checked
+         //to be consistent at, this is kept in the root transaction.
+         uint64_t& GetSnapshotSequence ();
+#endif //WSTM_CLOCK_ENGINE
+
+         //Child transactions of a read-only transaction are always read-only. A read-only root
+         //transaction takes a snapshot that all of its reads (and its children's reads) have to be
+         //consistent with, read-only children of other transactions just can't set anything.
+         void SetReadOnly (const bool readOnly);
+         bool IsReadOnly () const;
+         bool ReadsSnapshot () const;
+
+         //Makes the root transaction inevitable (waiting for any other inevitable transaction to
+         //finish first) or stops it being inevitable. Child transactions of the inevitable
+         //transaction are inevitable as well.
+         void SetInevitable (const bool inevitable);
+         bool IsInevitable () const;
+
+         //Marks the root transaction as having values in its set that need
+         //WValueBase::ApplyDelta called on them when it commits.
+         void SetHasDeltas ();
+         bool HasDeltas () const;
+
+         //Only the last window reads of an elastic transaction are kept in the got maps, this is
+         //kept in the root transaction.
+         void SetElastic (const unsigned int window);
+
+         GotMap& GetGot ();
+         //Records a read in the got map, releasing the oldest read if the transaction is elastic
+         //and its window is full.
+         void AddGot (Internal::WVarCoreBase* core_p, const Internal::WValueBase* value_p);
+         SetMap& GetSet ();
+         //The memory for inline values belongs to the root transaction so that it stays good when
+         //a child transaction's values are merged into its parent.
+         WInlineValueArena& GetInlineValues ();
+
+         Internal::WLocalValueBase* GetLocalValue (uint64_t key);
+         void SetLocalValue (uint64_t key, std::unique_ptr<Internal::WLocalValueBase>&& value_p);
+
+         void AddBeforeCommit (WAtomic::WBeforeCommitFunc& after);
+         using WBeforeCommitList = std::list<WAtomic::WBeforeCommitFunc> ;
+         void GetBeforeCommits (WBeforeCommitList& beforeCommit);
+
+         //keep is set for the functions that have to outlive the values that the transaction
+         //replaces, those are copied into kept.
+         void AddAfter (WAtomic::WAfterFunc& after, const bool keep);
+         using WAfterList = std::list<WAtomic::WAfterFunc>;
+         void GetAfters (WAfterList& afters, WAfterList& kept);
+
+         void AddOnFail (WAtomic::WOnFailFunc& after);
+         using WOnFailList = std::list<WAtomic::WOnFailFunc>;
+         void RunOnFails ();
+         
+         void MergeToParent ();
+         void MergeGetsToRoot ();
+         void Clear ();
+         void ClearWrites ();
+
+#ifdef _DEBUG
+         static void* const MARKER_VALUE;
+         void* GetMarker () const;
+#endif //_DEBUG
+         
+      private:         
+#ifdef _DEBUG
+         void* const m_marker;
+#endif //_DEBUG
+         
+         bool m_active;
+         bool m_readOnly;
+         bool m_readsSnapshot;
+         bool m_inevitable;
+         bool m_hasDeltas;
+
+         //The transaction's level (1 = root transaction)
+         int m_level;
+
+         WTransactionData* m_parent_p;
+         std::unique_ptr<WTransactionData> m_child_p;         
+
+         //locks for this thread.
+         WReadLock m_readLock;
+         WUpgradeableLock& m_upgradeLock;
+         //root transactions are pinned in this while active
+         WEpochThread& m_epoch;
+
+#ifdef WSTM_CLOCK_ENGINE
+         uint64_t m_readVersion;
+#else
+         uint64_t m_snapshotSequence;
+#endif //WSTM_CLOCK_ENGINE
+         
+         //The WVar's that have been read.
+         GotMap m_got;
+         //The most recent reads of an elastic transaction, m_elasticReads is used as a ring buffer
+         //once it has m_elasticWindow entries.
+         unsigned int m_elasticWindow;
+         std::vector<Internal::WVarCoreBase*> m_elasticReads;
+         size_t m_elasticNext;
+         //The WVar's that have been set.
+         SetMap m_set;
+
+         //Only the root's arena is used, see GetInlineValues
+         WInlineValueArena m_inlineValues;
+         WInlineValueArena& m_rootInlineValues;
+         
+         //The "transaction local" values
+         std::unordered_map<uint64_t, std::unique_ptr<Internal::WLocalValueBase>> m_locals;
+         
+         //list of functions to run just before the top-level
+         //transaction commits.
+         WBeforeCommitList m_beforeCommits;
+
+         //list of functions to run after the top-level transaction
+         //commits.
+         WAfterList m_afters;
+         //copies of the after functions that have to outlive the replaced values
+         WAfterList m_keptAfters;
+
+         //list of functions to run if transaction fails
+         WOnFailList m_onFails;
+      };
+
+#ifdef _DEBUG
+      void* const WTransactionData::MARKER_VALUE = (void*)0xdeadbeefdeadbeef;
+#endif //_DEBUG
+
+      WTransactionData::WTransactionData (WUpgradeableLock& lock, WEpochThread& epoch):
+#ifdef _DEBUG
+         m_marker (MARKER_VALUE),
+#endif //_DEBUG
+         m_active (false),
+         m_readOnly (false),
+         m_readsSnapshot (false),
+         m_inevitable (false),
+         m_hasDeltas (false),
+         m_level (1),
+         m_parent_p (nullptr),
+         m_readLock (false),
+         m_upgradeLock (lock),
+         m_epoch (epoch),
+#ifdef WSTM_CLOCK_ENGINE
+         m_readVersion (0),
+#else
+         m_snapshotSequence (0),
+#endif //WSTM_CLOCK_ENGINE
+         m_elasticWindow (0),
+         m_elasticNext (0),
+         m_rootInlineValues (m_inlineValues)
+      {}
+
+      WTransactionData* WTransactionData::CreateChild ()
+      {
+         if (!m_child_p)
+         {
+            m_child_p = std::make_unique<WTransactionData>(this);
+         }
+         
+         return m_child_p.get ();
+      }
+
+      WTransactionData::WTransactionData (WTransactionData* parent_p):
+#ifdef _DEBUG
+         m_marker (MARKER_VALUE),
+#endif //_DEBUG
+         m_active (false),
+         m_readOnly (false),
+         m_readsSnapshot (false),
+         m_inevitable (false),
+         m_hasDeltas (false),
+         m_level (parent_p->m_level + 1),
+         m_parent_p (parent_p),
+         m_readLock (false),
+         m_upgradeLock (parent_p->m_upgradeLock),
+         m_epoch (parent_p->m_epoch),
+#ifdef WSTM_CLOCK_ENGINE
+         m_readVersion (0),
+#else
+         m_snapshotSequence (0),
+#endif //WSTM_CLOCK_ENGINE
+         m_elasticWindow (0),
+         m_elasticNext (0),
+         m_rootInlineValues (parent_p->m_rootInlineValues)
+      {}
+      
+      void WTransactionData::Activate ()
+      {
+         m_active = true;
+         if (m_level == 1)
+         {
+            //the values read by the transaction have to stay around until it is done
+            m_epoch.Pin ();
+#ifdef WSTM_CLOCK_ENGINE
+            m_readVersion = s_clock.load ();
+#else
+            //if a commit is in progress the first read will have to wait for it to finish
+            m_snapshotSequence = s_commitSequence.load () & ~uint64_t (1);
+#endif //WSTM_CLOCK_ENGINE
+         }
+         else
+         {
+            m_inevitable = m_parent_p->m_inevitable;
+         }
+      }
+      
+      bool WTransactionData::IsActive () const
+      {
+         return m_active;
+      }
+         
+      WTransactionData* WTransactionData::GetParent () const
+      {
+         return m_parent_p;
+      }
+      
+      WTransactionData* WTransactionData::GetChild () const
+      {
+         return m_child_p.get ();
+      }
+
+      int WTransactionData::GetLevel () const
+      {
+         return m_level;
+      }
+
+      WReadLock& WTransactionData::GetReadLock ()
+      {
+         assert (m_active);
+         return m_readLock;
+      }
+      
+      WUpgradeableLock& WTransactionData::GetUpgradeLock ()
+      {
+         assert (m_active);
+         return m_upgradeLock;
+      }
+
+      WEpochThread& WTransactionData::GetEpoch ()
+      {
+         return m_epoch;
+      }
+
+#ifdef WSTM_CLOCK_ENGINE
+      uint64_t& WTransactionData::GetReadVersion ()
+      {
+         WTransactionData* root_p = this;
+         while (root_p->m_parent_p)
+         {
+            root_p = root_p->m_parent_p;
+         }
+         return root_p->m_readVersion;
+      }
+#else
+      uint64_t& WTransactionData::GetSnapshotSequence ()
+      {
+         WTransactionData* root_p = this;
+         while (root_p->m_parent_p)
+         {
+            root_p = root_p->m_parent_p;
+         }
+         return root_p->m_snapshotSequence;
+      }
+#endif //WSTM_CLOCK_ENGINE
+
+      void WTransactionData::SetReadOnly (const bool readOnly)
+      {
+         assert (m_active);
+         m_readOnly = (readOnly || (m_parent_p && m_parent_p->m_readOnly));
+         if (m_parent_p)
+         {
+            m_readsSnapshot = m_parent_p->m_readsSnapshot;
+            return;
+         }
+         
+         m_readsSnapshot = m_readOnly;
+         if (m_readOnly)
+         {
+            //The snapshot is published before it is taken so that commits either see it or
+            //happen before it (and then we don't need the values that they replace).
+#ifdef WSTM_CLOCK_ENGINE
+            m_epoch.PublishSnapshot (s_clock.load ());
+            m_readVersion = s_clock.load ();
+#else
+            m_epoch.PublishSnapshot (s_commitSequence.load () & ~uint64_t (1));
+            auto sequence = s_commitSequence.load ();
+            WBackoff backoff;
+            while (sequence & 1)
+            {
+               //a commit is in progress
+               backoff ();
+               sequence = s_commitSequence.load ();
+            }
+            m_snapshotSequence = sequence;
+#endif //WSTM_CLOCK_ENGINE
+         }
+      }
+
+      bool WTransactionData::IsReadOnly () const
+      {
+         return m_readOnly;
+      }
+
+      bool WTransactionData::ReadsSnapshot () const
+      {
+         return m_readsSnapshot;
+      }
+
+      void WTransactionData::SetInevitable (const bool inevitable)
+      {
+         assert (m_level == 1);
+         if (inevitable != m_inevitable)
+         {
+            if (inevitable)
+            {
+               BeginInevitable ();
+            }
+            else
+            {
+               EndInevitable ();
+            }
+            m_inevitable = inevitable;
+         }
+      }
+
+      bool WTransactionData::IsInevitable () const
+      {
+         return m_inevitable;
+      }
+
+      void WTransactionData::SetHasDeltas ()
+      {
+         WTransactionData* root_p = this;
+         while (root_p->m_parent_p)
+         {
+            root_p = root_p->m_parent_p;
+         }
+         root_p->m_hasDeltas = true;
+      }
+
+      bool WTransactionData::HasDeltas () const
+      {
+         return m_hasDeltas;
+      }
+
+      void WTransactionData::SetElastic (const unsigned int window)
+      {
+         assert (m_level == 1);
+         m_elasticWindow = window;
+      }
+
+      GotMap& WTransactionData::GetGot ()
+      {
+         assert (m_active);
+         return m_got;
+      }
+
+      void WTransactionData::AddGot (Internal::WVarCoreBase* core_p, const Internal::WValueBase* value_p)
+      {
+         assert (m_active);
+         WTransactionData* root_p = this;
+         while (root_p->m_parent_p)
+         {
+            root_p = root_p->m_parent_p;
+         }
+         if (root_p->m_elasticWindow > 0)
+         {
+            auto& reads = root_p->m_elasticReads;
+            if (reads.size () < root_p->m_elasticWindow)
+            {
+               reads.push_back (core_p);
+            }
+            else
+            {
+               //the read being released may have been merged into a parent by now
+               auto& oldest_p = reads[root_p->m_elasticNext];
+               for (auto data_p = this; data_p; data_p = data_p->m_parent_p)
+               {
+                  data_p->m_got.erase (oldest_p);
+               }
+               oldest_p = core_p;
+               root_p->m_elasticNext = (root_p->m_elasticNext + 1) % reads.size ();
+            }
+         }
+         m_got[core_p] = value_p;
+      }
+      
+      SetMap& WTransactionData::GetSet ()
+      {
+         assert (m_active);
+         return m_set;
+      }      
+
+      WInlineValueArena& WTransactionData::GetInlineValues ()
+      {
+         assert (m_active);
+         return m_rootInlineValues;
+      }
+
+      Internal::WLocalValueBase* WTransactionData::GetLocalValue (uint64_t key)
+      {
+         assert (m_active);
+         
+         WTransactionData* data_p = this;
+         while (data_p)
+         {
+            const auto it = data_p->m_locals.find (key);
+            if (it != data_p->m_locals.end ())
+            {
+               return it->second.get ();
+            }
+            data_p = data_p->m_parent_p;
+         }
+         
+         return nullptr;         
+      }
+      
+      void WTransactionData::SetLocalValue (uint64_t key, std::unique_ptr<Internal::WLocalValueBase>&& value_p)
+      {
+         assert (m_active);
+         m_locals[key] = std::move (value_p);
+      }
+
+      void WTransactionData::AddBeforeCommit (WAtomic::WBeforeCommitFunc& beforeCommit)
+      {
+         assert (m_active);
+         m_beforeCommits.push_back (beforeCommit);
+      }
+
+      void WTransactionData::GetBeforeCommits (WBeforeCommitList& beforeCommits)
+      {
+         assert (m_active);
+         beforeCommits.swap (m_beforeCommits);
+      }
+
+      void WTransactionData::AddAfter (WAtomic::WAfterFunc& after, const bool keep)
+      {
+         assert (m_active);
+         m_afters.push_back (after);
+         if (keep)
+         {
+            m_keptAfters.push_back (after);
+         }
+      }
+
+      void WTransactionData::GetAfters (WAfterList& afters, WAfterList& kept)
+      {
+         assert (m_active);
+         afters.swap (m_afters);
+         kept.swap (m_keptAfters);
+      }
+
+      void WTransactionData::AddOnFail (WAtomic::WOnFailFunc& onFail)
+      {
+         assert (m_active);
+         m_onFails.push_back (onFail);
+      }
+
+      void WTransactionData::RunOnFails ()
+      {
+         if (m_active)
+         {
+            for (const WAtomic::WOnFailFunc& func: m_onFails)
+            {
+               func ();
+            }
+         }
+         m_onFails.clear ();
+      }
+
+      void WTransactionData::MergeToParent ()
+      {
+         assert (m_active);
+         assert (m_parent_p);
+
+         for (GotMap::value_type& value: m_got)
+         {
+            m_parent_p->m_got[std::get<0>(value)] = std::get<1>(value);
+         }
+         for (SetMap::value_type& value: m_set)
+         {
+            m_parent_p->m_set[std::get<0>(value)] = std::move (std::get<1>(value));
+         }
+         for (auto& val: m_locals)
+         {
+            m_parent_p->m_locals[val.first] = std::move (val.second);
+         }
+
+         m_parent_p->m_beforeCommits.splice (m_parent_p->m_beforeCommits.end (), m_beforeCommits);
+         m_parent_p->m_afters.splice (m_parent_p->m_afters.end (), m_afters);
+         m_parent_p->m_keptAfters.splice (m_parent_p->m_keptAfters.end (), m_keptAfters);
+         m_parent_p->m_onFails.splice (m_parent_p->m_onFails.end (), m_onFails);
+         
+         Clear ();
+      }
+
+      void WTransactionData::MergeGetsToRoot ()
+      {
+         assert (m_active);
+         assert (m_parent_p);
+
+         WTransactionData* root_p = m_parent_p;
+         while (root_p->m_parent_p)
+         {
+            root_p = root_p->m_parent_p;
+         }
+         
+         for (GotMap::value_type& value: m_got)
+         {
+            m_parent_p->m_got[std::get<0>(value)] = std::get<1>(value);
+         }
+
+         Clear ();
+      }
+      
+      void WTransactionData::Clear ()
+      {
+         if (!m_got.empty ())
+         {
+            m_got.clear ();
+         }
+         ClearWrites ();
+         if (!m_onFails.empty ())
+         {
+            m_onFails.clear ();
+         }
+         if (m_level == 1)
+         {
+            //the got and set maps were the only things pointing at the inline values
+            m_inlineValues.Reset ();
+            m_elasticReads.clear ();
+            m_elasticNext = 0;
+            if (m_readsSnapshot)
+            {
+               m_epoch.ClearSnapshot ();
+            }
+            SetInevitable (false);
+            m_hasDeltas = false;
+         }
+         m_inevitable = false;
+         m_readOnly = false;
+         m_readsSnapshot = false;
+         if (m_active && m_level == 1)
+         {
+            //Old values aren't reclaimed here since freeing them can run transactions, the callers
+            //that know that it is safe to do so call WEpochThread::Reclaim themselves.
+            m_epoch.Unpin ();
+         }
+         m_active = false;
+      }      
+
+      void WTransactionData::ClearWrites()
+      {
+         if (!m_set.empty ())
+         {
+            m_set.clear ();
+         }
+
+         //For some reason we are getting random crashes when clearing
+         //the after list when the list is empty so only clear it when it
+         //is non-empty. 
+         if (!m_beforeCommits.empty ())
+         {
+            m_beforeCommits.clear();
+         }
+
+         if (!m_afters.empty ())
+         {
+            m_afters.clear();
+         }
+
+         if (!m_keptAfters.empty ())
+         {
+            m_keptAfters.clear();
+         }
+
+         if (!m_locals.empty ())
+         {
+            m_locals.clear ();
+         }
+
+         if (!m_upgradeLock.locked ())
+         {
+            m_readLock.UnlockAll ();
+         }
+         else if (m_level == 1)
+         {
+            m_upgradeLock.UnlockAll ();
+         }
+      }
+
+#ifdef _DEBUG
+      void* WTransactionData::GetMarker () const
+      {
+         return m_marker;
+      }
+#endif //_DEBUG
+   }
+   
+
+   namespace 
+   {      
+      //Stores the transaction data for each thread
+      class WTransactionDataList
+      {
+      public:
+         WTransactionDataList ();
+         
+         Internal::WTransactionData* Get ();
+         Internal::WTransactionData* GetNew ();
+
+         class WPushGuard
+         {
+         public:
+            WPushGuard (std::unique_ptr<Internal::WTransactionData>&& root_p, Internal::WTransactionData* cur_p);
+            WPushGuard (WPushGuard&& g);
+            ~WPushGuard ();
+            
+         private:
+            std::unique_ptr<Internal::WTransactionData> m_root_p;
+            Internal::WTransactionData* m_cur_p;
+         };
+         friend WPushGuard;
+         WPushGuard Push ();
+         //Takes the current root transaction out of the list so that another one can be started
+         //(see AtomicallyBatch), it stays active until it is cleared.
+         std::unique_ptr<Internal::WTransactionData> Detach ();
+         
+         void MergeToParent ();
+         void Abandon ();
+
+         WEpochThread& GetEpoch ();
+
+         void CheckIntegrity () const;
+         
+      private:
+         Internal::WTransactionData* GetNewNoActivate ();
+
+         std::unique_ptr<Internal::WTransactionData> m_root_p;
+         Internal::WTransactionData* m_cur_p;
+         WUpgradeableLock m_lock;
+         WEpochThread m_epoch;
+      };
+
+      THREAD_LOCAL (WTransactionDataList, s_transData_p);
+
+      WTransactionDataList::WTransactionDataList ():
+         m_cur_p (nullptr),
+         m_lock (false)
+      {}
+
+      Internal::WTransactionData* WTransactionDataList::Get ()
+      {
+         if (m_cur_p)
+         {
+            return m_cur_p;
+         }
+         else
+         {
+            return GetNewNoActivate ();
+         }
+      }
+
+      Internal::WTransactionData* WTransactionDataList::GetNew ()
+      {
+         Internal::WTransactionData* data_p = GetNewNoActivate ();
+         data_p->Activate();
+         return data_p;
+      }
+
+      Internal::WTransactionData* WTransactionDataList::GetNewNoActivate ()
+      {
+         CheckIntegrity ();
+         if (!m_cur_p)
+         {
+            assert (!m_root_p);
+            m_root_p = std::make_unique<Internal::WTransactionData>(m_lock, m_epoch);
+            m_cur_p = m_root_p.get ();
+         }
+         else if (m_cur_p->IsActive ())
+         {
+            m_cur_p = m_cur_p->CreateChild ();
+            assert (!m_cur_p->IsActive ());
+         }
+         //Note: if m_cur_p wasn't active above then we just use it
+         CheckIntegrity ();
+         
+         return m_cur_p;
+      }
+
+      WTransactionDataList::WPushGuard::WPushGuard (std::unique_ptr<Internal::WTransactionData>&& root_p, Internal::WTransactionData* cur_p):
+         m_root_p (std::move (root_p)),
+         m_cur_p (cur_p)
+      {}
+      
+      WTransactionDataList::WPushGuard::WPushGuard (WPushGuard&& g):
+         m_root_p (std::move (g.m_root_p)),
+         m_cur_p (g.m_cur_p)
+      {}
+      
+      WTransactionDataList::WPushGuard::~WPushGuard ()
+      {
+         s_transData_p->m_root_p = std::move (m_root_p);
+         s_transData_p->m_cur_p = m_cur_p;
+      }
+
+      WTransactionDataList::WPushGuard WTransactionDataList::Push ()
+      {
+         CheckIntegrity ();
+         auto oldRoot_p = std::move (m_root_p);
+         auto oldCur_p = m_cur_p;
+         m_root_p.reset ();
+         m_cur_p = nullptr;
+         return WPushGuard (std::move (oldRoot_p), oldCur_p);
+      }
+
+      std::unique_ptr<Internal::WTransactionData> WTransactionDataList::Detach ()
+      {
+         CheckIntegrity ();
+         assert (m_cur_p == m_root_p.get ());
+         m_cur_p = nullptr;
+         return std::move (m_root_p);
+      }
+
+      void WTransactionDataList::MergeToParent ()
+      {
+         CheckIntegrity ();
+         assert (m_cur_p->IsActive ());
+         assert (m_cur_p->GetParent ());
+         if (m_cur_p->GetParent ())
+         {
+            m_cur_p->MergeToParent ();
+            m_cur_p = m_cur_p->GetParent ();
+            CheckIntegrity ();
+         }
+      }
+
+      void WTransactionDataList::Abandon ()
+      {
+         assert (m_cur_p);
+         if (!m_cur_p)
+         {
+            return;
+         }
+         m_cur_p->Clear ();
+         
+         if (m_cur_p->GetParent ())
+         {
+            m_cur_p = m_cur_p->GetParent ();
+            CheckIntegrity ();
+         }
+         else
+         {
+            m_epoch.Reclaim ();
+         }
+      }
+
+      WEpochThread& WTransactionDataList::GetEpoch ()
+      {
+         return m_epoch;
+      }
+
+//#define CHECK_TLS_INTEGRITY
+#ifdef CHECK_TLS_INTEGRITY
+
+      void WTransactionDataList::CheckIntegrity () const
+      {
+         if (m_cur_p)
+         {            
+            Internal::WTransactionData* cur_p = m_cur_p;
+            Internal::WTransactionData* parent_p = cur_p->GetParent ();
+            assert (cur_p->GetMarker () == Internal::WTransactionData::MARKER_VALUE);
+            
+            while (parent_p)
+            {
+               assert (parent_p->GetMarker () == Internal::WTransactionData::MARKER_VALUE);
+               assert (parent_p->GetChild () == cur_p);
+               assert (parent_p->GetLevel () == (cur_p->GetLevel () - 1));
+               cur_p = parent_p;
+               parent_p = cur_p->GetParent ();
+            }
+
+            cur_p = m_cur_p;
+            Internal::WTransactionData* child_p = cur_p->GetChild ();
+            while (child_p)
+            {
+               assert (child_p->GetMarker () == Internal::WTransactionData::MARKER_VALUE);
+               assert (child_p->GetParent () == cur_p);
+               assert (child_p->GetLevel () == (cur_p->GetLevel () + 1));
+               cur_p = child_p;
+               child_p = cur_p->GetChild ();
+            }
+         }
+      }
+      
+#else
+      void WTransactionDataList::CheckIntegrity () const
+      {}
+#endif //CHECK_TLS_INTEGRITY
+
+   }
+
+   WTimeArg::WTimeArg ()
+   {}
+   
+   WTimeArg::WTimeArg (const time_point& t):
+      m_time_o (t)
+   {}
+
+   WTimeArg WTimeArg::Unlimited ()
+   {
+      return WTimeArg ();
+   }
+
+   bool WTimeArg::IsUnlimited () const
+   {
+      return !m_time_o;
+   }
+
+   bool WTimeArg::operator<(const WTimeArg& t) const
+   {
+      if (IsUnlimited ())
+      {
+         //nothing is less than unlimited
+         return false;
+      }
+      else if (!t.IsUnlimited ())
+      {
+         return (*m_time_o < *t.m_time_o);
+      }
+      else
+      {
+         //something limited is always less than an unlimited value
+         return true;
+      }
+   }
+
+   namespace Internal
+   {
+      
+#ifdef _DEBUG
+
+      bool ReadLocked()
+      {
+         return s_readMutexReadLocked;
+      }
+      
+      bool UpgradeLocked()
+      {
+         return s_readMutexUpgradeLocked;
+      }
+      
+      bool WriteLocked()
+      {
+         return s_readMutexWriteLocked;
+      }      
+#endif //_DEBUG
+
+      WValueBase::WValueBase (const size_t version):
+         m_version (version)
+      {}
+
+      WValueBase::~WValueBase ()
+      {
+      }
+
+      void WValueBase::ApplyDelta (const WVarCoreBase&)
+      {}
+
+      WVarCoreBase::WVarCoreBase (std::unique_ptr<WValueBase>&& val_p):
+#if defined (WSTM_CLOCK_ENGINE) && !defined (WSTM_STRIPED_LOCKS)
+         m_value_p (val_p.get ()),
+         m_versionLock (MakeLockWord (val_p.release ()->m_version)),
+#else
+         m_value_p (val_p.release ()),
+#endif //WSTM_CLOCK_ENGINE && !WSTM_STRIPED_LOCKS
+         m_history_p (nullptr),
+         m_isCurrentValue_p (nullptr),
+         m_numWaiters (0),
+         m_inline (false),
+         m_named (false),
+         m_attributed (false)
+      {}
+
+      WVarCoreBase::WVarCoreBase ():
+         m_value_p (nullptr),
+#if defined (WSTM_CLOCK_ENGINE) && !defined (WSTM_STRIPED_LOCKS)
+         m_versionLock (MakeLockWord (0)),
+#endif //WSTM_CLOCK_ENGINE && !WSTM_STRIPED_LOCKS
+         m_history_p (nullptr),
+         m_isCurrentValue_p (nullptr),
+         m_numWaiters (0),
+         m_inline (true),
+         m_named (false),
+         m_attributed (false)
+      {}
+      
+      WVarCoreBase::~WVarCoreBase ()
+      {
+         //Any transaction that read the current value holds a reference to us so nobody can be
+         //using it anymore.
+         delete m_value_p.load (std::memory_order_relaxed);
+         delete m_history_p;
+         //A conflict can only be put down to us while a transaction that read us has the epoch
+         //pinned, so nothing can be recording one now. Another core could get our address so our
+         //counts are moved to the destroyed variables.
+         if (m_attributed)
+         {
+            //we could have been named after the conflicts were recorded
+            const auto name = m_named ? GetVarName (*this) : std::string ();
+            std::lock_guard<std::mutex> lock (s_hotVarsMutex);
+            const auto it = s_hotVars.find (this);
+            //ResetHotVariables could have dropped them already
+            if (it != s_hotVars.end ())
+            {
+               AddCounts (s_destroyedHotVars[name], it->second);
+               s_hotVars.erase (it);
+            }
+         }
+         if (m_named)
+         {
+            std::lock_guard<std::mutex> lock (s_varNamesMutex);
+            s_varNames.erase (this);
+         }
+      }
+
+      void WVarCoreBase::EnableHistory (const size_t maxVersions)
+      {
+         assert (!m_history_p);
+         m_history_p = new WHistory (maxVersions);
+      }
+
+      size_t WVarCoreBase::GetHistoryLength () const
+      {
+         return m_history_p ? m_history_p->m_length.load (std::memory_order_relaxed) : 0;
+      }
+
+      size_t WVarCoreBase::GetHistoryMemory (const size_t valueSize) const
+      {
+         return m_history_p ? sizeof (WHistory) + GetHistoryLength ()*(sizeof (WVersion) + valueSize) : 0;
+      }
+
+      void RetireCore (std::shared_ptr<WVarCoreBase>&& core_p)
+      {
+         if (!core_p)
+         {
+            return;
+         }
+         if (s_epochThreadState != 2)
+         {
+            s_transData_p->GetEpoch ().RetireCore (std::move (core_p));
+         }
+         else if (WEpochThread::GetMinPinnedEpoch () != UNPINNED)
+         {
+            //This thread's reclamation state is already gone, leave the core for another thread to
+            //free.
+            auto r_p = new WRetired (s_epoch.load ());
+            r_p->m_cores.push_back (std::move (core_p));
+            AddOrphans (r_p, r_p);
+         }
+         //else nobody can be reading the core so it can go right away
+      }
+
+#ifndef WSTM_CLOCK_ENGINE
+      bool WVarCoreBase::Validate (const size_t version) const
+      {
+         return (version == GetVersion ());
+      }
+
+      bool WVarCoreBase::Validate (const WValueBase& val) const
+      {
+         return (Validate (val.m_version) || (m_isCurrentValue_p && m_isCurrentValue_p (*this, val)));
+      }
+
+      size_t WVarCoreBase::GetVersion () const
+      {
+         return m_inline ? GetInlineVersion () : m_value_p.load (std::memory_order_acquire)->m_version;
+      }
+#endif //!WSTM_CLOCK_ENGINE
+      
+      std::unique_ptr<WValueBase> WVarCoreBase::Commit (std::unique_ptr<WValueBase>&& val_p)
+      {
+         assert (!m_inline);
+         return std::unique_ptr<WValueBase>(m_value_p.exchange (val_p.release (), std::memory_order_acq_rel));
+      }
+
+      const WValueBase* WVarCoreBase::ReadInline (void*) const
+      {
+         assert (false);
+         return nullptr;
+      }
+
+      size_t WVarCoreBase::GetInlineVersion () const
+      {
+         assert (false);
+         return 0;
+      }
+
+      void WVarCoreBase::CommitInline (const WValueBase&)
+      {
+         assert (false);
+      }
+
+      std::unique_ptr<WValueBase> WVarCoreBase::CopyInline () const
+      {
+         assert (false);
+         return nullptr;
+      }
+
+#ifdef WSTM_CLOCK_ENGINE
+      WCommitGate::WCommitGate ():
+         m_holds (0)
+      {}
+      
+      void WCommitGate::lock_shared ()
+      {
+         ++m_holds;
+      }
+      
+      bool WCommitGate::try_lock_shared ()
+      {
+         lock_shared ();
+         return true;
+      }
+      
+      void WCommitGate::unlock_shared ()
+      {
+         Release ();
+      }
+
+      void WCommitGate::lock_upgrade ()
+      {
+         m_upgradeMutex.lock ();
+         ++m_holds;
+      }
+      
+      bool WCommitGate::try_lock_upgrade ()
+      {
+         if (!m_upgradeMutex.try_lock ())
+         {
+            return false;
+         }
+         ++m_holds;
+         return true;
+      }
+      
+      void WCommitGate::unlock_upgrade ()
+      {
+         Release ();
+         m_upgradeMutex.unlock ();
+      }
+
+      bool WCommitGate::IsOpen (const int ownHolds) const
+      {
+         return (m_holds.load () == ownHolds);
+      }
+      
+      void WCommitGate::WaitOpen (const int ownHolds)
+      {
+         std::unique_lock<std::mutex> lock (m_waitMutex);
+         m_opened.wait (lock, [&](){return IsOpen (ownHolds);});
+      }
+
+      void WCommitGate::Release ()
+      {
+         --m_holds;
+         //A RUN_LOCKED committer is waiting for the holds to drop to one, not zero, so notify on
+         //every release. Locking the mutex makes sure that a waiter that just checked the hold count
+         //is actually waiting before we notify. 
+         {
+            std::lock_guard<std::mutex> lock (m_waitMutex);
+         }
+         m_opened.notify_all ();
+      }
+#endif //WSTM_CLOCK_ENGINE
+
+   }
    
    WAtomic::WAtomic ():
       m_data_p (s_transData_p->GetNew ()),
       m_committed (false)
    {
-#ifdef _DEBUG
-      Internal::WTransactionData* data_p = m_data_p;
-      while (data_p)
+#ifdef _DEBUG
+      Internal::WTransactionData* data_p = m_data_p;
+      while (data_p)
+      {
+         assert (data_p->IsActive ());
+         data_p = data_p->GetParent ();
+      }
+#endif //DEBUG
+   }
+
+   void WAtomic::Validate() const
+   {
+#ifndef WSTM_CLOCK_ENGINE
+      boost::unique_lock<WReadLock> lock(m_data_p->GetReadLock (), boost::defer_lock_t ());
+      if (!m_data_p->GetUpgradeLock ().locked ())
+      {
+         lock.lock ();
+      }
+#endif //!WSTM_CLOCK_ENGINE
+      if(!DoValidation())
+      {
+         throw Internal::WFailedValidationException();
+      }
+   }
+
+#ifdef WSTM_CLOCK_ENGINE
+   namespace
+   {
+      //Checks the reads of the given transaction (and its parents if withParents is set) against
+      //the read version. If they are all valid validAt is set to a clock value that they were all
+      //current at.
+      bool ValidateReads (Internal::WTransactionData& data, const uint64_t readVersion, const bool withParents, uint64_t& validAt)
+      {
+         validAt = s_clock.load ();
+         auto compared = false;
+         for (auto data_p = &data; data_p; data_p = withParents ? data_p->GetParent () : nullptr)
+         {
+            for (const GotMap::value_type& val: data_p->GetGot ())
+            {
+               if (!IsReadValid (*val.first, readVersion))
+               {
+                  if (!HasSameValue (*val.first, *val.second))
+                  {
+                     NoteConflict (val.first);
+                     return false;
+                  }
+                  compared = true;
+               }
+            }
+         }
+         //If nothing was committed while we were checking then the compared values were all
+         //current at the same time as the rest.
+         return (!compared || s_clock.load () == validAt);
+      }
+   }
+#endif //WSTM_CLOCK_ENGINE
+
+   bool WAtomic::DoValidation() const
+   {
+      WLatencyTimer timer (LATENCY_VALIDATION);
+      const auto traceStart = TraceStart ();
+      auto valid = true;
+#ifdef WSTM_CLOCK_ENGINE
+      auto validAt = uint64_t (0);
+      valid = ValidateReads (*m_data_p, m_data_p->GetReadVersion (), false, validAt);
+#else
+      assert(Internal::ReadLocked() || Internal::UpgradeLocked ());
+      for (const GotMap::value_type& val: m_data_p->GetGot ())
       {
-         assert (data_p->IsActive ());
-         data_p = data_p->GetParent ();
+         if (!val.first->Validate (*val.second))
+         {
+            NoteConflict (val.first);
+            valid = false;
+            break;
+         }
       }
-#endif //DEBUG
+#endif //WSTM_CLOCK_ENGINE
+
+      if (traceStart)
+      {
+         Trace (valid ? TRACE_VALIDATE : TRACE_INVALID, traceStart, m_data_p->GetGot ().size (), 0);
+      }
+      return valid;
    }
 
-   void WAtomic::Validate() const
+   void WAtomic::ReadLock()
    {
-      boost::unique_lock<WReadLock> lock(m_data_p->GetReadLock (), boost::defer_lock_t ());
       if (!m_data_p->GetUpgradeLock ().locked ())
       {
-         lock.lock ();
+         m_data_p->GetReadLock ().lock();
       }
-      if(!DoValidation())
+   }
+
+   bool WAtomic::IsReadLocked() const
+   {
+      return m_data_p->GetReadLock ().locked ();
+   }
+
+   void WAtomic::ReadUnlock()
+   {
+      if (!m_data_p->GetUpgradeLock ().locked ())
       {
-         throw Internal::WFailedValidationException();
+         m_data_p->GetReadLock ().unlock();
       }
    }
 
-   bool WAtomic::DoValidation() const
+   void WAtomic::BeforeCommit (WBeforeCommitFunc func)
    {
-      assert(Internal::ReadLocked() || Internal::UpgradeLocked ());
-      for (const VarMap::value_type& val: m_data_p->GetGot ())
+      m_data_p->AddBeforeCommit (func);
+   }
+
+   void WAtomic::After(WAfterFunc func)
+   {
+      m_data_p->AddAfter (func, false);
+   }
+
+   void WAtomic::AfterOutlivingValues (WAfterFunc func)
+   {
+      m_data_p->AddAfter (func, true);
+   }
+
+   void WAtomic::OnFail (WOnFailFunc func)
+   {
+      m_data_p->AddOnFail (func);
+   }
+
+   void WAtomic::ClearWrites()
+   {
+      m_data_p->ClearWrites ();
+   }
+
+   void WAtomic::Abort ()
+   {
+      m_data_p->Clear ();
+   }
+
+   void WAtomic::Restart ()
+   {
+      //We need to push our transaction data aside here, if we don't
+      //and a destructor triggered by the clearing of data below
+      //starts a new transaction it will end up being a child of the
+      //transaction that is being restarted. If this happens at best
+      //the actions of the detstructor will never be comitted, at
+      //worst memory corruption will result.
+      WTransactionDataList::WPushGuard guard = s_transData_p->Push ();
+      const auto readOnly = m_data_p->IsReadOnly ();
+      m_data_p->Clear ();
+      m_data_p->GetEpoch ().Reclaim ();
+      m_data_p->Activate ();
+      m_data_p->SetReadOnly (readOnly);
+   }
+
+   void WAtomic::RestartAfterConflict (WContentionPolicy* policy_p, WContentionInfo& info)
+   {
+      if (!policy_p)
+      {
+         Restart ();
+         return;
+      }
+
+      //see Restart
+      WTransactionDataList::WPushGuard guard = s_transData_p->Push ();
+      const auto readOnly = m_data_p->IsReadOnly ();
+      info.m_karma += m_data_p->GetGot ().size () + m_data_p->GetSet ().size ();
+      m_data_p->Clear ();
+      m_data_p->GetEpoch ().Reclaim ();
+      //the transaction isn't pinned while the policy waits so values can still be reclaimed
+      {
+         WProfileTimer timer (PROFILE_CONTENTION_WAIT_NS);
+         policy_p->OnConflict (info);
+      }
+      m_data_p->Activate ();
+      m_data_p->SetReadOnly (readOnly);
+   }
+
+   void WAtomic::RunOnFails ()
+   {
+      //We need to push our transaction data aside here so that
+      //transactions in the "on fail" handlers will run properly
+      //(properly here means: no memory corruption)
+      WTransactionDataList::WPushGuard guard = s_transData_p->Push ();
+      m_data_p->RunOnFails ();
+   }
+
+   void WAtomic::CommitLock()
+   {
+      if (!m_data_p->GetUpgradeLock ().locked ())
       {
-         if (!val.first->Validate (*val.second))
          {
-            return false;
+            WProfileTimer timer (PROFILE_COMMIT_WAIT_NS);
+            WLatencyTimer latencyTimer (LATENCY_LOCK);
+            m_data_p->GetUpgradeLock ().lock ();
          }
+         //unlock all the old read-locks here else we won't be able to
+         //promote our upgrade lock later
+         m_data_p->GetReadLock ().UnlockAll ();
       }
+   }
+   
+   namespace
+   {
+      enum class WCommitResult
+      {
+         PENDING,
+         COMMITTED,
+         CONFLICT,
+         //the transaction writes something that the inevitable transaction has read
+         GIVE_WAY
+      };
 
-      return true;
+      //A root transaction that is committed along with others by CommitBatch.
+      struct WBatchCommit
+      {
+         Internal::WTransactionData* m_data_p;
+         WRetired* m_retired_p;
+         WCommitResult m_result;
+         //the variable that the commit conflicted over
+         const Internal::WVarCoreBase* m_conflict_p;
+      };
    }
+   
+#ifdef WSTM_CLOCK_ENGINE
+   namespace
+   {
+      struct WLockEntry
+      {
+         std::atomic<uint64_t>* m_lock_p;
+         //the version lock word from before we locked it
+         uint64_t m_word;
+         //whether anything covered by the lock was written
+         bool m_written;
 
-   void WAtomic::ReadLock()
+         bool operator<(const WLockEntry& e) const
+         {
+            return m_lock_p < e.m_lock_p;
+         }
+
+         bool operator==(const WLockEntry& e) const
+         {
+            return m_lock_p == e.m_lock_p;
+         }
+      };
+
+      std::vector<WLockEntry>::iterator FindLock (std::vector<WLockEntry>& locks, const Internal::WVarCoreBase& core)
+      {
+         auto& versionLock = GetVersionLock (core);
+         const auto it = std::lower_bound (locks.begin (), locks.end (), WLockEntry {&versionLock, 0, false});
+         return (it != locks.end () && it->m_lock_p == &versionLock) ? it : locks.end ();
+      }
+
+      //Checks the reads of a root transaction that is being committed by CommitBatch, locks holds
+      //the version locks that CommitBatch has taken. Locks that earlier transactions in the batch
+      //have written under don't have their new versions yet so reads covered by them are only
+      //valid if the value can be compared.
+      bool ValidateCommitReads (Internal::WTransactionData& data, std::vector<WLockEntry>& locks, const uint64_t writeVersion, const bool batchWritten)
+      {
+         //If nobody else committed since our read version was taken then the read set can't have
+         //changed. 
+         if (!batchWritten && writeVersion == data.GetReadVersion () + 1)
+         {
+            return true;
+         }
+         
+         WLatencyTimer validationTimer (LATENCY_VALIDATION);
+         auto compared = false;
+         for (const GotMap::value_type& val: data.GetGot ())
+         {
+            auto& core = *val.first;
+            const auto it = FindLock (locks, core);
+            const auto ours = (it != locks.end ());
+            auto valid = ours ?
+               (!it->m_written && GetVersion (it->m_word) <= data.GetReadVersion ()) :
+               IsReadValid (core, data.GetReadVersion ());
+            if (!valid)
+            {
+               //nobody else can change the variables that we have locked
+               valid = ours ?
+                  (core.m_isCurrentValue_p && core.m_isCurrentValue_p (core, *val.second)) :
+                  HasSameValue (core, *val.second);
+               compared = true;
+            }
+            if (!valid)
+            {
+               NoteConflict (&core);
+               return false;
+            }
+         }
+         //see ValidateReads
+         return (!compared || s_clock.load () == writeVersion);
+      }
+   
+      //Commits the writes of the given root transactions together using the version clock. The
+      //version locks for all of them are taken at once and they share a write version. The
+      //transactions are committed in order, each one is checked against the writes of the ones
+      //before it, and only the ones whose reads are still valid are written (see
+      //WBatchCommit::m_result).
+      void CommitBatch (WBatchCommit* const commits, const size_t numCommits)
+      {
+         //Our own explicit read locks would keep us from committing, they would be dropped by
+         //CommitLock with the lock based engine too.
+         for (auto i = size_t (0); i < numCommits; ++i)
+         {
+            commits[i].m_data_p->GetReadLock ().UnlockAll ();
+         }
+         const auto ownHolds = commits[0].m_data_p->GetUpgradeLock ().locked () ? 1 : 0;
+
+         //The version locks are taken in address order so that two committers can't deadlock. With
+         //striped locks several variables can share a lock so duplicates have to be dropped.
+         auto numWrites = size_t (0);
+         for (auto i = size_t (0); i < numCommits; ++i)
+         {
+            numWrites += commits[i].m_data_p->GetSet ().size ();
+         }
+         auto locks = std::vector<WLockEntry>();
+         locks.reserve (numWrites);
+         for (auto i = size_t (0); i < numCommits; ++i)
+         {
+            for (const SetMap::value_type& val: commits[i].m_data_p->GetSet ())
+            {
+               locks.push_back (WLockEntry {&GetVersionLock (*val.first), 0, false});
+            }
+         }
+         if (locks.empty ())
+         {
+            //Nothing is written so there is nothing to lock, see WAtomic::Commit.
+            for (auto i = size_t (0); i < numCommits; ++i)
+            {
+               auto& data = *commits[i].m_data_p;
+               auto validAt = uint64_t (0);
+               const auto valid = (data.IsReadOnly () ||
+                                   s_clock.load () == data.GetReadVersion () ||
+                                   ValidateReads (data, data.GetReadVersion (), false, validAt));
+               commits[i].m_result = valid ? WCommitResult::COMMITTED : WCommitResult::CONFLICT;
+               commits[i].m_conflict_p = valid ? nullptr : TakeConflict ();
+            }
+            return;
+         }
+         std::sort (locks.begin (), locks.end ());
+         locks.erase (std::unique (locks.begin (), locks.end ()), locks.end ());
+      
+         const auto unlockAll = [&]()
+            {
+               for (const auto& l: locks)
+               {
+                  l.m_lock_p->store (l.m_word, std::memory_order_release);
+               }
+            };
+      
+         WLatencyTimer lockTimer (LATENCY_LOCK);
+         for (;;)
+         {
+            for (auto& l: locks)
+            {
+               l.m_word = LockVersion (*l.m_lock_p);
+            }
+            //Any transaction that takes the gate after this check will see our version locks and wait
+            //for us to finish.
+            if (s_readMutex.IsOpen (ownHolds))
+            {
+               break;
+            }
+            //Don't hold the version locks while waiting, the transaction holding the gate may need to
+            //read them. 
+            unlockAll ();
+            s_readMutex.WaitOpen (ownHolds);
+         }
+         lockTimer.Stop ();
+
+         //Anything that the inevitable transaction has read can't change until it finishes.
+         auto numLeft = size_t (0);
+         for (auto i = size_t (0); i < numCommits; ++i)
+         {
+            auto& data = *commits[i].m_data_p;
+            const auto giveWay = (!data.IsInevitable () && WritesInevitableRead (data.GetSet ()));
+            commits[i].m_result = giveWay ? WCommitResult::GIVE_WAY : WCommitResult::PENDING;
+            numLeft += giveWay ? 0 : 1;
+         }
+         if (numLeft == 0)
+         {
+            unlockAll ();
+            return;
+         }
+         
+         const auto writeVersion = s_clock.fetch_add (1) + 1;
+         auto batchWritten = false;
+         for (auto i = size_t (0); i < numCommits; ++i)
+         {
+            auto& commit = commits[i];
+            if (commit.m_result != WCommitResult::PENDING)
+            {
+               continue;
+            }
+            auto& data = *commit.m_data_p;
+            if (!ValidateCommitReads (data, locks, writeVersion, batchWritten))
+            {
+               commit.m_result = WCommitResult::CONFLICT;
+               commit.m_conflict_p = TakeConflict ();
+               continue;
+            }
+            
+            auto& set = data.GetSet ();
+            const auto applyDeltas = data.HasDeltas ();
+            auto silent = std::vector<Internal::WVarCoreBase*>();
+            for (SetMap::value_type& val: set)
+            {
+               if (applyDeltas)
+               {
+                  val.second->ApplyDelta (*val.first);
+               }
+               if (IsSilentStore (val))
+               {
+                  silent.push_back (val.first.get ());
+                  continue;
+               }
+               val.second->m_version = writeVersion;
+               CommitValue (val, commit.m_retired_p);
+               //Locks that only cover silent stores get their old version back.
+               FindLock (locks, *val.first)->m_written = true;
+               batchWritten = true;
+            }
+            for (const auto core_p: silent)
+            {
+               set.erase (core_p);
+            }
+            commit.m_result = WCommitResult::COMMITTED;
+         }
+         const auto unlockWord = MakeLockWord (writeVersion);
+         for (const auto& l: locks)
+         {
+            l.m_lock_p->store (l.m_written ? unlockWord : l.m_word, std::memory_order_release);
+         }
+         for (auto i = size_t (0); i < numCommits; ++i)
+         {
+            if (commits[i].m_result == WCommitResult::COMMITTED)
+            {
+               NotifyCommit (commits[i].m_data_p->GetSet ());
+            }
+         }
+      }
+      
+      //Commits the writes of the given root transaction using the version clock. Returns false if
+      //the transaction's reads are no longer valid, in which case nothing is written.
+      bool CommitWrites (Internal::WTransactionData& data, WRetired* retired_p)
+      {
+         auto commit = WBatchCommit {&data, retired_p, WCommitResult::PENDING, nullptr};
+         CommitBatch (&commit, 1);
+         if (commit.m_result == WCommitResult::GIVE_WAY)
+         {
+            //a RUN_LOCKED transaction's hold on the gate would keep the inevitable one from committing
+            data.GetUpgradeLock ().UnlockAll ();
+            WaitForInevitable (data.GetSet ());
+         }
+         NoteConflict (commit.m_conflict_p);
+         return (commit.m_result == WCommitResult::COMMITTED);
+      }
+   }
+#else
+   namespace
    {
-      if (!m_data_p->GetUpgradeLock ().locked ())
+      //Writes the values set by the given root transaction, the caller must be holding the write
+      //lock. Returns false if the transaction has to give way to the inevitable transaction, in
+      //which case nothing is written.
+      bool WriteValues (Internal::WTransactionData& data, WRetired* retired_p)
+      {
+         auto& set = data.GetSet ();
+         //We're the only writer so the sequence doesn't need a read-modify-write. The store is
+         //sequentially consistent since it is what the inevitable transaction checks for commits
+         //in progress.
+         const auto sequence = s_commitSequence.load (std::memory_order_relaxed);
+         s_commitSequence.store (sequence + 1);
+         std::atomic_thread_fence (std::memory_order_release);
+         //Anything that the inevitable transaction has read can't change until it finishes.
+         if (!data.IsInevitable () && WritesInevitableRead (set))
+         {
+            //nothing has been written
+            s_commitSequence.store (sequence, std::memory_order_release);
+            return false;
+         }
+         
+         const auto applyDeltas = data.HasDeltas ();
+         auto silent = std::vector<Internal::WVarCoreBase*>();
+         for (SetMap::value_type& val: set)
+         {
+            if (applyDeltas)
+            {
+               val.second->ApplyDelta (*val.first);
+            }
+            if (IsSilentStore (val))
+            {
+               silent.push_back (val.first.get ());
+               continue;
+            }
+            //A value's version is the sequence number of the commit that wrote it, so versions
+            //double as commit times for read-only transactions.
+            val.second->m_version = sequence + 2;
+            CommitValue (val, retired_p);
+         }
+         s_commitSequence.store (sequence + 2, std::memory_order_release);
+         //nobody waiting on the silent stores' variables needs to be woken up
+         for (const auto core_p: silent)
+         {
+            set.erase (core_p);
+         }
+         return true;
+      }
+
+      //Validates the reads of the given root transaction and writes its values if they are
+      //valid, the caller must be holding the write lock. conflict_p is set to the variable that
+      //was found to have changed if the reads aren't valid.
+      WCommitResult ValidateAndWrite (Internal::WTransactionData& data, WRetired* retired_p, const Internal::WVarCoreBase*& conflict_p)
+      {
+         const auto& got = data.GetGot ();
+         const auto it = std::find_if (got.begin (), got.end (),
+                                       [](const GotMap::value_type& val){return !val.first->Validate (*val.second);});
+         if (it != got.end ())
+         {
+            conflict_p = it->first;
+            return WCommitResult::CONFLICT;
+         }
+         if (data.GetSet ().empty ())
+         {
+            return WCommitResult::COMMITTED;
+         }
+         return WriteValues (data, retired_p) ? WCommitResult::COMMITTED : WCommitResult::GIVE_WAY;
+      }
+
+      //Commits the given root transactions together under one hold of the write lock. They are
+      //committed in order, each one is validated against the writes of the ones before it, and
+      //only the ones whose reads are still valid are written (see WBatchCommit::m_result). The
+      //transactions must not be holding any locks.
+      void CommitBatch (WBatchCommit* const commits, const size_t numCommits)
+      {
+         auto& lock = commits[0].m_data_p->GetUpgradeLock ();
+         const auto writes = std::any_of (commits, commits + numCommits,
+                                          [](const WBatchCommit& commit){return !commit.m_data_p->GetSet ().empty ();});
+         if (!writes)
+         {
+            //see WAtomic::Commit
+            auto& readLock = commits[0].m_data_p->GetReadLock ();
+            readLock.lock ();
+            for (auto i = size_t (0); i < numCommits; ++i)
+            {
+               commits[i].m_result = ValidateAndWrite (*commits[i].m_data_p, nullptr, commits[i].m_conflict_p);
+            }
+            readLock.UnlockAll ();
+            return;
+         }
+         
+         //our read locks would keep us from getting the write lock
+         for (auto i = size_t (0); i < numCommits; ++i)
+         {
+            commits[i].m_data_p->GetReadLock ().UnlockAll ();
+         }
+         {
+            WProfileTimer timer (PROFILE_COMMIT_WAIT_NS);
+            WLatencyTimer latencyTimer (LATENCY_LOCK);
+            lock.lock ();
+         }
+         {
+            WWriteLock wlock (lock);
+            for (auto i = size_t (0); i < numCommits; ++i)
+            {
+               commits[i].m_result = ValidateAndWrite (*commits[i].m_data_p, commits[i].m_retired_p, commits[i].m_conflict_p);
+            }
+         }
+         lock.unlock ();
+         for (auto i = size_t (0); i < numCommits; ++i)
+         {
+            if (commits[i].m_result == WCommitResult::COMMITTED)
+            {
+               NotifyCommit (commits[i].m_data_p->GetSet ());
+            }
+         }
+      }
+
+      //With commit combining on, transactions that find the commit lock taken publish their
+      //commits in these slots. Whoever holds the lock takes the commits out of the slots and does
+      //them along with its own.
+      struct WCommitRequest
+      {
+         Internal::WTransactionData& m_data;
+         WRetired* m_retired_p;
+         //the variable that the commit conflicted over
+         const Internal::WVarCoreBase* m_conflict_p;
+         //Stays PENDING until the commit has been done, the thread doing the commit doesn't touch
+         //the request again once it sets this.
+         std::atomic<WCommitResult> m_result;
+
+         WCommitRequest (Internal::WTransactionData& data, WRetired* retired_p):
+            m_data (data),
+            m_retired_p (retired_p),
+            m_conflict_p (nullptr),
+            m_result (WCommitResult::PENDING)
+         {}
+      };
+
+      //Whether the given root transaction's commit can be left to another thread. The commits
+      //done by the combining thread can't throw part way through since the requests that it has
+      //taken would never get a result, so anything that runs the variables' own code (value
+      //comparisons and deltas) or allocates (history) while committing is committed by the thread
+      //that owns it.
+      bool CanCombine (Internal::WTransactionData& data)
       {
-         m_data_p->GetReadLock ().lock();
+         if (data.HasDeltas ())
+         {
+            return false;
+         }
+         const auto& set = data.GetSet ();
+         if (std::any_of (set.begin (), set.end (),
+                          [](const SetMap::value_type& val){return val.first->m_history_p || val.first->m_isCurrentValue_p;}))
+         {
+            return false;
+         }
+         const auto& got = data.GetGot ();
+         return std::none_of (got.begin (), got.end (),
+                              [](const GotMap::value_type& val){return val.first->m_isCurrentValue_p;});
       }
-   }
 
-   bool WAtomic::IsReadLocked() const
-   {
-      return m_data_p->GetReadLock ().locked ();
-   }
+      struct alignas (64) WCommitSlot
+      {
+         std::atomic<WCommitRequest*> m_request_p;
+      };
+      const size_t NUM_COMMIT_SLOTS = 64;
+      std::array<WCommitSlot, NUM_COMMIT_SLOTS> s_commitSlots;
 
-   void WAtomic::ReadUnlock()
-   {
-      if (!m_data_p->GetUpgradeLock ().locked ())
+      //Does the calling thread's commit (unless it was published) and all the published ones. The
+      //caller must be holding the given upgrade lock.
+      void CombineCommits (WUpgradeableLock& lock, WCommitRequest& own, const bool published)
       {
-         m_data_p->GetReadLock ().unlock();
+         std::array<WCommitRequest*, NUM_COMMIT_SLOTS + 1> requests;
+         auto numRequests = size_t (0);
+         if (!published)
+         {
+            requests[numRequests++] = &own;
+         }
+         for (auto& slot: s_commitSlots)
+         {
+            if (slot.m_request_p.load (std::memory_order_relaxed))
+            {
+               const auto request_p = slot.m_request_p.exchange (nullptr, std::memory_order_acquire);
+               if (request_p)
+               {
+                  requests[numRequests++] = request_p;
+                  if (request_p != &own)
+                  {
+                     Count (PROFILE_COMBINED_COMMITS);
+                  }
+               }
+            }
+         }
+         
+         std::array<WCommitResult, NUM_COMMIT_SLOTS + 1> results;
+         {
+            WWriteLock wlock (lock);
+            //The commits are done one after the other so each one is validated against the ones
+            //before it.
+            for (auto i = size_t (0); i < numRequests; ++i)
+            {
+               results[i] = ValidateAndWrite (requests[i]->m_data, requests[i]->m_retired_p, requests[i]->m_conflict_p);
+            }
+         }
+         for (auto i = size_t (0); i < numRequests; ++i)
+         {
+            requests[i]->m_result.store (results[i], std::memory_order_release);
+         }
       }
-   }
-
-   void WAtomic::BeforeCommit (WBeforeCommitFunc func)
-   {
-      m_data_p->AddBeforeCommit (func);
-   }
-
-   void WAtomic::After(WAfterFunc func)
-   {
-      m_data_p->AddAfter (func);
-   }
-
-   void WAtomic::OnFail (WOnFailFunc func)
-   {
-      m_data_p->AddOnFail (func);
-   }
-
-   void WAtomic::ClearWrites()
-   {
-      m_data_p->ClearWrites ();
-   }
-
-   void WAtomic::Abort ()
-   {
-      m_data_p->Clear ();
-   }
-
-   void WAtomic::Restart ()
-   {
-      //We need to push our transaction data aside here, if we don't
-      //and a destructor triggered by the clearing of data below
-      //starts a new transaction it will end up being a child of the
-      //transaction that is being restarted. If this happens at best
-      //the actions of the detstructor will never be comitted, at
-      //worst memory corruption will result.
-      WTransactionDataList::WPushGuard guard = s_transData_p->Push ();
-      m_data_p->Clear ();
-      m_data_p->Activate ();
-   }
-
-   void WAtomic::RunOnFails ()
-   {
-      //We need to push our transaction data aside here so that
-      //transactions in the "on fail" handlers will run properly
-      //(properly here means: no memory corruption)
-      WTransactionDataList::WPushGuard guard = s_transData_p->Push ();
-      m_data_p->RunOnFails ();
-   }
 
-   void WAtomic::CommitLock()
-   {
-      if (!m_data_p->GetUpgradeLock ().locked ())
+      //Commits the given root transaction with commit combining, the transaction must not be
+      //holding any locks.
+      WCommitResult CombineCommit (Internal::WTransactionData& data, WRetired* retired_p)
       {
-         m_data_p->GetUpgradeLock ().lock ();
-         //unlock all the old read-locks here else we won't be able to
-         //promote our upgrade lock later
-         m_data_p->GetReadLock ().UnlockAll ();
+         WProfileTimer timer (PROFILE_COMMIT_WAIT_NS);
+         WLatencyTimer latencyTimer (LATENCY_LOCK);
+         WCommitRequest request (data, retired_p);
+         auto& lock = data.GetUpgradeLock ();
+
+         //Each thread starts looking for a free slot at a different place.
+         const auto start = std::hash<std::thread::id>()(std::this_thread::get_id ());
+         auto published = false;
+         for (auto i = size_t (0); i < NUM_COMMIT_SLOTS && !published; ++i)
+         {
+            auto& slot = s_commitSlots[(start + i) % NUM_COMMIT_SLOTS];
+            auto expected = static_cast<WCommitRequest*>(nullptr);
+            published = (!slot.m_request_p.load (std::memory_order_relaxed) &&
+                         slot.m_request_p.compare_exchange_strong (expected, &request, std::memory_order_release));
+         }
+         if (!published)
+         {
+            lock.lock ();
+            CombineCommits (lock, request, false);
+            lock.unlock ();
+            NoteConflict (request.m_conflict_p);
+            return request.m_result.load (std::memory_order_relaxed);
+         }
+
+         WBackoff backoff;
+         for (;;)
+         {
+            const auto result = request.m_result.load (std::memory_order_acquire);
+            if (result != WCommitResult::PENDING)
+            {
+               NoteConflict (request.m_conflict_p);
+               return result;
+            }
+            if (lock.try_lock ())
+            {
+               CombineCommits (lock, request, true);
+               lock.unlock ();
+            }
+            else
+            {
+               backoff ();
+            }
+         }
       }
    }
-   
+#endif //WSTM_CLOCK_ENGINE
+
    bool WAtomic::Commit()
    {
       assert (m_data_p->GetLevel () == 1);
       if(m_data_p->GetLevel () == 1)
       {
+         WLatencyTimer commitTimer (LATENCY_COMMIT);
          Internal::WTransactionData::WBeforeCommitList beforeCommits;
          m_data_p->GetBeforeCommits (beforeCommits);         
          for (WAtomic::WBeforeCommitFunc& beforeCommit: beforeCommits)
@@ -1237,35 +4733,86 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
          (void)clearFlag; //avoid a compiler warning
 #endif //_DEBUG
          
-         std::list<std::shared_ptr<Internal::WValueBase>> dead;
+         auto retired_p = std::unique_ptr<WRetired>();
+#ifdef WSTM_CLOCK_ENGINE
          if (!m_data_p->GetSet ().empty ())
          {
-            CommitLock ();
-            
-            if(!DoValidation())
+            retired_p = MakeRetired (m_data_p->GetSet ());
+            const auto committed = CommitWrites (*m_data_p, retired_p.get ());
+            m_data_p->GetUpgradeLock ().UnlockAll ();
+            if (!committed)
+            {
+               return false;
+            }
+            CountCommit (m_data_p->GetGot ().size (), m_data_p->GetSet ().size ());
+         }
+         else
+         {
+            //If nobody has committed since our read version was taken then nothing we read can
+            //have changed. Read-only transactions never read anything newer than their read
+            //version so they don't need to check.
+            const auto valid = (m_data_p->IsReadOnly () ||
+                                s_clock.load () == m_data_p->GetReadVersion () ||
+                                DoValidation ());
+            m_data_p->GetUpgradeLock ().UnlockAll ();
+            if (!valid)
             {
-               m_data_p->GetUpgradeLock ().UnlockAll ();
                return false;
             }
+            CountCommit (m_data_p->GetGot ().size (), m_data_p->GetSet ().size ());
+         }
+#else
+         if (!m_data_p->GetSet ().empty ())
+         {
+            auto result = WCommitResult::PENDING;
+            //Transactions that are already holding the commit lock (or are inevitable) just commit
+            //themselves.
+            if (s_combineCommits.load (std::memory_order_relaxed) &&
+                !m_data_p->GetUpgradeLock ().locked () && !m_data_p->IsInevitable () && CanCombine (*m_data_p))
+            {
+               //our read locks would keep the thread doing the commit from getting the write lock
+               m_data_p->GetReadLock ().UnlockAll ();
+               retired_p = MakeRetired (m_data_p->GetSet ());
+               result = CombineCommit (*m_data_p, retired_p.get ());
+            }
+            else
+            {
+               CommitLock ();
             
-            {   
-               //scope introduced so that wlock goes away at end of block
-               WWriteLock wlock(m_data_p->GetUpgradeLock ());
-               for (const VarMap::value_type& val: m_data_p->GetSet ())
+               if(!DoValidation())
                {
-                  //save old values until after we're done committing
-                  //in case they run transactions in their destructors
-                  dead.push_back (val.first->Commit (val.second));
+                  m_data_p->GetUpgradeLock ().UnlockAll ();
+                  return false;
+               }
+            
+               retired_p = MakeRetired (m_data_p->GetSet ());
+               {   
+                  //scope introduced so that wlock goes away at end of block
+                  WWriteLock wlock(m_data_p->GetUpgradeLock ());
+                  result = WriteValues (*m_data_p, retired_p.get ()) ? WCommitResult::COMMITTED : WCommitResult::GIVE_WAY;
                }
-               s_commitSignal.notify_all();
+               m_data_p->GetUpgradeLock ().UnlockAll ();
             }
-
-            m_data_p->GetUpgradeLock ().UnlockAll ();
-            IncrementNumWriteCommits ();
+            if (result == WCommitResult::CONFLICT)
+            {
+               return false;
+            }
+            if (result == WCommitResult::GIVE_WAY)
+            {
+               WaitForInevitable (m_data_p->GetSet ());
+               return false;
+            }
+            NotifyCommit (m_data_p->GetSet ());
+            CountCommit (m_data_p->GetGot ().size (), m_data_p->GetSet ().size ());
          }
          else
          {
-            if (m_data_p->GetUpgradeLock ().locked ())
+            if (m_data_p->IsReadOnly ())
+            {
+               //the reads were checked to be a consistent snapshot as they were done
+               m_data_p->GetUpgradeLock ().UnlockAll ();
+            }
+            else if (m_data_p->GetUpgradeLock ().locked ())
             {
                if(!DoValidation())
                {
@@ -1284,25 +4831,40 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
                }
                m_data_p->GetReadLock ().UnlockAll ();
             }
-            IncrementNumReadCommits ();
+            CountCommit (m_data_p->GetGot ().size (), m_data_p->GetSet ().size ());
          }
+#endif //WSTM_CLOCK_ENGINE
 
          //reset transaction data here so that after funcs will see no
          //transaction in progress         
+         TraceRun (TRACE_COMMIT, m_data_p->GetGot ().size (), m_data_p->GetSet ().size ());
+         WSTM_PROBE2 (commit, m_data_p->GetGot ().size (), m_data_p->GetSet ().size ());
          Internal::WTransactionData::WAfterList afters;
-         m_data_p->GetAfters (afters);
+         Internal::WTransactionData::WAfterList keptAfters;
+         m_data_p->GetAfters (afters, keptAfters);
+         //Copies of the after functions that have to outlive the replaced values go with them. If
+         //nothing was retired then there is nothing for them to outlive.
+         if (retired_p)
+         {
+            retired_p->m_afters.swap (keptAfters);
+         }
+         auto& epoch = m_data_p->GetEpoch ();
          m_data_p->Clear ();
 #ifdef _DEBUG
          s_committing = false;
 #endif //_DEBUG
          m_committed = true;
 
-         //The dead must be cleared before the afters run, else we coudl be holding on to things
-         //that the afters are relying on being gone already (specifically
-         //WChannelReader::Wdata::Release assumes that the after function that it attaches won't be
-         //fighting with the transaction to release the channel nodes in order to avoid a stack overflow). 
-         dead.clear ();
+         //The old values are freed right away if no other transaction could be reading them,
+         //otherwise they get freed when the last transaction that could be reading them finishes.
+         if (retired_p)
+         {
+            epoch.Retire (std::move (retired_p));
+         }
+         epoch.Reclaim ();
+         commitTimer.Stop ();
          
+         WLatencyTimer aftersTimer (LATENCY_AFTERS);
          for (WAtomic::WAfterFunc& after: afters)
          {
             after ();
@@ -1319,52 +4881,432 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
       {
          m_data_p->GetUpgradeLock ().unlock ();
       }
+      //Any read locks that the transaction took would keep the commits that we're waiting for from
+      //happening, the transaction is going to be restarted anyway.
+      m_data_p->GetReadLock ().UnlockAll ();
+      WSTM_PROBE1 (retry_wait, m_data_p->GetGot ().size ());
+
+      //Only commits that write one of the variables that we read will wake us up. The registration
+      //also keeps the variables' cores alive while we wait.
+      Internal::WCommitWaiter waiter;
+      WWaitRegistration registration (waiter, m_data_p->GetGot ());
+
+      //We don't want to hold up the freeing of old values while we wait so the transaction is
+      //unpinned until we're done. That means that the values that we read could go away so
+      //validation has to be done using their versions (the clock engine only needs the variables'
+      //version locks).
+#ifndef WSTM_CLOCK_ENGINE
+      auto versions = std::vector<std::pair<Internal::WVarCoreBase*, size_t>>();
+      versions.reserve (m_data_p->GetGot ().size ());
+      for (const GotMap::value_type& val: m_data_p->GetGot ())
+      {
+         versions.push_back (std::make_pair (val.first, val.second->m_version));
+      }
+#endif //!WSTM_CLOCK_ENGINE
+      auto& epoch = m_data_p->GetEpoch ();
+      struct WUnpin
+      {
+         WEpochThread& m_epoch;
+         WUnpin (WEpochThread& epoch): m_epoch (epoch) {m_epoch.Unpin ();}
+         ~WUnpin () {m_epoch.Pin ();}
+      };
+      WUnpin unpin (epoch);
+      //this thread could be waiting for a long time
+      epoch.HandOff ();
+      const auto changed = [&]()
+         {
+#ifdef WSTM_CLOCK_ENGINE
+            //only the versions can be checked, the values that were read could be freed
+            const auto readVersion = m_data_p->GetReadVersion ();
+            const auto& got = m_data_p->GetGot ();
+            return !std::all_of (got.begin (), got.end (),
+                                 [&](const GotMap::value_type& v){return IsReadValid (*v.first, readVersion);});
+#else
+            epoch.Pin ();
+            const auto valid = std::all_of (versions.begin (), versions.end (),
+                                            [](const auto& v){return v.first->Validate (v.second);});
+            epoch.Unpin ();
+            return !valid;
+#endif //WSTM_CLOCK_ENGINE
+         };
+      const auto notified = [&](){return waiter.m_notified;};
+      for (;;)
+      {
+         if(changed ())
+         {
+            WSTM_PROBE1 (retry_wake, 1);
+            return true;
+         }
+         std::unique_lock<std::mutex> lock (waiter.m_mutex);
+         if(timeout.IsUnlimited ())
+         {
+            waiter.m_signal.wait (lock, notified);
+         }
+         else if (!waiter.m_signal.wait_until (lock, *timeout.m_time_o, notified))
+         {
+            WSTM_PROBE1 (retry_wake, 0);
+            return false;
+         }
+         waiter.m_notified = false;
+      }
+   }
+
+   namespace
+   {
+      //A transaction that is being run by AtomicallyAsync, or just a function when m_transaction
+      //isn't set.
+      struct WAsyncTask
+      {
+         WAsyncTask (std::function<void ()> run, std::function<void ()> onTimeout, const bool transaction):
+            m_run (std::move (run)),
+            m_onTimeout (std::move (onTimeout)),
+            m_transaction (transaction),
+            m_retries (0),
+            m_parking (false),
+            m_woken (false),
+            m_parkId (0),
+            m_timedOut (false)
+         {}
+         
+         std::function<void ()> m_run;
+         std::function<void ()> m_onTimeout;
+         const bool m_transaction;
+         //The transaction starts over each time it is woken up so it can't keep its own count.
+         unsigned int m_retries;
+
+         //Set by SaveReads along with what the transaction read, the worker thread parks the
+         //transaction once it is out of Atomically.
+         bool m_parking;
+         WWaitRegistration::Cores m_cores;
+#ifdef WSTM_CLOCK_ENGINE
+         uint64_t m_readVersion;
+#else
+         std::vector<size_t> m_versions;
+#endif //WSTM_CLOCK_ENGINE
+         WTimeArg m_timeout;
+
+         //Set while the transaction is parked.
+         std::unique_ptr<Internal::WCommitWaiter> m_waiter_p;
+         std::unique_ptr<WWaitRegistration> m_registration_p;
+         //Whatever wakes the transaction up (a commit or the timeout) sets this first so that it
+         //only gets woken once.
+         std::atomic<bool> m_woken;
+         uint64_t m_parkId;
+         bool m_timedOut;
+
+         //Checks if any of the saved reads have changed, must be called outside of a transaction.
+         bool ReadsChanged () const;
+      };
+      using WAsyncTaskPtr = std::shared_ptr<WAsyncTask>;
+      
+      //The transaction that the current thread is running for AtomicallyAsync, if any. The first
+      //root transaction that starts takes it so that transactions run by its after actions don't
+      //get parked in its place.
+      THREAD_LOCAL_WITH_INIT_VALUE (WAsyncTask*, s_asyncTask_p, nullptr);
+
+      //Saves what the given transaction read so that the worker thread can wait for changes once
+      //the transaction is out of Atomically.
+      void SaveReads (WAsyncTask& task, Internal::WTransactionData& data, const WTimeArg& timeout)
+      {
+         task.m_parking = true;
+         task.m_cores.clear ();
+         const auto& got = data.GetGot ();
+         task.m_cores.reserve (got.size ());
+#ifdef WSTM_CLOCK_ENGINE
+         task.m_readVersion = data.GetReadVersion ();
+#else
+         task.m_versions.clear ();
+         task.m_versions.reserve (got.size ());
+#endif //WSTM_CLOCK_ENGINE
+         for (const GotMap::value_type& val: got)
+         {
+            task.m_cores.push_back (val.first->shared_from_this ());
+#ifndef WSTM_CLOCK_ENGINE
+            task.m_versions.push_back (val.second->m_version);
+#endif //!WSTM_CLOCK_ENGINE
+         }
+         task.m_timeout = timeout;
+      }
+
+      bool WAsyncTask::ReadsChanged () const
+      {
+#ifdef WSTM_CLOCK_ENGINE
+         return !std::all_of (m_cores.begin (), m_cores.end (),
+                              [&](const auto& core_p){return IsReadValid (*core_p, m_readVersion);});
+#else
+         auto& epoch = s_transData_p->GetEpoch ();
+         epoch.Pin ();
+         auto valid = true;
+         for (auto i = size_t (0); i < m_cores.size () && valid; ++i)
+         {
+            valid = m_cores[i]->Validate (m_versions[i]);
+         }
+         epoch.Unpin ();
+         //this is only called outside of transactions, values may have been waiting on our pin
+         epoch.Reclaim ();
+         return !valid;
+#endif //WSTM_CLOCK_ENGINE
+      }
+
+      //The threads that AtomicallyAsync runs transactions on. Transactions that call Retry don't
+      //hold on to a thread while they wait, they are parked on the waiter lists of the variables
+      //that they read and get queued up again when one of those variables changes.
+      class WAsyncPool
+      {
+      public:
+         static WAsyncPool& Get ();
+
+         WAsyncPool ();
+         ~WAsyncPool ();
+
+         void Post (WAsyncTaskPtr task_p);
+         
+      private:
+         void Work ();
+         void Run (WAsyncTaskPtr task_p);
+         void Park (const WAsyncTaskPtr& task_p);
+         void Wake (WAsyncTask* task_p);
+         //must be called with m_mutex held
+         void ExpireTimeouts ();
+         
+         std::mutex m_mutex;
+         std::condition_variable m_signal;
+         bool m_stop;
+         std::deque<WAsyncTaskPtr> m_ready;
+         //The parked transactions are owned by the pool. The timeouts refer to a particular
+         //parking of a transaction so that ones left behind after the transaction has been woken
+         //up are ignored.
+         std::unordered_map<WAsyncTask*, WAsyncTaskPtr> m_parked;
+         std::multimap<WTimeArg::time_point, std::pair<WAsyncTask*, uint64_t>> m_timeouts;
+         uint64_t m_nextParkId;
+         std::vector<std::thread> m_threads;
+      };
+
+      WAsyncPool& WAsyncPool::Get ()
+      {
+         static WAsyncPool pool;
+         return pool;
+      }
+      
+      WAsyncPool::WAsyncPool ():
+         m_stop (false),
+         m_nextParkId (0)
+      {
+         const auto numThreads = std::max (1u, std::thread::hardware_concurrency ());
+         for (auto i = 0u; i < numThreads; ++i)
+         {
+            m_threads.push_back (std::thread ([this](){Work ();}));
+         }
+      }
+
+      WAsyncPool::~WAsyncPool ()
+      {
+         {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_stop = true;
+         }
+         m_signal.notify_all ();
+         for (auto& thread: m_threads)
+         {
+            thread.join ();
+         }
+      }
+      
+      void WAsyncPool::Post (WAsyncTaskPtr task_p)
+      {
+         {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_ready.push_back (std::move (task_p));
+         }
+         m_signal.notify_one ();
+      }
+
+      void WAsyncPool::Work ()
+      {
+         std::unique_lock<std::mutex> lock (m_mutex);
+         for (;;)
+         {
+            ExpireTimeouts ();
+            if (!m_ready.empty ())
+            {
+               auto task_p = std::move (m_ready.front ());
+               m_ready.pop_front ();
+               lock.unlock ();
+               Run (std::move (task_p));
+               lock.lock ();
+            }
+            else if (m_stop)
+            {
+               //Transactions that are still parked are thrown away. This is done here since
+               //getting rid of them runs transactions, which can't be done on the exiting thread.
+               auto parked = std::move (m_parked);
+               m_parked.clear ();
+               lock.unlock ();
+               parked.clear ();
+               return;
+            }
+            else
+            {
+               //the worker could be idle for a long time
+               s_transData_p->GetEpoch ().HandOff ();
+               if (m_timeouts.empty ())
+               {
+                  m_signal.wait (lock);
+               }
+               else
+               {
+                  m_signal.wait_until (lock, m_timeouts.begin ()->first);
+               }
+            }
+         }
+      }
+
+      void WAsyncPool::ExpireTimeouts ()
+      {
+         const auto now = std::chrono::steady_clock::now ();
+         while (!m_timeouts.empty () && m_timeouts.begin ()->first <= now)
+         {
+            const auto task = m_timeouts.begin ()->second;
+            m_timeouts.erase (m_timeouts.begin ());
+            const auto it = m_parked.find (task.first);
+            if (it != m_parked.end () && it->second->m_parkId == task.second &&
+                !it->second->m_woken.exchange (true))
+            {
+               it->second->m_timedOut = true;
+               m_ready.push_back (std::move (it->second));
+               m_parked.erase (it);
+            }
+         }
+      }
+      
+      void WAsyncPool::Run (WAsyncTaskPtr task_p)
+      {
+         task_p->m_registration_p.reset ();
+         task_p->m_waiter_p.reset ();
+         if (task_p->m_timedOut)
+         {
+            task_p->m_timedOut = false;
+            task_p->m_onTimeout ();
+            return;
+         }
+
+         if (!task_p->m_transaction)
+         {
+            task_p->m_run ();
+            return;
+         }
+         
+         s_asyncTask_p = task_p.get ();
+         try
+         {
+            task_p->m_run ();
+         }
+         catch (Internal::WParkedException&)
+         {}
+         s_asyncTask_p = nullptr;
+         
+         if (task_p->m_parking)
+         {
+            task_p->m_parking = false;
+            Park (task_p);
+         }
+      }
 
-      WReadLockGuard<WAtomic> rlock(*this);
-      if(!timeout.IsUnlimited ())
+      void WAsyncPool::Park (const WAsyncTaskPtr& task_p)
       {
-         do
+         //The transaction is registered and checked before anybody else can see it, once it is
+         //queued or parked another thread can pick it up.
+         task_p->m_woken.store (false);
+         task_p->m_waiter_p = std::make_unique<Internal::WCommitWaiter>();
+         const auto raw_p = task_p.get ();
+         task_p->m_waiter_p->m_onNotify = [this, raw_p](){Wake (raw_p);};
+         task_p->m_registration_p = std::make_unique<WWaitRegistration>(*task_p->m_waiter_p, task_p->m_cores);
+         //something we read may have changed before we were registered
+         if (task_p->ReadsChanged ())
+         {
+            task_p->m_woken.store (true);
+         }
+         task_p->m_cores.clear ();
+         
          {
-            if(!DoValidation())
+            std::lock_guard<std::mutex> lock (m_mutex);
+            if (task_p->m_woken.load ())
             {
-               return true;
+               m_ready.push_back (task_p);
+            }
+            else
+            {
+               task_p->m_parkId = m_nextParkId++;
+               m_parked.emplace (raw_p, task_p);
+               if (!task_p->m_timeout.IsUnlimited ())
+               {
+                  m_timeouts.emplace (*task_p->m_timeout.m_time_o, std::make_pair (raw_p, task_p->m_parkId));
+               }
             }
-            m_data_p->GetReadLock ().WaitForCommit(timeout);
-         }while(std::chrono::steady_clock::now () < *timeout.m_time_o);
+         }
+         m_signal.notify_one ();
       }
-      else
+
+      void WAsyncPool::Wake (WAsyncTask* task_p)
       {
-         for (;;)
+         if (task_p->m_woken.exchange (true))
+         {
+            return;
+         }
          {
-            if(!DoValidation())
+            std::lock_guard<std::mutex> lock (m_mutex);
+            //if the task isn't parked yet then Park will requeue it
+            const auto it = m_parked.find (task_p);
+            if (it == m_parked.end ())
             {
-               return true;
+               return;
             }
-            m_data_p->GetReadLock ().WaitForCommit(timeout);
+            m_ready.push_back (std::move (it->second));
+            m_parked.erase (it);
          }
+         m_signal.notify_one ();
+      }
+   }
+
+   namespace Internal
+   {
+      void RunAsync (std::function<void ()> run, std::function<void ()> onTimeout)
+      {
+         WAsyncPool::Get ().Post (std::make_shared<WAsyncTask>(std::move (run), std::move (onTimeout), true));
       }
 
-      return false;
+      void PostAsync (std::function<void ()> f)
+      {
+         WAsyncPool::Get ().Post (std::make_shared<WAsyncTask>(std::move (f), std::function<void ()>(), false));
+      }
    }
 
-   const Internal::WValueBase* WAtomic::GetVarValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p)
+   const Internal::WValueBase* WAtomic::GetVarValue (const Internal::WVarCoreBase* core_p, bool* fromSet_p)
    {
       //Look in the values of this transaction and its parents
       Internal::WTransactionData* data_p = m_data_p;
       while (data_p)
       {
          //first try the set value
-         VarMap::iterator it = data_p->GetSet ().find (core_p);
-         if (it != data_p->GetSet ().end ())
+         const auto setIt = data_p->GetSet ().find (core_p);
+         if (setIt != data_p->GetSet ().end ())
          {
-            return it->second.get ();
+            if (fromSet_p)
+            {
+               *fromSet_p = true;
+            }
+            return setIt->second.get ();
          }
 
          //next the got value
-         it = data_p->GetGot ().find (core_p);
-         if (it != data_p->GetGot ().end ())
+         const auto gotIt = data_p->GetGot ().find (core_p);
+         if (gotIt != data_p->GetGot ().end ())
          {
-            return it->second.get ();
+            if (fromSet_p)
+            {
+               *fromSet_p = false;
+            }
+            return gotIt->second;
          }
 
          //try the parent transaction
@@ -1375,7 +5317,7 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
       return nullptr;
    }
 
-   const Internal::WValueBase* WAtomic::GetVarGotValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p)
+   const Internal::WValueBase* WAtomic::GetVarGotValue (const Internal::WVarCoreBase* core_p)
    {
       //Look in the values of this transaction and its parents
       Internal::WTransactionData* data_p = m_data_p;
@@ -1385,7 +5327,7 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
          auto it = data_p->GetGot ().find (core_p);
          if (it != data_p->GetGot ().end ())
          {
-            return it->second.get ();
+            return it->second;
          }
 
          //try the parent transaction
@@ -1396,19 +5338,224 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
       return nullptr;      
    }
 
-   void WAtomic::SetVarGetValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p, std::shared_ptr<Internal::WValueBase>&& value_p)
+#ifndef WSTM_CLOCK_ENGINE
+   namespace
+   {
+      //Read-only transactions don't validate when they commit so with the lock based engine they
+      //can only read values that were committed by the time of their snapshot. When they need a
+      //newer value the snapshot is moved forward, which is only possible if nothing that has
+      //already been read has changed. Returns false if something has.
+      bool ExtendSnapshot (Internal::WTransactionData& data)
+      {
+         auto& snapshot = data.GetSnapshotSequence ();
+         WBackoff backoff;
+         for (;;)
+         {
+            const auto sequence = s_commitSequence.load (std::memory_order_acquire);
+            if (sequence & 1)
+            {
+               //a commit is in progress
+               backoff ();
+               continue;
+            }
+            for (auto data_p = &data; data_p; data_p = data_p->GetParent ())
+            {
+               for (const GotMap::value_type& val: data_p->GetGot ())
+               {
+                  if (!val.first->Validate (*val.second))
+                  {
+                     NoteConflict (val.first);
+                     return false;
+                  }
+               }
+            }
+            //If nothing was committed while we were checking then all the values were current at
+            //the same time.
+            std::atomic_thread_fence (std::memory_order_acquire);
+            if (s_commitSequence.load (std::memory_order_relaxed) == sequence)
+            {
+               snapshot = sequence;
+               return true;
+            }
+         }
+      }
+   }
+#endif //!WSTM_CLOCK_ENGINE
+
+   namespace
+   {
+      //A child transaction that has a conflict can be run again on its own as long as nothing that
+      //its ancestors have read has changed. If that is the case the root's read version (or
+      //snapshot) is moved forward so that the child sees the current values when it runs again.
+      bool CanRestartChild (Internal::WTransactionData& parent)
+      {
+#ifdef WSTM_CLOCK_ENGINE
+         auto& readVersion = parent.GetReadVersion ();
+         auto newReadVersion = uint64_t (0);
+         if (!ValidateReads (parent, readVersion, true, newReadVersion))
+         {
+            return false;
+         }
+         readVersion = newReadVersion;
+         return true;
+#else
+         if (parent.ReadsSnapshot ())
+         {
+            return ExtendSnapshot (parent);
+         }
+         for (auto data_p = &parent; data_p; data_p = data_p->GetParent ())
+         {
+            for (const GotMap::value_type& val: data_p->GetGot ())
+            {
+               if (!val.first->Validate (*val.second))
+               {
+                  NoteConflict (val.first);
+                  return false;
+               }
+            }
+         }
+         return true;
+#endif //WSTM_CLOCK_ENGINE
+      }
+   }
+
+   bool WAtomic::RestartChild ()
+   {
+      assert (m_data_p->GetLevel () > 1);
+      auto& parent = *m_data_p->GetParent ();
+      if (!CanRestartChild (parent))
+      {
+         return false;
+      }
+      auto savedReads = size_t (0);
+      for (auto data_p = &parent; data_p; data_p = data_p->GetParent ())
+      {
+         savedReads += data_p->GetGot ().size ();
+      }
+      CountChildRestart (savedReads);
+
+      //see Restart, the root's epoch is still pinned so nothing is reclaimed here
+      WTransactionDataList::WPushGuard guard = s_transData_p->Push ();
+      const auto readOnly = m_data_p->IsReadOnly ();
+      m_data_p->Clear ();
+      m_data_p->Activate ();
+      m_data_p->SetReadOnly (readOnly);
+      return true;
+   }
+
+   const Internal::WValueBase* WAtomic::ReadVarValue (Internal::WVarCoreBase* core_p)
+   {
+      if (m_data_p->IsInevitable ())
+      {
+         MarkInevitableRead (*core_p);
+#ifndef WSTM_CLOCK_ENGINE
+         //a commit that didn't see the mark could be changing the variable
+         WBackoff backoff;
+         while (s_commitSequence.load (std::memory_order_acquire) & 1)
+         {
+            backoff ();
+         }
+#endif //!WSTM_CLOCK_ENGINE
+      }
+      
+#ifdef WSTM_CLOCK_ENGINE
+      auto& readVersion = m_data_p->GetReadVersion ();
+      const auto slot_p = core_p->m_inline ? AllocateInlineValue () : nullptr;
+      auto value = LoadValue (*core_p, slot_p);
+      while (GetVersion (value.second) > readVersion)
+      {
+         if (m_data_p->ReadsSnapshot ())
+         {
+            //read-only transactions can use an old value if the variable still has it
+            const auto old_p = FindOldValue (*core_p, readVersion);
+            if (old_p)
+            {
+               m_data_p->AddGot (core_p, old_p);
+               return old_p;
+            }
+         }
+         
+         //The variable has changed since our read version was taken. If nothing that we have
+         //already read has changed we can just move the read version forward and read the variable
+         //again, otherwise we would be seeing an inconsistent state.
+         auto newReadVersion = uint64_t (0);
+         if (!ValidateReads (*m_data_p, readVersion, true, newReadVersion))
+         {
+            throw Internal::WFailedValidationException ();
+         }
+         readVersion = newReadVersion;
+         value = LoadValue (*core_p, slot_p);
+      }
+      m_data_p->AddGot (core_p, value.first);
+      return value.first;
+#else
+      //The transaction is pinned so the value can't be freed out from under us even if it gets
+      //replaced. 
+      const auto slot_p = core_p->m_inline ? AllocateInlineValue () : nullptr;
+      const auto loadValue = [core_p, slot_p]()
+         {
+            return core_p->m_inline ?
+               core_p->ReadInline (slot_p) :
+               core_p->m_value_p.load (std::memory_order_acquire);
+         };
+      auto value_p = loadValue ();
+      if (m_data_p->ReadsSnapshot ())
+      {
+         //A value's version is the sequence number of the commit that wrote it.
+         const auto& snapshot = m_data_p->GetSnapshotSequence ();
+         while (value_p->m_version > snapshot)
+         {
+            const auto old_p = FindOldValue (*core_p, snapshot);
+            if (old_p)
+            {
+               value_p = old_p;
+               break;
+            }
+            if (!ExtendSnapshot (*m_data_p))
+            {
+               throw Internal::WFailedValidationException ();
+            }
+            value_p = loadValue ();
+         }
+      }
+      m_data_p->AddGot (core_p, value_p);
+      return value_p;
+#endif //WSTM_CLOCK_ENGINE
+   }
+
+   void WAtomic::ValidateVar (const Internal::WVarCoreBase* core_p)
    {
-      m_data_p->GetGot ()[core_p] = std::move (value_p);
+      const auto val_p = GetVarGotValue (core_p);
+      if (val_p)
+      {
+#ifdef WSTM_CLOCK_ENGINE
+         const auto valid = (IsReadValid (*core_p, m_data_p->GetReadVersion ()) || HasSameValue (*core_p, *val_p));
+#else
+         const auto valid = core_p->Validate (*val_p);
+#endif //WSTM_CLOCK_ENGINE
+         if (!valid)
+         {
+            NoteConflict (core_p);
+            throw Internal::WFailedValidationException();
+         }
+      }
+   }
+
+   void WAtomic::ReleaseVar (const Internal::WVarCoreBase* core_p)
+   {
+      //Only this transaction's own read is released, a read done by an enclosing transaction is
+      //kept (and any read of ours that has already been merged into the parent is the parent's).
+      m_data_p->GetGot ().erase (core_p);
    }
 
-   Internal::WValueBase* WAtomic::GetVarSetValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p)
+   Internal::WValueBase* WAtomic::GetVarSetValue (const Internal::WVarCoreBase* core_p)
    {
       //Note that we only check this transaction's set values not the
       //parent's. Values need to be set in the current transaction,
       //even if they have already been set in the parent. When this
       //transaction commits the set values will be merged into the
       //parent transaction.
-      VarMap::iterator it = m_data_p->GetSet ().find (core_p);
+      const auto it = m_data_p->GetSet ().find (core_p);
       if (it != m_data_p->GetSet ().end ())
       {
          return it->second.get ();
@@ -1419,11 +5566,26 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
       }
    }
    
-   void WAtomic::SetVarValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p, std::shared_ptr<Internal::WValueBase>&& value_p)
+   void WAtomic::SetVarValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p, std::unique_ptr<Internal::WValueBase>&& value_p)
    {
+      if (m_data_p->IsReadOnly ())
+      {
+         throw WReadOnlyException ();
+      }
       m_data_p->GetSet ()[core_p] = std::move (value_p);
    }
 
+   void WAtomic::SetVarDelta (const std::shared_ptr<Internal::WVarCoreBase>& core_p, std::unique_ptr<Internal::WValueBase>&& value_p)
+   {
+      SetVarValue (core_p, std::move (value_p));
+      m_data_p->SetHasDeltas ();
+   }
+
+   void* WAtomic::AllocateInlineValue ()
+   {
+      return m_data_p->GetInlineValues ().Allocate ();
+   }
+
    Internal::WLocalValueBase* WAtomic::GetLocalValue (uint64_t key)
    {
       return m_data_p->GetLocalValue (key);
@@ -1473,7 +5635,11 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
    void WAtomic::AtomicallyImpl(Internal::WAtomicOp& op,
                                 const WMaxConflicts& maxConflicts,
                                 const WMaxRetries& maxRetries,
-                                const WMaxRetryWait& maxRetryWait)
+                                const WMaxRetryWait& maxRetryWait,
+                                const WReadOnly& readOnly,
+                                const WContentionManager& contention,
+                                const WElastic& elastic,
+                                const WCallSite& callSite)
    {      
 #ifdef _DEBUG
       //if this assertion fails we got a new transaction starting
@@ -1483,6 +5649,11 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
 
       WAtomic at;
       assert (!at.m_committed);
+      at.m_data_p->SetReadOnly (readOnly.m_value);
+      if (at.m_data_p->GetLevel () == 1)
+      {
+         at.m_data_p->SetElastic (elastic.m_value);
+      }
       struct WRunOnFailHandlers
       {
          WAtomic& m_at;
@@ -1500,27 +5671,78 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
       WRunOnFailHandlers runOnFailHandlers (at);
       if (at.m_data_p->GetLevel () > 1)
       {
-         try
+         unsigned int childConflicts = 0;
+         for (;;)
          {
-            //this is a child transaction so just run the op and
-            //merge to parent, exceptions and committing will be handled by the
-            //root transaction
-            op.Run (at);
-            s_transData_p->MergeToParent ();
-            at.m_committed = true;
-            return;
+            try
+            {
+               //this is a child transaction so just run the op and
+               //merge to parent, exceptions and committing will be handled by the
+               //root transaction
+               op.Run (at);
+               s_transData_p->MergeToParent ();
+               at.m_committed = true;
+               return;
+            }
+            catch(Internal::WFailedValidationException&)
+            {
+               //If the conflict only involves what this transaction read then only it needs to be
+               //run again, otherwise the parent's work is lost as well.
+               ++childConflicts;
+               at.RunOnFails ();
+               const auto conflict_p = TakeConflict ();
+               if ((maxConflicts.m_max != UNLIMITED && childConflicts >= maxConflicts.m_max) ||
+                   !at.RestartChild ())
+               {
+                  //the conflict is put down (and counted) to the root transaction
+                  NoteConflict (conflict_p);
+                  throw;
+               }
+               Count (PROFILE_CONFLICTS);
+               AttributeConflict (conflict_p, callSite);
+            }
+            catch(WRetryException&)
+            {
+               at.RunOnFails ();
+               //we need to merge our gets into the root transaction so
+               //that those vars get checked in the root transaction
+               //retry handler
+               at.m_data_p->MergeGetsToRoot ();
+               throw;
+            }
          }
-         catch(WRetryException&)
+      }
+
+      WAsyncTask* const asyncTask_p = s_asyncTask_p;
+      s_asyncTask_p = nullptr;
+
+      //Latencies and traces are kept for top-level transactions, transactions run by after actions
+      //get their own.
+      struct WCallSiteGuard
+      {
+         WLatencySite* const m_oldLatency_p;
+         const char* const m_oldTraceSite_p;
+         const uint64_t m_oldTraceRunStart;
+
+         WCallSiteGuard (const WCallSite& callSite):
+            m_oldLatency_p (s_latencySite_p),
+            m_oldTraceSite_p (s_traceSite_p),
+            m_oldTraceRunStart (s_traceRunStart)
          {
-            at.RunOnFails ();
-            //we need to merge our gets into the root transaction so
-            //that those vars get checked in the root transaction
-            //retry handler
-            at.m_data_p->MergeGetsToRoot ();
-            throw;
+            s_latencySite_p = s_trackLatency.load (std::memory_order_relaxed) ? GetLatencySite (callSite.m_value) : nullptr;
+            s_traceSite_p = callSite.m_value;
          }
-      }
 
+         ~WCallSiteGuard ()
+         {
+            s_latencySite_p = m_oldLatency_p;
+            s_traceSite_p = m_oldTraceSite_p;
+            s_traceRunStart = m_oldTraceRunStart;
+         }
+      };
+      WCallSiteGuard callSiteGuard (callSite);
+      WLatencyTimer totalTimer (LATENCY_TOTAL);
+      
       unsigned int badCommits = 0;
 #ifdef TRACK_LAST_TRANS_CONFLICTS
       const size_t numConflictsLastTime = s_lastTransConflicts;
@@ -1528,6 +5750,29 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
       WSetLastTransConflicts setLastTransConflicts (badCommits);
 #endif //TRACK_LAST_TRANS_CONFLICTS
       unsigned int retries = 0;
+
+      //The contention policy is only told about transactions that have had conflicts.
+      const auto policy_p = contention.m_policy_p.get ();
+      struct WContentionGuard
+      {
+         WContentionPolicy* m_policy_p;
+         WContentionInfo m_info;
+
+         WContentionGuard (WContentionPolicy* policy_p):
+            m_policy_p (policy_p),
+            m_info {0, 0, policy_p ? s_contentionTimestamp.fetch_add (1, std::memory_order_relaxed) : 0, 0, nullptr}
+         {}
+
+         ~WContentionGuard ()
+         {
+            if (m_policy_p && m_info.m_conflicts > 0)
+            {
+               m_policy_p->OnFinish (m_info);
+            }
+         }
+      };
+      WContentionGuard contentionGuard (policy_p);
+      
       for (;;)
       {
          if(maxConflicts.m_max != UNLIMITED && badCommits >= maxConflicts.m_max)
@@ -1536,15 +5781,31 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
             {
                throw WMaxConflictsException(badCommits);
             }
+            else if (WConflictResolution::RUN_INEVITABLE == maxConflicts.m_resolution)
+            {
+               if (badCommits == maxConflicts.m_max)
+               {
+                  Count (PROFILE_RUN_INEVITABLE);
+               }
+               at.m_data_p->SetInevitable (true);
+            }
             else
             {
+               if (badCommits == maxConflicts.m_max)
+               {
+                  Count (PROFILE_RUN_LOCKED);
+               }
                at.CommitLock();
             }
          }
          
+         s_traceRunStart = TraceStart ();
          try
          {
-            op.Run (at);
+            {
+               WLatencyTimer runTimer (LATENCY_RUN);
+               op.Run (at);
+            }
 
             //have to commit in this try block in case a "before action" does something that throws
             //an exception
@@ -1556,22 +5817,51 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
          catch(Internal::WFailedValidationException&)
          {
             ++badCommits;
-            IncrementNumConflicts ();
+            Count (PROFILE_CONFLICTS);
             at.RunOnFails ();
-            at.Restart();
+            contentionGuard.m_info.m_conflicts = badCommits;
+            const auto conflict_p = TakeConflict ();
+            contentionGuard.m_info.m_conflict = conflict_p;
+            AttributeConflict (conflict_p, callSite);
+            TraceRun (TRACE_ABORT, at.m_data_p->GetGot ().size (), at.m_data_p->GetSet ().size ());
+            WSTM_PROBE3 (conflict, badCommits, at.m_data_p->GetGot ().size (), at.m_data_p->GetSet ().size ());
+            at.RestartAfterConflict (policy_p, contentionGuard.m_info);
             continue;
          }
          catch(WRetryException& exc)
          {
-            ++retries;
+            //transactions run by AtomicallyAsync start over each time they are woken up
+            retries = asyncTask_p ? ++asyncTask_p->m_retries : retries + 1;
             if(maxRetries.m_value != UNLIMITED && retries >= maxRetries.m_value)
             {
                throw WMaxRetriesException(retries);
             }
+            Count (PROFILE_RETRIES);
+            TraceRun (TRACE_RETRY, at.m_data_p->GetGot ().size (), at.m_data_p->GetSet ().size ());
             at.RunOnFails ();
+            //nobody could change what we read while we were inevitable
+            at.m_data_p->SetInevitable (false);
 
             const auto timeout = std::min (exc.m_timeout, maxRetryWait.m_value);
-            if(!at.WaitForChanges(timeout))
+            if (asyncTask_p)
+            {
+               //the worker thread waits for the changes once we're out of Atomically
+               SaveReads (*asyncTask_p, *at.m_data_p, timeout);
+               at.Restart ();
+               throw Internal::WParkedException ();
+            }
+            auto changed = false;
+            const auto waitStart = TraceStart ();
+            {
+               WProfileTimer timer (PROFILE_RETRY_WAIT_NS);
+               WLatencyTimer latencyTimer (LATENCY_RETRY_WAIT);
+               changed = at.WaitForChanges (timeout);
+            }
+            if (waitStart)
+            {
+               Trace (changed ? TRACE_WAKE : TRACE_TIMEOUT, waitStart, 0, 0);
+            }
+            if(!changed)
             {
                throw WRetryTimeoutException();
             }
@@ -1586,16 +5876,35 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
          }
 
          at.RunOnFails ();
-         at.Restart();
          ++badCommits;
-         IncrementNumConflicts ();
+         Count (PROFILE_CONFLICTS);
+         contentionGuard.m_info.m_conflicts = badCommits;
+         const auto conflict_p = TakeConflict ();
+         contentionGuard.m_info.m_conflict = conflict_p;
+         AttributeConflict (conflict_p, callSite);
+         TraceRun (TRACE_ABORT, at.m_data_p->GetGot ().size (), at.m_data_p->GetSet ().size ());
+         WSTM_PROBE3 (conflict, badCommits, at.m_data_p->GetGot ().size (), at.m_data_p->GetSet ().size ());
+         at.RestartAfterConflict (policy_p, contentionGuard.m_info);
       }
    }
 
    void WInconsistent::InconsistentlyImpl(Internal::WInconsistentOp& op)
    {
-      WInconsistent ins;
-      op.Run (ins);
+      //keeps the values that are read from being freed while op is running
+      auto& epoch = s_transData_p->GetEpoch ();
+      struct WPin
+      {
+         WEpochThread& m_epoch;
+         WPin (WEpochThread& epoch): m_epoch (epoch) {m_epoch.Pin ();}
+         ~WPin () {m_epoch.Unpin ();}
+      };
+      {
+         WPin pin (epoch);
+         WInconsistent ins;
+         op.Run (ins);
+      }
+      //values that couldn't be freed while we were reading may be waiting on us
+      epoch.Reclaim ();
    }
 
    WInconsistent::WInconsistent() :
@@ -1612,6 +5921,17 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
       ++m_lockCount;
    }
    
+   const Internal::WValueBase* WInconsistent::GetVarValue (const Internal::WVarCoreBase& core)
+   {
+      //WVar reads inline values itself
+      assert (!core.m_inline);
+#ifdef WSTM_CLOCK_ENGINE
+      return LoadValue (core, nullptr).first;
+#else
+      return core.m_value_p.load (std::memory_order_acquire);
+#endif //WSTM_CLOCK_ENGINE
+   }
+   
    bool WInconsistent::IsReadLocked() const
    {
       return m_lock.owns_lock();
@@ -1629,6 +5949,15 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
       }
    }
 
+   void SetCommitCombining (const bool combine)
+   {
+#ifdef WSTM_CLOCK_ENGINE
+      (void)combine;
+#else
+      s_combineCommits.store (combine);
+#endif //WSTM_CLOCK_ENGINE
+   }
+
    bool InAtomic()
    {
       return (s_transData_p->Get()->IsActive ());
@@ -1645,6 +5974,154 @@ THREAD_LOCAL_WITH_INIT_VALUE (bool, s_committing, false);
    WInAtomicError::WInAtomicError ():
       WException ("Attempt to use function marked NO ATOMIC from within a transaction")
    {}
+
+   std::vector<std::exception_ptr> WAtomic::AtomicallyBatchImpl (const std::vector<std::function<void (WAtomic&)>>& ops)
+   {
+      auto errors = std::vector<std::exception_ptr>(ops.size ());
+      //operations that need to be run on their own after the batch
+      auto alone = std::vector<size_t>();
+
+      //Each operation is run in a transaction of its own, which is set aside once the operation is
+      //done so that they can all be committed together.
+      auto datas = std::vector<std::unique_ptr<Internal::WTransactionData>>();
+      auto batched = std::vector<size_t>();
+      datas.reserve (ops.size ());
+      batched.reserve (ops.size ());
+      //the transactions stay pinned until they are cleared
+      struct WClearDatas
+      {
+         std::vector<std::unique_ptr<Internal::WTransactionData>>& m_datas;
+
+         WClearDatas (std::vector<std::unique_ptr<Internal::WTransactionData>>& datas): m_datas (datas) {}
+         
+         ~WClearDatas ()
+         {
+            for (auto& data_p: m_datas)
+            {
+               data_p->Clear ();
+            }
+         }
+      };
+      WClearDatas clearDatas (datas);
+      
+      for (size_t i = 0; i < ops.size (); ++i)
+      {
+         WAtomic at;
+         try
+         {
+            ops[i] (at);
+            Internal::WTransactionData::WBeforeCommitList beforeCommits;
+            at.m_data_p->GetBeforeCommits (beforeCommits);         
+            for (WAtomic::WBeforeCommitFunc& beforeCommit: beforeCommits)
+            {
+               beforeCommit (at);
+            }
+         }
+         catch (Internal::WFailedValidationException&)
+         {
+            at.RunOnFails ();
+            Count (PROFILE_CONFLICTS);
+            AttributeConflict (TakeConflict (), WCallSite ());
+            alone.push_back (i);
+            continue;
+         }
+         catch (WRetryException&)
+         {
+            //waiting here would hold up the whole batch
+            at.RunOnFails ();
+            alone.push_back (i);
+            continue;
+         }
+         catch (...)
+         {
+            at.RunOnFails ();
+            errors[i] = std::current_exception ();
+            continue;
+         }
+         //the batch looks after the transaction from here on
+         at.m_committed = true;
+         datas.push_back (s_transData_p->Detach ());
+         batched.push_back (i);
+      }
+
+      if (!datas.empty ())
+      {
+         auto retireds = std::vector<std::unique_ptr<WRetired>>();
+         auto commits = std::vector<WBatchCommit>();
+         retireds.reserve (datas.size ());
+         commits.reserve (datas.size ());
+         for (auto& data_p: datas)
+         {
+            retireds.push_back (MakeRetired (data_p->GetSet ()));
+            commits.push_back (WBatchCommit {data_p.get (), retireds.back ().get (), WCommitResult::PENDING, nullptr});
+         }
+         CommitBatch (commits.data (), commits.size ());
+
+         auto& epoch = s_transData_p->GetEpoch ();
+         auto afters = Internal::WTransactionData::WAfterList ();
+         for (size_t j = 0; j < datas.size (); ++j)
+         {
+            auto& data = *datas[j];
+            if (commits[j].m_result != WCommitResult::COMMITTED)
+            {
+               //Operations that conflicted (or have to give way to the inevitable transaction) are
+               //run again on their own.
+               data.RunOnFails ();
+               data.Clear ();
+               if (commits[j].m_result == WCommitResult::CONFLICT)
+               {
+                  Count (PROFILE_CONFLICTS);
+                  AttributeConflict (commits[j].m_conflict_p, WCallSite ());
+               }
+               alone.push_back (batched[j]);
+               continue;
+            }
+            
+            CountCommit (data.GetGot ().size (), data.GetSet ().size ());
+            WSTM_PROBE2 (commit, data.GetGot ().size (), data.GetSet ().size ());
+            Internal::WTransactionData::WAfterList opAfters;
+            Internal::WTransactionData::WAfterList keptAfters;
+            data.GetAfters (opAfters, keptAfters);
+            afters.splice (afters.end (), opAfters);
+            //see Commit
+            if (retireds[j])
+            {
+               retireds[j]->m_afters.swap (keptAfters);
+            }
+            data.Clear ();
+            if (retireds[j])
+            {
+               epoch.Retire (std::move (retireds[j]));
+            }
+         }
+         epoch.Reclaim ();
+         
+         for (WAtomic::WAfterFunc& after: afters)
+         {
+            after ();
+         }
+      }
+
+      //the operations that didn't make it into the batch are run in the order that they were given
+      std::sort (alone.begin (), alone.end ());
+      for (const auto i: alone)
+      {
+         try
+         {
+            Atomically (ops[i]);
+         }
+         catch (...)
+         {
+            errors[i] = std::current_exception ();
+         }
+      }
+      return errors;
+   }
+
+   std::vector<std::exception_ptr> AtomicallyBatch (const std::vector<WBatchOp>& ops, NO_ATOMIC_IMPL)
+   {
+      return WAtomic::AtomicallyBatchImpl (ops);
+   }
    
    void Retry(WAtomic&, const WTimeArg& timeout)
    {
@@ -0,0 +1,90 @@
+#!/bin/bash
+#Copyright (c) 2015, Wyatt Technology Corporation
+#All rights reserved.
+#
+#Redistribution and use in source and binary forms, with or without
+#modification, are permitted provided that the following conditions are
+#met:
+#
+#1. Redistributions of source code must retain the above copyright
+#notice, this list of conditions and the following disclaimer.
+#
+#2. Redistributions in binary form must reproduce the above copyright
+#notice, this list of conditions and the following disclaimer in the
+#documentation and/or other materials provided with the distribution.
+#
+#3. Neither the name of the copyright holder nor the names of its
+#contributors may be used to endorse or promote products derived from
+#this software without specific prior written permission.
+#
+#THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+#"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+#LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+#A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+#HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+#SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+#LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+#DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+#THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+#(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+#OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#Shows what the USDT probes cost when nothing is attached to them by running the same contention
+#test against the library built with the probes (contention_tests) and without them
+#(contention_tests_noprobes, only built when sys/sdt.h was found). The two are run in turn a few
+#times and the average transactions/second of each is reported.
+#
+#usage: compare_probes.sh <build dir> [rounds] [contention_tests options...]
+#
+#For example, to compare set throughput in 4 threads with 5 runs of 10 seconds each:
+#
+#   testing/contention/compare_probes.sh build 5 -S -T 4 -D 10
+
+set -e
+
+if [ $# -lt 1 ]; then
+   echo "usage: $0 <build dir> [rounds] [contention_tests options...]"
+   exit 1
+fi
+buildDir=$1
+shift
+rounds=3
+if [ $# -gt 0 ] && [ "$1" -eq "$1" ] 2>/dev/null; then
+   rounds=$1
+   shift
+fi
+
+withProbes=$buildDir/contention_tests
+withoutProbes=$buildDir/contention_tests_noprobes
+for test in "$withProbes" "$withoutProbes"; do
+   if [ ! -x "$test" ]; then
+      echo "$test wasn't found, it is only built when sys/sdt.h is available"
+      exit 1
+   fi
+done
+
+#Runs the given test and prints its transactions/second.
+run () {
+   "$@" | awk -F' = ' '/^Transactions\/second/ {print $2}'
+}
+
+with=()
+without=()
+for ((i = 0; i < rounds; ++i)); do
+   with+=("$(run "$withProbes" "$@")")
+   without+=("$(run "$withoutProbes" "$@")")
+   echo "round $((i + 1)): ${with[i]} with probes, ${without[i]} without"
+done
+
+printf '%s\n' "${with[@]}" | paste -sd' ' | awk -v without="${without[*]}" '
+{
+   n = split (without, w, " ")
+   for (i = 1; i <= n; ++i)
+   {
+      sumWith += $i
+      sumWithout += w[i]
+   }
+   avgWith = sumWith/n
+   avgWithout = sumWithout/n
+   printf "Transactions/second = %g with probes, %g without (%+.2f%%)\n", avgWith, avgWithout, 100*(avgWith - avgWithout)/avgWithout
+}'
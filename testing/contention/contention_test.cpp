@@ -45,6 +45,10 @@ using namespace WSTM;
 #include <mutex>
 #include <atomic>
 #include <functional>
+#include <algorithm>
+#include <string>
+#include <new>
+#include <cstdlib>
 
 #ifdef NON_APPLE_CLANG 
 //Clang on linux is missing this
@@ -61,20 +65,51 @@ namespace
    
    std::mutex resultsMutex;
    auto results = std::vector<boost::timer::nanosecond_type>();
+   auto totalCount = size_t (0);
+   auto totalRuns = size_t (0);
+
+   //Heap allocations are only counted when asked for since the counter is shared by all the
+   //threads.
+   std::atomic<bool> countAllocs (false);
+   std::atomic<size_t> numAllocs (0);
 
    const auto ns_per_s = boost::timer::nanosecond_type (1000000000);
 }
 
-template <typename F_t>
-void RunTest (const F_t& f, boost::barrier& bar, const size_t numVars)
+#if defined (__GNUC__) && !defined (__clang__) && __GNUC__ >= 11
+//GCC can't tell that the replacement operator delete below is matched with the replacement operator
+//new
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new (std::size_t size)
 {
-   auto vars = std::vector<WVar<int>>(numVars);
-   for (auto& v: vars)
+   if (countAllocs.load (std::memory_order_relaxed))
    {
-      v.Set (0);
+      numAllocs.fetch_add (1, std::memory_order_relaxed);
    }
+   if (auto p = std::malloc (size ? size : 1))
+   {
+      return p;
+   }
+   throw std::bad_alloc ();
+}
 
+void operator delete (void* p) noexcept
+{
+   std::free (p);
+}
+
+void operator delete (void* p, std::size_t) noexcept
+{
+   std::free (p);
+}
+
+template <typename F_t>
+void RunTest (const F_t& f, boost::barrier& bar, std::vector<WVar<int>>& vars, const WContentionManager& contention)
+{
    auto count = size_t (0);
+   auto runs = size_t (0);
 
    bar.wait ();
    
@@ -83,17 +118,20 @@ void RunTest (const F_t& f, boost::barrier& bar, const size_t numVars)
    {
       Atomically ([&](WAtomic& at)
                   {
+                     ++runs;
                      for (auto& v: vars)
                      {
                         f (v, at);
                      }
-                  });
+                  }, contention, WSTM_CALL_SITE);
       ++count;
    }while (keepRunning.load ());
 
-   const auto elapsedSecs = timer.elapsed ().wall/ns_per_s;
+   const auto elapsedSecs = static_cast<double>(timer.elapsed ().wall)/ns_per_s;
    std::lock_guard<std::mutex> lock (resultsMutex);
    results.push_back (count/elapsedSecs);
+   totalCount += count;
+   totalRuns += runs;
 }
 
 int main (int argc, const char** argv)
@@ -101,15 +139,26 @@ int main (int argc, const char** argv)
    auto numThreads = 0u;
    auto numVars = 0u;
    auto durationSecs = 0u;
+   auto policy = std::string ();
+   auto traceFile = std::string ();
    namespace po = boost::program_options;
    po::options_description desc;
    desc.add_options ()
       ("help", "Display help message")
       ("version", "The program and library version")
       ("set,S", "Change variable values instead of just reading them")
+      ("shared,H", "All the threads use the same vars instead of each having their own")
+      ("allocs,A", "Count the heap allocations done by each transaction")
+      ("read-lock,L", "Hold a read lock while getting each var (the way that reads used to work before they were made lock free)")
+      ("combine,C", "Turn on commit combining")
+      ("hot-vars,X", "Report which vars caused the most aborts")
+      ("latency,Y", "Report how long transactions spent in each phase")
+      ("trace,R", po::value<std::string>(&traceFile), "Write a Chrome trace of each thread's last transactions to the given file")
+      ("sweep,W", "Run with 1, 2, 4, ... threads up to the number of threads and report the commits/second for each")
       ("threads,T", po::value<unsigned int>(&numThreads)->default_value (1), "The number of threads to run")
       ("vars,V", po::value<unsigned int>(&numVars)->default_value (1), "The number of vars to use in each thread")
-      ("duration,D", po::value<unsigned int>(&durationSecs)->default_value (10), "How long to run for in seconds");
+      ("duration,D", po::value<unsigned int>(&durationSecs)->default_value (10), "How long to run for in seconds")
+      ("policy,P", po::value<std::string>(&policy)->default_value ("none"), "The contention policy to use after conflicts (none, backoff, karma, timestamp or serialize)");
    po::variables_map vm;
    po::store(po::parse_command_line(argc, argv, desc), vm);
    po::notify(vm);
@@ -123,39 +172,158 @@ int main (int argc, const char** argv)
       std::cout << "Version = " << version.m_major << "." << version.m_minor << "." << version.m_patch << std::endl;
    }
    const auto doSet = vm.count ("set");
+   const auto shared = vm.count ("shared");
+   const auto readLock = vm.count ("read-lock");
+   const auto doCountAllocs = vm.count ("allocs");
+   const auto combine = vm.count ("combine");
+   const auto sweep = vm.count ("sweep");
+   const auto hotVars = vm.count ("hot-vars");
+   const auto latency = vm.count ("latency");
+   auto contention = WContentionManager ();
+   if (policy == "backoff")
+   {
+      contention = WContentionManager::Backoff ();
+   }
+   else if (policy == "karma")
+   {
+      contention = WContentionManager::Karma ();
+   }
+   else if (policy == "timestamp")
+   {
+      contention = WContentionManager::Timestamp ();
+   }
+   else if (policy == "serialize")
+   {
+      contention = WContentionManager::Serialize ();
+   }
+   else if (policy != "none")
+   {
+      std::cout << "Unknown contention policy: " << policy << std::endl;
+      return 1;
+   }
+   SetCommitCombining (combine);
    
-   std::cout << "Running " << (doSet ? "set" : "get") << " operations in " << numThreads << " threads for " << durationSecs
-             << " seconds with " << numVars << " vars in each transaction" << std::endl;
+#if defined (WSTM_STRIPED_LOCKS)
+   const auto engine = "striped";
+#elif defined (WSTM_CLOCK_ENGINE)
+   const auto engine = "clock";
+#else
+   const auto engine = "lock";
+#endif //WSTM_CLOCK_ENGINE
+   //compare_probes.sh compares runs with and without the probes (contention_tests_noprobes) to show
+   //what they cost when nothing is attached to them
+#ifdef WSTM_USDT_PROBES
+   const auto probes = "with";
+#else
+   const auto probes = "without";
+#endif //WSTM_USDT_PROBES
+   std::cout << "Running " << (doSet ? "set" : "get") << " operations in " << (sweep ? "up to " : "") << numThreads
+             << " threads for " << durationSecs << " seconds with " << numVars << (shared ? " shared" : "")
+             << " vars in each transaction" << (readLock ? " using read locks" : "") << (combine ? " with commit combining" : "")
+             << " (" << engine << " commit engine, " << policy << " contention policy, "
+             << probes << " USDT probes)" << std::endl;
    
-   boost::barrier bar (numThreads);
-
-   auto threads = std::vector<std::thread>();
-   if (!doSet)
+   //each thread gets its own vars unless they are shared
+   auto vars = std::vector<std::vector<WVar<int>>>();
+   for (auto i = size_t (0); i < (shared ? 1 : numThreads); ++i)
    {
-      for (auto i = size_t (0); i < numThreads; ++i)
+      vars.emplace_back (numVars);
+      if (hotVars)
       {
-         threads.push_back (std::thread ([&]() {RunTest ([](WVar<int>& v, WAtomic& at) {return v.Get (at);}, bar, numVars);}));
+         for (auto j = size_t (0); j < numVars; ++j)
+         {
+            vars.back ()[j].SetName (str (boost::format ("var %1%.%2%") % i % j));
+         }
       }
    }
-   else
-   {
-      const auto DoSet = [](auto& var, auto& at) {var.Set (var.Get (at) + 1, at);};
-      for (auto i = size_t (0); i < numThreads; ++i)
+   SetConflictAttribution (hotVars > 0);
+   SetLatencyTracking (latency > 0);
+   SetTracing (!traceFile.empty ());
+   const auto GetVars = [&](const size_t i) -> std::vector<WVar<int>>& {return vars[shared ? 0 : i];};
+
+   const auto DoGet = [](auto& var, auto& at) {return var.Get (at);};
+   const auto DoLockedGet = [](auto& var, auto& at)
       {
-         threads.push_back (std::thread ([&]() {RunTest (DoSet, bar, numVars);}));
-      }
-   }
+         WReadLockGuard<WAtomic> lock (at);
+         return var.Get (at);
+      };
+   const auto DoSet = [](auto& var, auto& at) {var.Set (var.Get (at) + 1, at);};
+   //Runs the test in the given number of threads, the results are left in results, totalCount and
+   //totalRuns.
+   const auto Run = [&](const size_t runThreads)
+      {
+         keepRunning.store (true);
+         results.clear ();
+         totalCount = 0;
+         totalRuns = 0;
+         numAllocs.store (0);
+         
+         boost::barrier bar (static_cast<unsigned int>(runThreads));
+         auto threads = std::vector<std::thread>();
+         for (auto i = size_t (0); i < runThreads; ++i)
+         {
+            if (doSet)
+            {
+               threads.push_back (std::thread ([&, i]() {RunTest (DoSet, bar, GetVars (i), contention);}));
+            }
+            else if (readLock)
+            {
+               threads.push_back (std::thread ([&, i]() {RunTest (DoLockedGet, bar, GetVars (i), contention);}));
+            }
+            else
+            {
+               threads.push_back (std::thread ([&, i]() {RunTest (DoGet, bar, GetVars (i), contention);}));
+            }
+         }
+
+         countAllocs.store (doCountAllocs);
+         boost::this_thread::sleep_for (boost::chrono::seconds (durationSecs));
+         keepRunning.store (false);
+         for (auto& t: threads)
+         {
+            t.join ();
+         }
+         countAllocs.store (false);
+      };
 
-   boost::this_thread::sleep_for (boost::chrono::seconds (durationSecs));
-   keepRunning.store (false);
-   for (auto& t: threads)
+   if (sweep)
    {
-      t.join ();
+      std::cout << "Threads\tCommits/second\tAborts/commit" << std::endl;
+      for (auto runThreads = size_t (1); ; runThreads = std::min<size_t> (runThreads*2, numThreads))
+      {
+         Run (runThreads);
+         std::lock_guard<std::mutex> lock (resultsMutex);
+         std::cout << runThreads << "\t" << boost::accumulate (results, 0.0) << "\t"
+                   << static_cast<double>(totalRuns - totalCount)/totalCount << std::endl;
+         if (runThreads >= numThreads)
+         {
+            break;
+         }
+      }
+      return 0;
    }
 
+   Run (numThreads);
    std::lock_guard<std::mutex> lock (resultsMutex);
    const auto avg = boost::accumulate (results, 0.0)/numThreads;
    std::cout << "Transactions/second = " << avg << std::endl;
+   std::cout << "Aborts/commit = " << static_cast<double>(totalRuns - totalCount)/totalCount << std::endl;
+   if (doCountAllocs)
+   {
+      std::cout << "Allocations/transaction = " << static_cast<double>(numAllocs.load ())/totalCount << std::endl;
+   }
+   if (hotVars)
+   {
+      std::cout << "Hot vars:" << std::endl << FormatHotVariables (GetHotVariables ());
+   }
+   if (latency)
+   {
+      std::cout << "Latencies:" << std::endl << FormatLatencies (GetLatencies ());
+   }
+   if (!traceFile.empty () && !WriteTrace (traceFile))
+   {
+      std::cout << "Couldn't write the trace to " << traceFile << std::endl;
+   }
    
    return 0;
 }
@@ -0,0 +1,130 @@
+// Copyright (c) 2015, Wyatt Technology Corporation
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "await.h"
+using namespace WSTM;
+
+#include <boost/test/unit_test.hpp>
+
+//These are built as their own C++20 test program (await_tests) since the rest of the tests are
+//C++14.
+#ifdef WSTM_HAS_COROUTINES
+
+#include <vector>
+
+namespace
+{
+   //a coroutine that nobody waits for
+   struct WDetached
+   {
+      struct promise_type
+      {
+         WDetached get_return_object () {return {};}
+         std::suspend_never initial_suspend () {return {};}
+         std::suspend_never final_suspend () noexcept {return {};}
+         void return_void () {}
+         void unhandled_exception () {std::terminate ();}
+      };
+   };
+
+   WDetached Consume (WVar<int>& x, WChannelReader<int>& reader, WDeferredValue<int> result)
+   {
+      try
+      {
+         const auto val = co_await AtomicallyAwait ([&x](WAtomic& at)
+                                                    {
+                                                       const auto v = x.Get (at);
+                                                       if (v == 0)
+                                                       {
+                                                          Retry (at);
+                                                       }
+                                                       return v;
+                                                    });
+         const auto msg_o = co_await AwaitRead (reader);
+         const auto done = co_await Await (DoneDeferred (*msg_o));
+         result.Done (val + done);
+      }
+      catch (...)
+      {
+         result.Fail (std::current_exception ());
+      }
+   }
+
+   WDetached Timeout (WChannelReader<int>& reader, WDeferredValue<bool> result)
+   {
+      const auto msg_o = co_await AwaitRead (reader, std::chrono::milliseconds (10));
+      result.Done (!msg_o);
+   }
+}
+
+BOOST_AUTO_TEST_SUITE (Await)
+
+BOOST_AUTO_TEST_CASE (waits_without_threads)
+{
+   WVar<int> x (0);
+   WChannel<int> chan;
+   const auto numWaiting = 1000;
+   //the coroutines hold on to the readers so they can't move
+   auto readers = std::vector<WChannelReader<int>>();
+   readers.reserve (numWaiting);
+   auto results = std::vector<WDeferredResult<int>>();
+   for (auto i = 0; i < numWaiting; ++i)
+   {
+      readers.emplace_back (chan);
+      WDeferredValue<int> value;
+      results.push_back (value);
+      Consume (x, readers.back (), value);
+   }
+   BOOST_CHECK (!results.back ().IsDone ());
+   
+   x.Set (1);
+   chan.Write (2);
+   for (const auto& result: results)
+   {
+      BOOST_REQUIRE (result.Wait (std::chrono::seconds (10)));
+      BOOST_CHECK_EQUAL (3, result.GetResult ());
+   }
+}
+
+BOOST_AUTO_TEST_CASE (read_timeout)
+{
+   WChannel<int> chan;
+   WChannelReader<int> reader (chan);
+   WDeferredValue<bool> value;
+   WDeferredResult<bool> result (value);
+   Timeout (reader, value);
+   BOOST_REQUIRE (result.Wait (std::chrono::seconds (10)));
+   BOOST_CHECK (result.GetResult ());
+}
+
+BOOST_AUTO_TEST_SUITE_END (/*Await*/)
+
+#endif //WSTM_HAS_COROUTINES
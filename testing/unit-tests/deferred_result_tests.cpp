@@ -33,6 +33,9 @@ using namespace  WSTM;
 
 #include <boost/test/unit_test.hpp>
 
+#include <atomic>
+#include <thread>
+
 namespace
 {
 	struct WTestException
@@ -445,4 +448,89 @@ BOOST_AUTO_TEST_CASE (assigns_properly_int)
    BOOST_CHECK (!val1.IsDone ());
 }
 
+BOOST_AUTO_TEST_CASE (atomically_async)
+{
+   //the result or the exception thrown is reported through the deferred result
+   auto res = AtomicallyAsync ([](WAtomic&){return 5;});
+   BOOST_REQUIRE (res.Wait (std::chrono::seconds (10)));
+   BOOST_CHECK_EQUAL (5, res.GetResult ());
+   auto fail = AtomicallyAsync ([](WAtomic&){throw WTestException (3);});
+   BOOST_REQUIRE (fail.Wait (std::chrono::seconds (10)));
+   BOOST_CHECK_THROW (fail.ThrowError (), WTestException);
+
+   //transactions waiting in Retry don't each need a thread
+   WVar<bool> go (false);
+   const auto numWaiting = 1000;
+   auto waiting = std::vector<WDeferredResult<int>>();
+   for (auto i = 0; i < numWaiting; ++i)
+   {
+      waiting.push_back (AtomicallyAsync ([&go, i](WAtomic& at)
+                                          {
+                                             if (!go.Get (at))
+                                             {
+                                                Retry (at);
+                                             }
+                                             return i;
+                                          }));
+   }
+   BOOST_CHECK (!waiting.back ().IsDone ());
+   go.Set (true);
+   for (auto i = 0; i < numWaiting; ++i)
+   {
+      BOOST_REQUIRE (waiting[i].Wait (std::chrono::seconds (10)));
+      BOOST_CHECK_EQUAL (i, waiting[i].GetResult ());
+   }
+
+   //timing out in Retry fails the result
+   WVar<bool> never (false);
+   auto timeout = AtomicallyAsync ([&never](WAtomic& at)
+                                   {
+                                      if (!never.Get (at))
+                                      {
+                                         Retry (at, std::chrono::milliseconds (10));
+                                      }
+                                   });
+   BOOST_REQUIRE (timeout.Wait (std::chrono::seconds (10)));
+   BOOST_CHECK_THROW (timeout.ThrowError (), WRetryTimeoutException);
+
+   //Transactions run by the task's after actions wait in Retry like any other transaction, they
+   //don't get parked in place of the task.
+   WVar<bool> afterGo (false);
+   WVar<bool> afterDone (false);
+   std::atomic<bool> afterWaiting (false);
+   std::atomic<int> runs (0);
+   auto withAfter = AtomicallyAsync ([&](WAtomic& at)
+                                     {
+                                        ++runs;
+                                        at.After ([&]()
+                                                  {
+                                                     Atomically ([&](WAtomic& at2)
+                                                                 {
+                                                                    if (!afterGo.Get (at2))
+                                                                    {
+                                                                       afterWaiting = true;
+                                                                       Retry (at2);
+                                                                    }
+                                                                    afterDone.Set (true, at2);
+                                                                 });
+                                                  });
+                                     });
+   for (auto i = 0; i < 1000 && !afterWaiting; ++i)
+   {
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+   }
+   BOOST_REQUIRE (afterWaiting);
+   afterGo.Set (true);
+   Atomically ([&](WAtomic& at)
+               {
+                  if (!afterDone.Get (at))
+                  {
+                     Retry (at, std::chrono::seconds (10));
+                  }
+               });
+   BOOST_REQUIRE (withAfter.Wait (std::chrono::seconds (10)));
+   BOOST_CHECK_NO_THROW (withAfter.ThrowError ());
+   BOOST_CHECK_EQUAL (1, runs.load ());
+}
+
 BOOST_AUTO_TEST_SUITE_END (/*DeferredResult*/)
@@ -42,6 +42,10 @@ using boost::barrier;
 #include <cstdlib>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <sstream>
 
 
 BOOST_AUTO_TEST_SUITE (STM)
@@ -162,6 +166,68 @@ BOOST_AUTO_TEST_CASE (StmVarTests_DtorCalled)
    BOOST_CHECK_EQUAL (2, varDtorDead[2].second);
 }
 
+BOOST_AUTO_TEST_CASE (StmVarTests_test_reclaim)
+{
+   //A value that is replaced while another thread could be reading it is freed once that thread's
+   //transaction is done, even though the thread that replaced it has exited without running any
+   //more transactions. After functions are freed once they have run unless they have to outlive
+   //the replaced values.
+   auto value_p = std::make_shared<int>(1);
+   WSTM::WVar<std::shared_ptr<int>> v (value_p);
+   auto after_p = std::make_shared<int>(2);
+   auto kept_p = std::make_shared<int>(3);
+   std::mutex mutex;
+   std::condition_variable cond;
+   auto reading = false;
+   auto committed = false;
+   std::thread reader ([&]()
+                       {
+                          WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                            {
+                                               v.Get (at);
+                                               std::unique_lock<std::mutex> lock (mutex);
+                                               reading = true;
+                                               cond.notify_all ();
+                                               cond.wait (lock, [&](){return committed;});
+                                            });
+                       });
+   {
+      std::unique_lock<std::mutex> lock (mutex);
+      cond.wait (lock, [&](){return reading;});
+   }
+   std::thread ([&]()
+                {
+                   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                     {
+                                        v.Set (nullptr, at);
+                                        at.After ([after_p](){});
+                                        at.AfterOutlivingValues ([kept_p](){});
+                                     });
+                }).join ();
+   BOOST_CHECK_EQUAL (1, after_p.use_count ());
+   BOOST_CHECK_EQUAL (2, value_p.use_count ());
+   BOOST_CHECK_EQUAL (2, kept_p.use_count ());
+   {
+      std::lock_guard<std::mutex> lock (mutex);
+      committed = true;
+      cond.notify_all ();
+   }
+   reader.join ();
+   BOOST_CHECK_EQUAL (1, value_p.use_count ());
+   BOOST_CHECK_EQUAL (1, kept_p.use_count ());
+
+   //The cores of variables destroyed outside of transactions are freed once the thread's next
+   //transaction is done. The first transaction frees anything left over from the other tests.
+   WSTM::Atomically ([](WSTM::WAtomic&){});
+   auto held_p = std::make_shared<int>(4);
+   {
+      WSTM::WVar<std::shared_ptr<int>> w (held_p);
+   }
+   BOOST_CHECK_EQUAL (2, held_p.use_count ());
+   WSTM::Atomically ([](WSTM::WAtomic&){});
+   BOOST_CHECK_EQUAL (1, held_p.use_count ());
+}
+
 namespace
 {
 	void Wait(std::shared_ptr<boost::barrier>& barrier_p)
@@ -178,6 +244,58 @@ namespace
 		v.Set(cur + inc, at);
 		return cur;
 	}
+
+   //Runs func on another thread and waits for it to finish. Transactions use this to have things
+   //change underneath them.
+   template <typename Func_t>
+   void RunOnOtherThread (const Func_t& func)
+   {
+      std::thread (func).join ();
+   }
+
+   //Changes v from another thread so that a transaction running on this thread that has read v
+   //will have a conflict.
+   template <typename Type_t>
+   void ForceConflict (WSTM::WVar<Type_t>& v, const Type_t& val)
+   {
+      RunOnOtherThread ([&](){WSTM::Atomically ([&](WSTM::WAtomic& at){v.Set (val, at);});});
+   }
+
+   void ForceConflict (WSTM::WVar<int>& v)
+   {
+      RunOnOtherThread ([&](){WSTM::Atomically ([&](WSTM::WAtomic& at){v.Set (v.Get (at) + 1, at);});});
+   }
+
+   //Has numThreads threads each run numIncrements transactions that increment v using the given
+   //options. If alsoDo is set it is run in each of the transactions, it is given the index of the
+   //thread.
+   template <typename... Options_t>
+   void HammerIncrements (WSTM::WVar<int>& v, const int numThreads, const int numIncrements,
+                          const std::function<void (int, WSTM::WAtomic&)>& alsoDo, const Options_t&... options)
+   {
+      auto threads = std::vector<std::thread>();
+      for (auto i = 0; i < numThreads; ++i)
+      {
+         threads.push_back (std::thread ([&, i]()
+                                         {
+                                            for (auto j = 0; j < numIncrements; ++j)
+                                            {
+                                               WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                                                 {
+                                                                    v.Set (v.Get (at) + 1, at);
+                                                                    if (alsoDo)
+                                                                    {
+                                                                       alsoDo (i, at);
+                                                                    }
+                                                                 }, options...);
+                                            }
+                                         }));
+      }
+      for (auto& t: threads)
+      {
+         t.join ();
+      }
+   }
 }
 
 BOOST_AUTO_TEST_CASE (StmVarTests_test_int_increment)
@@ -232,6 +350,943 @@ BOOST_AUTO_TEST_CASE (StmVarTests_test_class_increment)
 	}
 }
 
+BOOST_AUTO_TEST_CASE (StmVarTests_test_many_vars)
+{
+   //enough variables that the transaction's read and write sets have to be indexed
+   std::vector<WSTM::WVar<int>> vars (100);
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        for (auto i = 0u; i < vars.size (); ++i)
+                        {
+                           vars[i].Set (vars[i].Get (at) + static_cast<int>(i), at);
+                        }
+                        for (auto i = 0u; i < vars.size (); ++i)
+                        {
+                           BOOST_CHECK_EQUAL (static_cast<int>(i), vars[i].Get (at));
+                        }
+                     });
+   for (auto i = 0u; i < vars.size (); ++i)
+   {
+      BOOST_CHECK_EQUAL (static_cast<int>(i), vars[i].GetReadOnly ());
+   }
+}
+
+namespace
+{
+   struct WPair
+   {
+      int64_t m_a;
+      int64_t m_b;
+   };
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_inline_struct)
+{
+   //small trivially copyable types are stored in the variable itself
+   static_assert (WSTM::Internal::WIsInlineValue<WPair>::value, "WPair should be stored inline");
+   WSTM::WVar<WPair> v (WPair {1, -1});
+
+   //Boost.Test isn't thread safe so the threads just count the torn values that they see
+   std::atomic<int> torn (0);
+   std::vector<std::thread> threads;
+   for (auto i = 0; i < 4; ++i)
+   {
+      threads.emplace_back ([&]()
+                            {
+                               for (auto j = 0; j < 1000; ++j)
+                               {
+                                  WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                                    {
+                                                       const auto p = v.Get (at);
+                                                       if (p.m_a != -p.m_b)
+                                                       {
+                                                          ++torn;
+                                                       }
+                                                       v.Set (WPair {p.m_a + 1, p.m_b - 1}, at);
+                                                       //nested transactions see the parent's value
+                                                       WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                                                         {
+                                                                            if (v.Get (at).m_a != p.m_a + 1)
+                                                                            {
+                                                                               ++torn;
+                                                                            }
+                                                                         });
+                                                    });
+                                  WSTM::Inconsistently ([&](WSTM::WInconsistent& ins)
+                                                        {
+                                                           const auto p = v.GetInconsistent (ins);
+                                                           if (p.m_a != -p.m_b)
+                                                           {
+                                                              ++torn;
+                                                           }
+                                                        });
+                               }
+                            });
+   }
+   for (auto& t: threads)
+   {
+      t.join ();
+   }
+   BOOST_CHECK_EQUAL (0, torn.load ());
+   BOOST_CHECK_EQUAL (4001, v.GetReadOnly ().m_a);
+   BOOST_CHECK_EQUAL (-4001, v.GetReadOnly ().m_b);
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_read_only)
+{
+   WSTM::WVar<int> x (0);
+   WSTM::WVar<std::string> y ("0");
+
+   BOOST_CHECK_THROW (WSTM::Atomically ([&](WSTM::WAtomic& at){x.Set (1, at);}, WSTM::WReadOnly (true)),
+                      WSTM::WReadOnlyException);
+   BOOST_CHECK_THROW (WSTM::Atomically ([&](WSTM::WAtomic&)
+                                        {
+                                           WSTM::Atomically ([&](WSTM::WAtomic& at){x.Set (1, at);});
+                                        }, WSTM::WReadOnly (true)),
+                      WSTM::WReadOnlyException);
+   BOOST_CHECK_EQUAL (0, x.GetReadOnly ());
+
+   //the values seen by a read-only transaction are consistent while it runs, not just when it
+   //commits
+   std::atomic<bool> done (false);
+   std::thread writer ([&]()
+                       {
+                          for (auto i = 1; i <= 1000; ++i)
+                          {
+                             WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                               {
+                                                  x.Set (i, at);
+                                                  y.Set (std::to_string (i), at);
+                                               });
+                          }
+                          done = true;
+                       });
+   auto inconsistent = 0;
+   while (!done)
+   {
+      WSTM::Atomically ([&](WSTM::WAtomic& at)
+                        {
+                           const auto xVal = x.Get (at);
+                           std::this_thread::yield ();
+                           if (std::to_string (xVal) != y.Get (at))
+                           {
+                              ++inconsistent;
+                           }
+                        }, WSTM::WReadOnly (true));
+   }
+   writer.join ();
+   BOOST_CHECK_EQUAL (0, inconsistent);
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_history)
+{
+   WSTM::WVar<int> x (0, WSTM::WVarHistory (8));
+   WSTM::WVar<std::string> y ("0", WSTM::WVarHistory (8));
+
+   //a read-only transaction reads the old values instead of restarting when the variables are
+   //changed while it runs
+   auto runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        const auto xVal = x.Get (at);
+                        std::thread writer ([&]()
+                                            {
+                                               for (auto i = 1; i <= 5; ++i)
+                                               {
+                                                  WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                                                    {
+                                                                       x.Set (i, at);
+                                                                       y.Set (std::to_string (i), at);
+                                                                    });
+                                               }
+                                            });
+                        writer.join ();
+                        BOOST_CHECK_EQUAL (5u, y.GetHistoryLength ());
+                        BOOST_CHECK (y.GetHistoryMemory () > 0);
+                        BOOST_CHECK_EQUAL (std::to_string (xVal), y.Get (at));
+                     }, WSTM::WReadOnly (true));
+   BOOST_CHECK_EQUAL (1, runs);
+   BOOST_CHECK_EQUAL (5, x.GetReadOnly ());
+
+   //the old values are dropped once no read-only transaction could want them
+   WSTM::Atomically ([&](WSTM::WAtomic& at){y.Set ("6", at);});
+   BOOST_CHECK_EQUAL (0u, y.GetHistoryLength ());
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_contention_manager)
+{
+   struct WCountingPolicy : public WSTM::WContentionPolicy
+   {
+      int m_conflicts = 0;
+      int m_finishes = 0;
+      size_t m_karma = 0;
+
+      void OnConflict (WSTM::WContentionInfo& info) override
+      {
+         ++m_conflicts;
+         m_karma = info.m_karma;
+      }
+
+      void OnFinish (WSTM::WContentionInfo&) override
+      {
+         ++m_finishes;
+      }
+   };
+
+   WSTM::WVar<int> v (0);
+   const auto policy_p = std::make_shared<WCountingPolicy>();
+   const auto managers = {WSTM::WContentionManager (policy_p),
+                          WSTM::WContentionManager::Backoff (),
+                          WSTM::WContentionManager::Karma (),
+                          WSTM::WContentionManager::Timestamp (),
+                          WSTM::WContentionManager::Serialize ()};
+   for (const auto& manager: managers)
+   {
+      auto runs = 0;
+      WSTM::Atomically ([&](WSTM::WAtomic& at)
+                        {
+                           ++runs;
+                           v.Set (v.Get (at) + 1, at);
+                           if (runs == 1)
+                           {
+                              ForceConflict (v);
+                           }
+                        }, manager);
+      BOOST_CHECK_EQUAL (2, runs);
+   }
+   BOOST_CHECK_EQUAL (10, v.GetReadOnly ());
+   BOOST_CHECK_EQUAL (1, policy_p->m_conflicts);
+   BOOST_CHECK_EQUAL (1, policy_p->m_finishes);
+   //v was both read and set
+   BOOST_CHECK_EQUAL (2u, policy_p->m_karma);
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_serialize)
+{
+   //policies are told which variable each conflict was over
+   struct WConflictPolicy : public WSTM::WContentionPolicy
+   {
+      std::vector<const void*> m_conflicts;
+
+      void OnConflict (WSTM::WContentionInfo& info) override
+      {
+         m_conflicts.push_back (info.m_conflict);
+      }
+   };
+
+   WSTM::WVar<int> x (0);
+   WSTM::WVar<int> y (0);
+   const auto policy_p = std::make_shared<WConflictPolicy>();
+   for (auto v_p: {&x, &y, &x})
+   {
+      auto runs = 0;
+      WSTM::Atomically ([&](WSTM::WAtomic& at)
+                        {
+                           ++runs;
+                           x.Get (at);
+                           y.Get (at);
+                           if (runs == 1)
+                           {
+                              ForceConflict (*v_p);
+                           }
+                           //forces validation
+                           x.Set (x.Get (at), at);
+                        }, WSTM::WContentionManager (policy_p));
+   }
+   BOOST_REQUIRE_EQUAL (3u, policy_p->m_conflicts.size ());
+   BOOST_CHECK (policy_p->m_conflicts[0]);
+   BOOST_CHECK (policy_p->m_conflicts[1]);
+   BOOST_CHECK (policy_p->m_conflicts[0] != policy_p->m_conflicts[1]);
+   BOOST_CHECK (policy_p->m_conflicts[0] == policy_p->m_conflicts[2]);
+
+   //A transaction that keeps conflicting over the same variable takes its lane once the lane is
+   //hot. The lane cools off if the conflicts are too far apart so they're forced until it is taken.
+   WSTM::WVar<int> hot (0);
+   WSTM::StartProfiling ();
+   auto runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        hot.Set (hot.Get (at) + 1, at);
+                        if (runs < 100 && WSTM::Checkpoint ().m_numSerialized == 0)
+                        {
+                           ForceConflict (hot);
+                        }
+                     }, WSTM::WContentionManager::Serialize ());
+   BOOST_CHECK_EQUAL (1, WSTM::Checkpoint ().m_numSerialized);
+   WSTM::StopProfiling ();
+   BOOST_CHECK_EQUAL (runs, hot.GetReadOnly ());
+
+   //transactions that keep conflicting over the same variable still all get done
+   const auto numThreads = 4;
+   const auto numIncrements = 1000;
+   HammerIncrements (hot, numThreads, numIncrements, {}, WSTM::WContentionManager::Serialize ());
+   BOOST_CHECK_EQUAL (runs + numThreads*numIncrements, hot.GetReadOnly ());
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_profiling)
+{
+   WSTM::StartProfiling ();
+
+   //a commit that reads two variables and writes one, after a conflict that escalates to RUN_LOCKED
+   WSTM::WVar<int> x (0);
+   WSTM::WVar<int> y (0);
+   auto runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        y.Get (at);
+                        if (runs == 1)
+                        {
+                           ForceConflict (y, 1);
+                        }
+                        x.Set (x.Get (at) + 1, at);
+                     }, WSTM::WMaxConflicts (1, WSTM::WConflictResolution::RUN_LOCKED));
+   BOOST_CHECK_EQUAL (2, runs);
+
+   //a retry, counted by a thread that has exited by the time we check
+   std::thread ([&]()
+                {
+                   try
+                   {
+                      WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                        {
+                                           x.Get (at);
+                                           WSTM::Retry (at, std::chrono::milliseconds (1));
+                                        });
+                   }
+                   catch (WSTM::WRetryTimeoutException&)
+                   {}
+                }).join ();
+
+   const auto data = WSTM::Checkpoint ();
+   BOOST_CHECK (data.m_end >= data.m_start);
+   BOOST_CHECK_GE (data.m_numConflicts, 1);
+   BOOST_CHECK_GE (data.m_numRunLocked, 1);
+   BOOST_CHECK_GE (data.m_numWriteCommits, 2);
+   BOOST_CHECK_GE (data.m_numReads, 2);
+   BOOST_CHECK_GE (data.m_numWrites, 2);
+   BOOST_CHECK_GE (data.m_numRetries, 1);
+   BOOST_CHECK (!data.FormatData ().empty ());
+
+   //nothing is counted once profiling is off
+   WSTM::StopProfiling ();
+   x.Set (2);
+   const auto after = WSTM::Checkpoint ();
+   BOOST_CHECK_EQUAL (data.m_numWriteCommits, after.m_numWriteCommits);
+   BOOST_CHECK_EQUAL (data.m_numRetries, after.m_numRetries);
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_hot_variables)
+{
+   WSTM::SetConflictAttribution (true);
+   WSTM::ResetHotVariables ();
+
+   WSTM::WVar<int> x (0);
+   x.SetName ("x");
+   WSTM::WVar<int> y (0);
+   BOOST_CHECK_EQUAL ("x", x.GetName ());
+   BOOST_CHECK_EQUAL ("", y.GetName ());
+
+   //conflicts over x from two call sites and one over y
+   const auto conflict = [&](WSTM::WVar<int>& v, const WSTM::WCallSite& site)
+      {
+         auto runs = 0;
+         WSTM::Atomically ([&](WSTM::WAtomic& at)
+                           {
+                              ++runs;
+                              x.Get (at);
+                              y.Get (at);
+                              if (runs == 1)
+                              {
+                                 ForceConflict (v);
+                              }
+                              //forces validation
+                              x.Set (x.Get (at), at);
+                           }, site);
+      };
+   conflict (x, WSTM::WCallSite ("a"));
+   conflict (x, WSTM::WCallSite ("a"));
+   conflict (x, WSTM_CALL_SITE);
+   conflict (y, WSTM::WCallSite ());
+   WSTM::SetConflictAttribution (false);
+   conflict (y, WSTM::WCallSite ());
+
+   const auto vars = WSTM::GetHotVariables ();
+   BOOST_REQUIRE_EQUAL (2u, vars.size ());
+   BOOST_CHECK_EQUAL ("x", vars[0].m_name);
+   BOOST_CHECK_EQUAL (3, vars[0].m_aborts);
+   BOOST_REQUIRE_EQUAL (2u, vars[0].m_callSites.size ());
+   BOOST_CHECK_EQUAL ("a", vars[0].m_callSites[0].first);
+   BOOST_CHECK_EQUAL (2, vars[0].m_callSites[0].second);
+   BOOST_CHECK (vars[0].m_callSites[1].first.find ("stm_test.cpp") != std::string::npos);
+   BOOST_CHECK (vars[1].m_var);
+   BOOST_CHECK (vars[1].m_var != vars[0].m_var);
+   BOOST_CHECK_EQUAL ("", vars[1].m_name);
+   BOOST_CHECK_EQUAL (1, vars[1].m_aborts);
+   BOOST_REQUIRE_EQUAL (1u, vars[1].m_callSites.size ());
+   BOOST_CHECK_EQUAL ("unknown", vars[1].m_callSites[0].first);
+   BOOST_CHECK (WSTM::FormatHotVariables (vars).find ("x: 3 aborts") != std::string::npos);
+
+   WSTM::ResetHotVariables ();
+   BOOST_CHECK (WSTM::GetHotVariables ().empty ());
+
+   //the counts of destroyed variables are kept under their names
+   WSTM::SetConflictAttribution (true);
+   {
+      WSTM::WVar<int> z (0);
+      z.SetName ("z");
+      auto runs = 0;
+      WSTM::Atomically ([&](WSTM::WAtomic& at)
+                        {
+                           ++runs;
+                           z.Set (z.Get (at) + 1, at);
+                           if (runs == 1)
+                           {
+                              ForceConflict (z);
+                           }
+                        });
+      BOOST_CHECK_EQUAL (1u, WSTM::GetHotVariables ().size ());
+   }
+   WSTM::SetConflictAttribution (false);
+   //frees z's core
+   WSTM::Atomically ([](WSTM::WAtomic&){});
+   const auto destroyed = WSTM::GetHotVariables ();
+   BOOST_REQUIRE_EQUAL (1u, destroyed.size ());
+   BOOST_CHECK (!destroyed[0].m_var);
+   BOOST_CHECK (destroyed[0].m_destroyed);
+   BOOST_CHECK_EQUAL ("z", destroyed[0].m_name);
+   BOOST_CHECK_EQUAL (1, destroyed[0].m_aborts);
+   BOOST_CHECK (WSTM::FormatHotVariables (destroyed).find ("z (destroyed): 1 aborts") != std::string::npos);
+   WSTM::ResetHotVariables ();
+   BOOST_CHECK (WSTM::GetHotVariables ().empty ());
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_latencies)
+{
+   //buckets hold the times that they say they do
+   BOOST_CHECK_EQUAL (0u, WSTM::WLatencyHistogram::GetBucket (std::chrono::nanoseconds (0)));
+   BOOST_CHECK_EQUAL (15u, WSTM::WLatencyHistogram::GetBucket (std::chrono::nanoseconds (15)));
+   for (const auto ns: {16ll, 17ll, 1000ll, 123456ll, 987654321ll})
+   {
+      const auto bucket = WSTM::WLatencyHistogram::GetBucket (std::chrono::nanoseconds (ns));
+      BOOST_CHECK_GE (WSTM::WLatencyHistogram::GetBucketMax (bucket).count (), ns);
+      BOOST_CHECK_LT (WSTM::WLatencyHistogram::GetBucketMax (bucket - 1).count (), ns);
+   }
+
+   WSTM::SetLatencyTracking (true);
+   WSTM::ResetLatencies ();
+
+   WSTM::WVar<int> x (0);
+   const auto numTransactions = 10;
+   for (auto i = 0; i < numTransactions; ++i)
+   {
+      WSTM::Atomically ([&](WSTM::WAtomic& at)
+                        {
+                           x.Set (x.Get (at) + 1, at);
+                           at.After ([](){});
+                        }, WSTM::WCallSite ("latency test"));
+   }
+   try
+   {
+      WSTM::Atomically ([&](WSTM::WAtomic& at)
+                        {
+                           x.Get (at);
+                           WSTM::Retry (at, std::chrono::milliseconds (1));
+                        }, WSTM::WCallSite ("latency test"));
+   }
+   catch (WSTM::WRetryTimeoutException&)
+   {}
+   WSTM::SetLatencyTracking (false);
+   x.Set (0);
+
+   const auto find = [](const std::vector<WSTM::WCallSiteLatencies>& latencies)
+      {
+         return std::find_if (latencies.begin (), latencies.end (),
+                              [](const WSTM::WCallSiteLatencies& l){return l.m_callSite == "latency test";});
+      };
+   const auto latencies = WSTM::GetLatencies ();
+   const auto it = find (latencies);
+   BOOST_REQUIRE (it != latencies.end ());
+   BOOST_CHECK_EQUAL (numTransactions + 1u, it->m_total.GetCount ());
+   BOOST_CHECK_EQUAL (numTransactions + 1u, it->m_run.GetCount ());
+   BOOST_CHECK_EQUAL (numTransactions + 0u, it->m_commit.GetCount ());
+   BOOST_CHECK_EQUAL (numTransactions + 0u, it->m_afters.GetCount ());
+   BOOST_CHECK_GE (it->m_lock.GetCount (), numTransactions + 0u);
+   BOOST_CHECK_EQUAL (1u, it->m_retryWait.GetCount ());
+   BOOST_CHECK (it->m_retryWait.GetPercentile (50) >= std::chrono::milliseconds (1));
+   BOOST_CHECK (it->m_total.GetPercentile (50) <= it->m_total.GetPercentile (99));
+   BOOST_CHECK (it->m_total.GetMean () > std::chrono::nanoseconds (0));
+   BOOST_CHECK (WSTM::FormatLatencies (latencies).find ("latency test") != std::string::npos);
+
+   WSTM::ResetLatencies ();
+   const auto reset = WSTM::GetLatencies ();
+   BOOST_CHECK (find (reset) == reset.end ());
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_trace)
+{
+   WSTM::SetTracing (true);
+
+   WSTM::WVar<int> x (0);
+   WSTM::WVar<int> y (0);
+   auto runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        x.Get (at);
+                        if (runs == 1)
+                        {
+                           ForceConflict (x, 1);
+                        }
+                        y.Set (x.Get (at), at);
+                     }, WSTM::WCallSite ("trace \"test\""));
+   try
+   {
+      WSTM::Atomically ([&](WSTM::WAtomic& at)
+                        {
+                           x.Get (at);
+                           WSTM::Retry (at, std::chrono::milliseconds (1));
+                        }, WSTM::WCallSite ("trace \"test\""));
+   }
+   catch (WSTM::WRetryTimeoutException&)
+   {}
+   //more events than the buffer holds
+   std::thread ([&]()
+                {
+                   for (auto i = 0; i < 5000; ++i)
+                   {
+                      WSTM::Atomically ([&](WSTM::WAtomic& at){y.Set (i, at);}, WSTM::WCallSite ("trace overflow"));
+                   }
+                }).join ();
+   WSTM::SetTracing (false);
+
+   std::ostringstream out;
+   WSTM::WriteTrace (out);
+   const auto trace = out.str ();
+   BOOST_CHECK_EQUAL (0u, trace.find ("{\"traceEvents\":["));
+   BOOST_CHECK_EQUAL (trace.size () - 3, trace.rfind ("]}\n"));
+   BOOST_CHECK (trace.find ("\"name\":\"trace \\\"test\\\"\"") != std::string::npos);
+   BOOST_CHECK (trace.find ("\"result\":\"abort\"") != std::string::npos);
+   BOOST_CHECK (trace.find ("\"result\":\"commit\",\"reads\":1,\"writes\":1") != std::string::npos);
+   BOOST_CHECK (trace.find ("\"result\":\"retry\"") != std::string::npos);
+   BOOST_CHECK (trace.find ("\"result\":\"timed out\"") != std::string::npos);
+   auto numOverflow = 0;
+   for (auto pos = trace.find ("trace overflow"); pos != std::string::npos; pos = trace.find ("trace overflow", pos + 1))
+   {
+      ++numOverflow;
+   }
+   BOOST_CHECK_GT (numOverflow, 0);
+   BOOST_CHECK_LE (numOverflow, 4096);
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_inevitable)
+{
+   WSTM::WVar<int> a (0);
+   auto others = std::vector<WSTM::WVar<int>>(8);
+   std::atomic<int> othersDone (0);
+   std::atomic<bool> writerDone (false);
+   auto threads = std::vector<std::thread>();
+   auto runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        const auto aVal = a.Get (at);
+                        //transactions that don't touch what we have read can still commit (a few
+                        //of them are used since variables can share marks)
+                        for (auto& other: others)
+                        {
+                           threads.push_back (std::thread ([&]()
+                              {
+                                 WSTM::Atomically ([&](WSTM::WAtomic& at){other.Set (1, at);});
+                                 ++othersDone;
+                              }));
+                        }
+                        const auto end = std::chrono::steady_clock::now () + std::chrono::seconds (10);
+                        while (othersDone.load () == 0 && std::chrono::steady_clock::now () < end)
+                        {
+                           std::this_thread::sleep_for (std::chrono::milliseconds (1));
+                        }
+                        BOOST_CHECK (othersDone.load () > 0);
+
+                        //but changes to what we have read have to wait for us to finish
+                        threads.push_back (std::thread ([&]()
+                           {
+                              WSTM::Atomically ([&](WSTM::WAtomic& at){a.Set (a.Get (at) + 10, at);});
+                              writerDone = true;
+                           }));
+                        std::this_thread::sleep_for (std::chrono::milliseconds (50));
+                        BOOST_CHECK (!writerDone);
+                        a.Set (aVal + 1, at);
+                     }, WSTM::WMaxConflicts (0, WSTM::WConflictResolution::RUN_INEVITABLE));
+   for (auto& t: threads)
+   {
+      t.join ();
+   }
+   BOOST_CHECK_EQUAL (1, runs);
+   BOOST_CHECK_EQUAL (11, a.GetReadOnly ());
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_child_restart)
+{
+   WSTM::WVar<int> x (0);
+   WSTM::WVar<int> y (0);
+
+   //a conflict on something only the child read just restarts the child
+   auto outerRuns = 0;
+   auto innerRuns = 0;
+   auto result = WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                   {
+                                      ++outerRuns;
+                                      const auto xVal = x.Get (at);
+                                      return xVal + WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                                                      {
+                                                                         ++innerRuns;
+                                                                         const auto yVal = y.Get (at);
+                                                                         if (innerRuns == 1)
+                                                                         {
+                                                                            ForceConflict (y, 10);
+                                                                            at.Validate ();
+                                                                         }
+                                                                         return yVal;
+                                                                      });
+                                   });
+   BOOST_CHECK_EQUAL (1, outerRuns);
+   BOOST_CHECK_EQUAL (2, innerRuns);
+   BOOST_CHECK_EQUAL (10, result);
+
+   //if the parent's reads have changed the whole transaction is restarted, the conflict is only
+   //counted once
+   WSTM::StartProfiling ();
+   outerRuns = 0;
+   innerRuns = 0;
+   result = WSTM::Atomically ([&](WSTM::WAtomic& at)
+                              {
+                                 ++outerRuns;
+                                 const auto xVal = x.Get (at);
+                                 return xVal + WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                                                 {
+                                                                    ++innerRuns;
+                                                                    if (innerRuns == 1)
+                                                                    {
+                                                                       ForceConflict (x, 5);
+                                                                       x.Validate (at);
+                                                                    }
+                                                                    return y.Get (at);
+                                                                 });
+                              });
+   const auto data = WSTM::Checkpoint ();
+   WSTM::StopProfiling ();
+   BOOST_CHECK_EQUAL (2, outerRuns);
+   BOOST_CHECK_EQUAL (2, innerRuns);
+   BOOST_CHECK_EQUAL (15, result);
+   BOOST_CHECK_EQUAL (1, data.m_numConflicts);
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_counter)
+{
+   WSTM::WCounter<int> c (5);
+
+   //adding doesn't conflict with other transactions that add
+   auto runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        c.Add (1, at);
+                        if (runs == 1)
+                        {
+                           RunOnOtherThread ([&](){c.Add (10);});
+                        }
+                        c.Add (1, at);
+                     });
+   BOOST_CHECK_EQUAL (1, runs);
+   BOOST_CHECK_EQUAL (17, c.GetReadOnly ());
+
+   //reading turns the additions into a normal read so it does conflict
+   runs = 0;
+   const auto seen = WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                       {
+                                          ++runs;
+                                          c.Add (2, at);
+                                          const auto val = c.Get (at);
+                                          if (runs == 1)
+                                          {
+                                             RunOnOtherThread ([&](){c.Add (10);});
+                                          }
+                                          c.Add (1, at);
+                                          return val;
+                                       });
+   BOOST_CHECK_EQUAL (2, runs);
+   BOOST_CHECK_EQUAL (29, seen);
+   BOOST_CHECK_EQUAL (30, c.GetReadOnly ());
+
+   //child transactions see what their parents have added
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        c.Add (1, at);
+                        WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                          {
+                                             c.Add (2, at);
+                                             BOOST_CHECK_EQUAL (33, c.Get (at));
+                                          });
+                        c.Add (-3, at);
+                     });
+   BOOST_CHECK_EQUAL (30, c.GetReadOnly ());
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_release)
+{
+   std::vector<std::unique_ptr<WSTM::WVar<int>>> vars;
+   for (auto i = 0; i < 40; ++i)
+   {
+      vars.push_back (std::make_unique<WSTM::WVar<int>>(i));
+   }
+
+   //released variables can be changed without causing a conflict, the others still conflict
+   auto runs = 0;
+   auto reread = 0;
+   auto keptOk = true;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        for (auto& var_p: vars)
+                        {
+                           var_p->Get (at);
+                        }
+                        for (auto i = 0u; i < vars.size (); i += 2)
+                        {
+                           vars[i]->Release (at);
+                        }
+                        if (runs == 1)
+                        {
+                           ForceConflict (*vars[10], 100);
+                           at.Validate ();
+                           reread = vars[10]->Get (at);
+                           ForceConflict (*vars[11], 110);
+                        }
+                        for (auto i = 1; i < 40; i += 2)
+                        {
+                           keptOk = keptOk && vars[i]->Get (at) == (runs == 1 ? i : (i == 11 ? 110 : i));
+                        }
+                     });
+   BOOST_CHECK_EQUAL (2, runs);
+   BOOST_CHECK_EQUAL (100, reread);
+   BOOST_CHECK (keptOk);
+
+   //a child transaction only releases its own reads, not the ones that its parent made
+   runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        vars[0]->Get (at);
+                        WSTM::Atomically ([&](WSTM::WAtomic& at)
+                                          {
+                                             vars[0]->Get (at);
+                                             vars[1]->Get (at);
+                                             vars[0]->Release (at);
+                                             vars[1]->Release (at);
+                                          });
+                        if (runs == 1)
+                        {
+                           ForceConflict (*vars[1], 1);
+                           at.Validate ();
+                           ForceConflict (*vars[0], 1);
+                        }
+                     });
+   BOOST_CHECK_EQUAL (2, runs);
+
+   //an elastic transaction only validates its most recent reads
+   WSTM::WVar<int> a (0), b (0), c (0);
+   runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        a.Get (at);
+                        b.Get (at);
+                        c.Get (at);
+                        if (runs == 1)
+                        {
+                           ForceConflict (a, 1);
+                           at.Validate ();
+                           ForceConflict (c, 1);
+                        }
+                     },
+                     WSTM::WElastic (2));
+   BOOST_CHECK_EQUAL (2, runs);
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_compare_values)
+{
+   WSTM::WVar<int> flag (0, WSTM::WCompareValues ());
+   WSTM::WVar<std::string> str ("a", WSTM::WCompareValues ());
+
+   //setting the value that the variable already has doesn't cause a conflict
+   auto runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        flag.Get (at);
+                        str.Get (at);
+                        if (runs == 1)
+                        {
+                           ForceConflict (flag, 0);
+                           ForceConflict (str, std::string ("a"));
+                           at.Validate ();
+                        }
+                     });
+   BOOST_CHECK_EQUAL (1, runs);
+
+   //neither does changing the value and then changing it back
+   runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        flag.Get (at);
+                        str.Get (at);
+                        if (runs == 1)
+                        {
+                           ForceConflict (flag, 1);
+                           ForceConflict (flag, 0);
+                           ForceConflict (str, std::string ("b"));
+                           ForceConflict (str, std::string ("a"));
+                           at.Validate ();
+                        }
+                        flag.Set (0, at);
+                     });
+   BOOST_CHECK_EQUAL (1, runs);
+
+   //an actual change still conflicts
+   runs = 0;
+   WSTM::Atomically ([&](WSTM::WAtomic& at)
+                     {
+                        ++runs;
+                        flag.Get (at);
+                        str.Get (at);
+                        if (runs == 1)
+                        {
+                           ForceConflict (str, std::string ("c"));
+                        }
+                        flag.Set (1, at);
+                     });
+   BOOST_CHECK_EQUAL (2, runs);
+   BOOST_CHECK_EQUAL (1, flag.GetReadOnly ());
+   BOOST_CHECK_EQUAL ("c", str.GetReadOnly ());
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_batch)
+{
+   WSTM::WVar<int> x (0);
+   WSTM::WVar<int> y (0);
+   WSTM::WVar<bool> ready (false);
+
+   //Operations don't see each other's changes, the last one reads x after the first one set it so
+   //it is run again once the batch has committed. Ones that throw or retry don't stop the rest.
+   auto seen = std::vector<int>();
+   auto errors = WSTM::AtomicallyBatch ({
+         [&](WSTM::WAtomic& at){x.Set (1, at);},
+         [&](WSTM::WAtomic& at){x.Set (100, at); throw std::runtime_error ("failed");},
+         [&](WSTM::WAtomic& at)
+         {
+            if (!ready.Get (at))
+            {
+               WSTM::Retry (at, std::chrono::milliseconds (1));
+            }
+         },
+         [&](WSTM::WAtomic& at){seen.push_back (x.Get (at)); y.Set (2, at);}
+      });
+   BOOST_REQUIRE_EQUAL (4u, errors.size ());
+   BOOST_CHECK (!errors[0]);
+   BOOST_CHECK_THROW (std::rethrow_exception (errors[1]), std::runtime_error);
+   BOOST_CHECK_THROW (std::rethrow_exception (errors[2]), WSTM::WRetryTimeoutException);
+   BOOST_CHECK (!errors[3]);
+   BOOST_REQUIRE_EQUAL (2u, seen.size ());
+   BOOST_CHECK_EQUAL (0, seen[0]);
+   BOOST_CHECK_EQUAL (1, seen[1]);
+   BOOST_CHECK_EQUAL (1, x.GetReadOnly ());
+   BOOST_CHECK_EQUAL (2, y.GetReadOnly ());
+
+   //only the operations that have conflicts are run again
+   auto runs = 0;
+   auto yRuns = 0;
+   errors = WSTM::AtomicallyBatch ({
+         [&](WSTM::WAtomic& at)
+         {
+            ++runs;
+            const auto val = x.Get (at);
+            if (runs == 1)
+            {
+               ForceConflict (x, 10);
+            }
+            x.Set (val + 1, at);
+         },
+         [&](WSTM::WAtomic& at){++yRuns; y.Set (y.Get (at) + 1, at);}
+      });
+   BOOST_CHECK (!errors[0]);
+   BOOST_CHECK (!errors[1]);
+   BOOST_CHECK_EQUAL (2, runs);
+   BOOST_CHECK_EQUAL (1, yRuns);
+   BOOST_CHECK_EQUAL (11, x.GetReadOnly ());
+   BOOST_CHECK_EQUAL (3, y.GetReadOnly ());
+}
+
+BOOST_AUTO_TEST_CASE (StmVarTests_test_commit_combining)
+{
+   WSTM::SetCommitCombining (true);
+   struct WCombiningOff
+   {
+      ~WCombiningOff ()
+      {
+         WSTM::SetCommitCombining (false);
+      }
+   };
+   WCombiningOff combiningOff;
+   (void)combiningOff; //avoid a compiler warning
+
+   //Conflicting commits done by other threads still get noticed. Whether a commit gets left for
+   //another thread depends on the scheduling so the increments are repeated until one is.
+#ifndef WSTM_CLOCK_ENGINE
+   const auto maxRounds = 20;
+#else
+   //nothing gets combined
+   const auto maxRounds = 1;
+#endif
+   WSTM::WVar<int> shared (0);
+   const auto numThreads = 4;
+   const auto numIncrements = 1000;
+   std::vector<WSTM::WVar<int>> own (numThreads);
+   auto rounds = 0;
+   WSTM::StartProfiling ();
+   auto data = WSTM::Checkpoint ();
+   for (; rounds < maxRounds && data.m_numCombinedCommits == 0; ++rounds)
+   {
+      HammerIncrements (shared, numThreads, numIncrements,
+                        [&](const int i, WSTM::WAtomic& at){own[i].Set (own[i].Get (at) + 1, at);});
+      data = WSTM::Checkpoint ();
+   }
+   WSTM::StopProfiling ();
+
+#ifndef WSTM_CLOCK_ENGINE
+   BOOST_CHECK_GT (data.m_numCombinedCommits, 0);
+#else
+   BOOST_CHECK_EQUAL (data.m_numCombinedCommits, 0);
+#endif
+   BOOST_CHECK_EQUAL (rounds*numThreads*numIncrements, shared.GetReadOnly ());
+   for (const auto& v: own)
+   {
+      BOOST_CHECK_EQUAL (rounds*numIncrements, v.GetReadOnly ());
+   }
+
+   //transactions whose commits could throw commit themselves
+   WSTM::WVar<int> compared (0, WSTM::WCompareValues ());
+   WSTM::StartProfiling ();
+   HammerIncrements (compared, numThreads, numIncrements, {});
+   data = WSTM::Checkpoint ();
+   WSTM::StopProfiling ();
+   BOOST_CHECK_EQUAL (data.m_numCombinedCommits, 0);
+   BOOST_CHECK_EQUAL (numThreads*numIncrements, compared.GetReadOnly ());
+}
+
 BOOST_AUTO_TEST_CASE (StmVarTests_test_conflict)
 {
    WSTM::WVar<int> v1(1);
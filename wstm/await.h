@@ -0,0 +1,181 @@
+// Copyright (c) 2015, Wyatt Technology Corporation
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include "deferred_result.h"
+#include "channel.h"
+
+/**
+ * @file await.h
+ * Awaitables for using transactions that call Retry from C++20 coroutines. Nothing is defined
+ * unless the code including this header is compiled with coroutine support, the library itself
+ * doesn't need it.
+ */
+
+#if defined (__cpp_impl_coroutine) && defined (__has_include)
+#if __has_include (<coroutine>)
+#define WSTM_HAS_COROUTINES
+#endif
+#endif
+
+#ifdef WSTM_HAS_COROUTINES
+
+#include <coroutine>
+#include <type_traits>
+
+namespace WSTM
+{
+   /**
+    * @defgroup Await Coroutine Awaitables
+    *
+    * Awaitables that suspend the awaiting coroutine instead of blocking the thread while a
+    * transaction waits in Retry. Coroutines are resumed on the threads that AtomicallyAsync runs
+    * transactions on.
+    */
+   ///@{
+
+   /**
+    * Awaitable that waits for a WDeferredResult to be done. The result of co_await is the result
+    * of the WDeferredResult, if the WDeferredResult failed then its error is thrown instead.
+    */
+   template <typename Result_t>
+   class WResultAwaiter
+   {
+   public:
+      /**
+       * Creates an awaiter for the given result.
+       *
+       * @param result The result to wait for.
+       */
+      explicit WResultAwaiter (const WDeferredResult<Result_t>& result):
+         m_result (result)
+      {}
+
+      bool await_ready () const
+      {
+         return m_result.IsDone ();
+      }
+
+      void await_suspend (std::coroutine_handle<> handle)
+      {
+         //The callback is run as an after action of the transaction that finishes the result, the
+         //coroutine is resumed on a worker thread so that it doesn't hold up that thread.
+         m_result.OnDone ([handle](){Internal::PostAsync ([handle](){handle.resume ();});});
+      }
+
+      Result_t await_resume () const
+      {
+         if constexpr (std::is_void_v<Result_t>)
+         {
+            m_result.ThrowError ();
+         }
+         else
+         {
+            return m_result.GetResult ();
+         }
+      }
+      
+   private:
+      WDeferredResult<Result_t> m_result;
+   };
+
+   /**
+    * Awaitable version of WDeferredResult::GetResult.
+    *
+    * @param result The result to wait for.
+    *
+    * @return An awaitable that gives the result when it is done.
+    */
+   template <typename Result_t>
+   WResultAwaiter<Result_t> Await (const WDeferredResult<Result_t>& result)
+   {
+      return WResultAwaiter<Result_t> (result);
+   }
+
+   /**
+    * Awaitable version of Atomically. The given function is run by AtomicallyAsync so if it calls
+    * Retry neither the coroutine nor a thread is tied up waiting, the coroutine is resumed once the
+    * function has finished.
+    *
+    * @param op The function to run, it is copied.
+    *
+    * @param options Arguments that set various options, see \ref atomically_options "here" for
+    * options that are recognized.
+    *
+    * @return An awaitable that gives the result of op. If op throws then the exception is thrown
+    * by co_await.
+    */
+   template <typename Op_t, typename ... Options_t>
+   auto AtomicallyAwait (Op_t op, const Options_t& ... options)
+   {
+      return Await (AtomicallyAsync (std::move (op), options...));
+   }
+
+   /**
+    * Awaitable version of WChannelReader::Read. The reader must stay around until the read is
+    * done and mustn't be used by anything else in the meantime.
+    *
+    * @param reader The reader to read from.
+    *
+    * @param timeout How long to wait for a message (defaults to UNLIMITED).
+    *
+    * @return An awaitable that gives the first available message, or an uninitialized optional if
+    * no message became available within the timeout.
+    */
+   template <typename Data_t>
+   auto AwaitRead (WChannelReader<Data_t>& reader, const WTimeArg& timeout = WTimeArg::Unlimited ())
+   {
+      using DataOpt = typename WChannelReader<Data_t>::DataOpt;
+      struct WReadAwaiter : WResultAwaiter<DataOpt>
+      {
+         using WResultAwaiter<DataOpt>::WResultAwaiter;
+
+         DataOpt await_resume () const
+         {
+            try
+            {
+               return WResultAwaiter<DataOpt>::await_resume ();
+            }
+            catch (WRetryTimeoutException&)
+            {
+               return DataOpt ();
+            }
+         }
+      };
+      
+      return WReadAwaiter (AtomicallyAsync ([&reader, timeout](WAtomic& at){return reader.ReadRetry (at, timeout);}));
+   }
+
+   ///@}
+}
+
+#endif //WSTM_HAS_COROUTINES
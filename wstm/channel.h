@@ -32,6 +32,7 @@
 
 #include "exports.h"
 #include "stm.h"
+#include "probes.h"
 
 #include <boost/optional.hpp>
 #include <boost/signals2.hpp>
@@ -100,7 +101,8 @@ namespace WSTM
          std::shared_ptr<WWriteSignal> m_writeSignal_p;
          WVar<std::shared_ptr<WNode>> m_next_v;
          ReaderInitFunc m_readerInit;
-         WVar<int> m_numReaders_v;
+         //Readers are added without reading the count so that adding readers doesn't conflict
+         WCounter<int> m_numReaders_v;
          
          WChannelCore (ReaderInitFunc readerInit):
             m_writeSignal_p (std::make_shared<WWriteSignal>()),
@@ -126,7 +128,9 @@ namespace WSTM
 
          void Write (const Data_t& data, WAtomic& at)
          {
-            if (m_numReaders_v.Get (at) == 0)
+            const auto numReaders = m_numReaders_v.Get (at);
+            WSTM_PROBE1 (channel_write, numReaders);
+            if (numReaders == 0)
             {
                //This is not just a performance optimization, if we build up a list of new nodes
                //when there aren't any readers then we can get a stack overflow. When the
@@ -148,7 +152,7 @@ namespace WSTM
 
          std::shared_ptr<WNode> AddReader (WAtomic& at)
          {
-            m_numReaders_v.Set (m_numReaders_v.Get (at) + 1, at);
+            m_numReaders_v.Add (1, at);
             
             auto next_p = m_next_v.Get (at);
             if (m_readerInit)
@@ -988,7 +992,7 @@ namespace WSTM
             m_deadNodes.Set (deadNodes_p, at);
             //We need the following "After action" in order to force the dead nodes to stick around
             //long enough in the commit cycle to avoid the stack overflow
-            at.After ([deadNodes_p]() {});
+            at.AfterOutlivingValues ([deadNodes_p]() {});
          }
 
          deadNodes_p->Push (node_p);         
@@ -1098,6 +1102,7 @@ namespace WSTM
          
          if (cur_p->m_initial)
          {
+            WSTM_PROBE1 (channel_read, 1);
             m_data_p->m_cur_v.Set (cur_p->m_next_v.Get (at), at);
             return cur_p->m_data;
          }
@@ -1105,12 +1110,14 @@ namespace WSTM
          auto next_p = cur_p->m_next_v.Get (at);
          if (next_p)
          {
+            WSTM_PROBE1 (channel_read, 1);
             DataOpt data_o = DataOpt (next_p->m_data);
             m_data_p->m_cur_v.Set (next_p, at);
             return data_o;
          }
          else
          {
+            WSTM_PROBE1 (channel_read, 0);
             return DataOpt ();
          }         
       }
@@ -1130,17 +1137,31 @@ namespace WSTM
       {
          const unsigned int MAX_CHANNEL_READ_ALL_CONFLICTS = 5;
 
-         return Atomically ([&](WAtomic& at){return ReadAll (at);},
+         return Atomically ([&](WAtomic& at)
+                            {
+                               auto values = ReadAll (at);
+                               //Nothing else is done in this transaction so the end of the list
+                               //can be released too, a message written while we are reading will
+                               //be picked up by the next read instead of causing a conflict.
+                               m_data_p->m_cur_v.Get (at)->m_next_v.Release (at);
+                               return values;
+                            },
                             WMaxConflicts (MAX_CHANNEL_READ_ALL_CONFLICTS, WConflictResolution::RUN_LOCKED));
       }
    
       std::vector<Data> ReadAll (WAtomic& at)
       {
+         //Links that have been followed won't change again so they are released as we go to keep
+         //the transaction's reads small. The link at the end of the list is kept so that the
+         //transaction can still retry waiting for more messages.
          std::vector<Data> values;
+         auto cur_p = m_data_p->m_cur_v.Get (at);
          DataOpt val_o = ReadAtomic (at);
          while (val_o)
          {
             values.push_back (val_o.get ());
+            cur_p->m_next_v.Release (at);
+            cur_p = m_data_p->m_cur_v.Get (at);
             val_o = ReadAtomic (at);
          }
          return values;
@@ -1179,22 +1200,21 @@ namespace WSTM
             //to the channel since this reader was last read from then we can end up with a stack
             //overflow when the ndoes are walked and reclaimed. To avoid this we copy all the nodes
             //into another data structure so that they can't go to zero ref count during the
-            //transaction. After the transaction ends we go through the container of node pointers
-            //releasing each on its own in a loop so that the stack doesn't overflow.
+            //transaction. The after function holding that data structure is freed after the old
+            //value of m_cur_v, at which point the nodes are released one at a time in a loop so
+            //that the stack doesn't overflow.
             m_cur_v.Set (nullptr, at);
-            auto release_p = std::make_shared<std::deque<std::shared_ptr<Node>>>();
+            auto release_p = std::make_shared<WDeadNodeQueue>();
             while (cur_p)
             {
-               release_p->push_back (cur_p);
-               cur_p = cur_p->m_next_v.Get (at);
+               release_p->Push (cur_p);
+               //the links don't need to be validated, messages written after the last one are
+               //dropped along with the rest
+               auto next_p = cur_p->m_next_v.Get (at);
+               cur_p->m_next_v.Release (at);
+               cur_p = next_p;
             }
-            at.After ([release_p]()
-                      {
-                         for (auto& cur_p: *release_p)
-                         {
-                            cur_p = nullptr;
-                         }
-                      });
+            at.AfterOutlivingValues ([release_p]() {});
             m_core_v.Set (CorePtr (), at);
          }
 
@@ -787,6 +787,74 @@ namespace WSTM
       return value;      
    }
 
+   namespace Internal
+   {
+      template <typename Result_t>
+      struct WAsyncDone
+      {
+         template <typename Op_t>
+         static void Run (Op_t& op, WDeferredValue<Result_t>& value, WAtomic& at)
+         {
+            value.Done (op (at), at);
+         }
+      };
+
+      template <>
+      struct WAsyncDone<void>
+      {
+         template <typename Op_t>
+         static void Run (Op_t& op, WDeferredValue<void>& value, WAtomic& at)
+         {
+            op (at);
+            value.Done (at);
+         }
+      };
+   }
+
+   /**
+    * Runs the given function in a transaction on one of the library's worker threads instead of
+    * the calling thread. The result of the function (or the exception that it threw) is reported
+    * through the returned WDeferredResult, which is set in the same transaction that the function
+    * runs in. If the function calls Retry then the transaction doesn't hold on to a thread while it
+    * waits, it is run again on one of the worker threads once one of the variables that it read
+    * changes. This allows large numbers of waiting transactions to be run on a small number of
+    * threads. There is one worker thread per core so the function should not block other than by
+    * calling Retry.
+    *
+    * If the transaction times out in Retry then the result fails with WRetryTimeoutException.
+    *
+    * @param op The function to run, it is copied and must take a WAtomic& argument.
+    *
+    * @param options Arguments that set various options, see \ref atomically_options "here" for
+    * options that are recognized. WMaxRetries counts all of the retries that the transaction does.
+    *
+    * @return The result of the function.
+    */
+   template <typename Op_t, typename ... Options_t>
+   auto AtomicallyAsync (Op_t op, const Options_t& ... options)
+   {
+      using Result_t = std::decay_t<decltype (op (std::declval<WAtomic&>()))>;
+      WDeferredValue<Result_t> value;
+      WDeferredResult<Result_t> result (value);
+      Internal::RunAsync ([=]() mutable
+                          {
+                             try
+                             {
+                                Atomically ([&](WAtomic& at){Internal::WAsyncDone<Result_t>::Run (op, value, at);}, options...);
+                             }
+                             catch (Internal::WParkedException&)
+                             {
+                                throw;
+                             }
+                             catch (...)
+                             {
+                                value.Fail (std::current_exception ());
+                             }
+                          },
+                          [=]() mutable {value.Fail (WRetryTimeoutException ());});
+      return result;
+   }
+
    ///@}
 
 }
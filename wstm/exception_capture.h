@@ -116,6 +116,19 @@ namespace WSTM
       }
       //@}
 
+      //@{
+      /**
+       * Captures the exception held by the given exception pointer, ThrowCaptured will rethrow
+       * it. Used for capturing exceptions in catch (...) blocks.
+       *
+       * @param exc The exception to capture, must not be null.
+       *
+       * @param at The current transaction.
+       */
+      void Capture (const std::exception_ptr& exc);
+      void Capture (const std::exception_ptr& exc, WAtomic& at);
+      //@}
+
       //@{
       /**
        * Clears out any captured exceptions.
@@ -0,0 +1,78 @@
+// Copyright (c) 2015, Wyatt Technology Corporation
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+/**
+ * @file probes.h
+ * Statically defined tracepoints (USDT probes) that perf, bpftrace and SystemTap can attach to in
+ * a running process. The probes are only put in when the library is built with WSTM_USDT_PROBES
+ * defined (the CMake option of the same name does this when sys/sdt.h is available), otherwise
+ * they compile to nothing. A probe that nothing is attached to is a single nop instruction.
+ *
+ * The probes, all in the "wstm" provider, are:
+ *
+ * - commit (reads, writes): a top-level transaction committed, with the sizes of its read and
+ *   write sets.
+ * - conflict (conflicts, reads, writes): a run of a top-level transaction had a conflict, with the
+ *   number of conflicts it has had so far and the sizes of its read and write sets.
+ * - retry_wait (reads): a transaction that called Retry is about to wait for the variables that
+ *   it read to change, with the number of variables it read.
+ * - retry_wake (changed): a transaction has finished waiting in Retry, changed is 0 if the wait
+ *   timed out.
+ * - channel_write (readers): a message is being written to a channel with the given number of
+ *   readers.
+ * - channel_read (found): a channel reader is reading, found is 0 if there was no message.
+ *
+ * The channel probes are in channel.h so they fire in the code that uses channels, which needs to
+ * be built with WSTM_USDT_PROBES defined as well. The channel probes fire each time their
+ * transaction runs, including runs that end up not committing.
+ *
+ * For example, to count conflicts by their number of reads with bpftrace:
+ *
+ *    bpftrace -e 'usdt:/path/to/libwstm.so:wstm:conflict { @[arg1] = count(); }' -p PID
+ */
+
+#ifdef WSTM_USDT_PROBES
+
+#include <sys/sdt.h>
+
+#define WSTM_PROBE1(name, a) DTRACE_PROBE1 (wstm, name, a)
+#define WSTM_PROBE2(name, a, b) DTRACE_PROBE2 (wstm, name, a, b)
+#define WSTM_PROBE3(name, a, b, c) DTRACE_PROBE3 (wstm, name, a, b, c)
+
+#else
+
+#define WSTM_PROBE1(name, a) do {} while (false)
+#define WSTM_PROBE2(name, a, b) do {} while (false)
+#define WSTM_PROBE3(name, a, b, c) do {} while (false)
+
+#endif //WSTM_USDT_PROBES
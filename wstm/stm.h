@@ -30,6 +30,7 @@
 
 #pragma once
 
+#include "config.h"
 #include "exports.h"
 #include "find_arg.h"
 #include "exception.h"
@@ -47,6 +48,19 @@
 #include <boost/thread/shared_mutex.hpp>
 
 #include <chrono>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <string>
+#include <utility>
+#include <type_traits>
+#include <cstring>
+#include <cstddef>
+#include <new>
+#include <exception>
+#include <iosfwd>
 
 /**
  * @file stm.h
@@ -92,18 +106,24 @@ namespace WSTM
    /**
     * @defgroup profiling Profiling
     *
-    * Profiling use of the library. These functions allow you to track how many conflicts your
-    * getting in your transactions. In order to use any of them you must compile the library with
-    * STM_PROFILING defined. It is not suggested that you leave profiling on in general as it is a
-    * performance drag.
+    * Profiling use of the library. These functions allow you to track how many commits and
+    * conflicts your transactions are getting, how often they retry or have to escalate, and how
+    * long they spend waiting. Profiling is always compiled in and is turned on and off at
+    * runtime. Each thread counts into its own counters which are only added up when Checkpoint is
+    * called, so leaving profiling on costs very little.
     */
    ///@{
    /**
-    * Starts a profiling run. Note that STM_PROFILING must be defined
-    * in stm.cpp for this to do anything.
+    * Starts a profiling run, turning profiling on if it isn't already. Checkpoint reports on
+    * everything since the last call to this.
     */
    void WSTM_LIBAPI StartProfiling ();
 
+   /**
+    * Turns profiling off. Nothing is counted until StartProfiling is called again.
+    */
+   void WSTM_LIBAPI StopProfiling ();
+
    /**
     * Data from a STM profile run. Pass these objects to Checkpoint.
     *
@@ -122,19 +142,236 @@ namespace WSTM
       long m_numReadCommits;
       //!The number of commits with writes during the run.
       long m_numWriteCommits;
+      //!The number of nested transactions that were run again on their own after a conflict.
+      long m_numChildRestarts;
+      //!The number of reads done by the parents of those transactions (work that would have been
+      //!repeated if the whole transaction had been restarted).
+      long m_numSavedReads;
+      //!The number of times transactions called Retry and waited for changes.
+      long m_numRetries;
+      //!The number of transactions that hit their WMaxConflicts limit and ran with other commits
+      //!locked out (WConflictResolution::RUN_LOCKED).
+      long m_numRunLocked;
+      //!The number of transactions that hit their WMaxConflicts limit and ran inevitably
+      //!(WConflictResolution::RUN_INEVITABLE).
+      long m_numRunInevitable;
+      //!The number of commits that were done by another thread because of commit combining (see
+      //!SetCommitCombining).
+      long m_numCombinedCommits;
+      //!The number of times a transaction using WContentionManager::Serialize took the lane for a
+      //!hot variable.
+      long m_numSerialized;
+      //!The total size of the read sets of the transactions that committed.
+      long m_numReads;
+      //!The total size of the write sets of the transactions that committed.
+      long m_numWrites;
+      //!The time spent waiting in Retry for variables to change.
+      std::chrono::nanoseconds m_retryWaitTime;
+      //!The time spent waiting to commit, for the commit lock or for an inevitable transaction.
+      std::chrono::nanoseconds m_commitWaitTime;
+      //!The time spent waiting in contention policies after conflicts.
+      std::chrono::nanoseconds m_contentionWaitTime;
 
       //!Formats the data for output.
       std::string FormatData () const;
    };
    
    /**
-    * Ends a profiling run. Note that STM_PROFILING must be defined in stm.cpp for this to do
-    * anything. StartProfiling must have been called before this is called.
+    * Gets the profile data for the current run, the run carries on after this. StartProfiling
+    * must have been called before this is called.
     *  
     * @return The profile data for this run.
     */
    WProfileData WSTM_LIBAPI Checkpoint ();
+
+   /**
+    * Turns conflict attribution on or off, it is off by default. While it is on, each time a
+    * transaction is aborted by a conflict the first variable that it read that had changed is
+    * recorded along with the transaction's call site (see WCallSite). GetHotVariables reports what
+    * has been recorded. Recording takes a lock so this is meant for tracking down contention rather
+    * than for leaving on.
+    *
+    * @param on Whether to record conflicts.
+    */
+   void WSTM_LIBAPI SetConflictAttribution (const bool on);
+
+   /**
+    * A variable that has caused transactions to be aborted, see GetHotVariables.
+    */
+   struct WSTM_CLASSAPI WHotVariable
+   {
+      //!Identifies the variable. This is only good for telling variables apart, the variable might
+      //!have been destroyed since GetHotVariables was called. Null for conflicts that couldn't be put
+      //!down to a single variable and for variables that had already been destroyed.
+      const void* m_var;
+      //!The variable's name (see WVar::SetName), empty if it doesn't have one.
+      std::string m_name;
+      //!The number of aborts that the variable caused.
+      long m_aborts;
+      //!Whether the variable had been destroyed. The counts for destroyed variables are added up by
+      //!name, the ones without names all go in one entry.
+      bool m_destroyed;
+      //!The call sites of the transactions that were aborted along with the number of aborts for
+      //!each, most aborts first. Transactions that weren't given a WCallSite are listed as
+      //!"unknown".
+      std::vector<std::pair<std::string, long>> m_callSites;
+   };
+
+   /**
+    * Gets the variables that have caused aborts since conflict attribution was turned on (or since
+    * the last ResetHotVariables). Short-lived variables (such as the ones a WChannel makes for
+    * each message) can still be hot spots so the counts for destroyed variables are kept, see
+    * WHotVariable::m_destroyed.
+    *
+    * @return The variables, most aborts first.
+    */
+   std::vector<WHotVariable> WSTM_LIBAPI GetHotVariables ();
+
+   /**
+    * Formats the given hot variables for output.
+    */
+   std::string WSTM_LIBAPI FormatHotVariables (const std::vector<WHotVariable>& vars);
+
+   /**
+    * Forgets the conflicts recorded so far.
+    */
+   void WSTM_LIBAPI ResetHotVariables ();
+
+   /**
+    * A histogram of how long something took. Times below 16ns get a bucket each, above that each
+    * power of two is split into 16 buckets so times are reported to within about 6%. Times over
+    * about 36 minutes all go in the last bucket.
+    */
+   struct WSTM_CLASSAPI WLatencyHistogram
+   {
+      //!The number of buckets.
+      static const size_t NUM_BUCKETS = 608;
+
+      //!Creates an empty histogram.
+      WLatencyHistogram ();
+
+      //!The number of times that fell in each bucket.
+      std::vector<uint64_t> m_counts;
+      //!The sum of all the times.
+      std::chrono::nanoseconds m_total;
+
+      //!The number of times in the histogram.
+      uint64_t GetCount () const;
+      //!The mean time, 0 if the histogram is empty.
+      std::chrono::nanoseconds GetMean () const;
+      /**
+       * Gets a percentile.
+       *
+       * @param percentile The percentile wanted (99 for the 99th percentile).
+       *
+       * @return The largest time in the bucket that the percentile falls in, 0 if the histogram is
+       * empty.
+       */
+      std::chrono::nanoseconds GetPercentile (const double percentile) const;
+
+      //!Gets the bucket that the given time belongs in.
+      static size_t GetBucket (const std::chrono::nanoseconds time);
+      //!Gets the largest time that belongs in the given bucket.
+      static std::chrono::nanoseconds GetBucketMax (const size_t bucket);
+   };
+
+   /**
+    * How long the top-level transactions started from a call site (see WCallSite) took, see
+    * GetLatencies. Each run of a transaction adds to the phase histograms, so a transaction that
+    * conflicted adds more than one time to m_run.
+    */
+   struct WSTM_CLASSAPI WCallSiteLatencies
+   {
+      //!The name of the call site, "unknown" for transactions that weren't given a WCallSite.
+      std::string m_callSite;
+      //!The whole call to Atomically.
+      WLatencyHistogram m_total;
+      //!Running the operation.
+      WLatencyHistogram m_run;
+      //!Checking that what was read hasn't changed, when committing or when asked to (see
+      //!WAtomic::Validate).
+      WLatencyHistogram m_validation;
+      //!Waiting to commit, for the commit lock or for the variables being written.
+      WLatencyHistogram m_lock;
+      //!Committing, this includes validation and waiting for locks but not after actions.
+      WLatencyHistogram m_commit;
+      //!Running after actions.
+      WLatencyHistogram m_afters;
+      //!Waiting in Retry for variables to change.
+      WLatencyHistogram m_retryWait;
+   };
+
+   /**
+    * Turns latency tracking on or off, it is off by default. While it is on the time that top-level
+    * transactions spend in each phase is recorded in histograms kept for each call site (see
+    * WCallSite). Each thread records into its own histograms so tracking doesn't add contention,
+    * but it does read the clock a few times for every transaction.
+    *
+    * @param on Whether to track latencies.
+    */
+   void WSTM_LIBAPI SetLatencyTracking (const bool on);
+
+   /**
+    * Gets the latencies recorded since tracking was turned on (or since the last ResetLatencies).
+    *
+    * @return The latencies of each call site that has run a transaction.
+    */
+   std::vector<WCallSiteLatencies> WSTM_LIBAPI GetLatencies ();
+
+   /**
+    * Formats the given latencies for output.
+    */
+   std::string WSTM_LIBAPI FormatLatencies (const std::vector<WCallSiteLatencies>& latencies);
+
+   /**
+    * Forgets the latencies recorded so far.
+    */
+   void WSTM_LIBAPI ResetLatencies ();
+
+   /**
+    * Turns tracing on or off, it is off by default. While it is on each thread records what its
+    * top-level transactions do (each run and how it ended, validations and waits in Retry) along
+    * with when they did it and how many variables they read and wrote. Each thread records into
+    * its own ring buffer which holds its last 4096 events, so tracing doesn't add contention or
+    * use more memory the longer it runs. Use WriteTrace to get the events.
+    *
+    * @param on Whether to record events.
+    */
+   void WSTM_LIBAPI SetTracing (const bool on);
+
+   /**
+    * Writes the events in the trace buffers in the Chrome trace event format (JSON), which can be
+    * loaded into chrome://tracing or Perfetto to see what each thread was doing over time. Threads
+    * can carry on recording events while this runs, events that get overwritten while they are
+    * being written are left out.
+    *
+    * @param out The stream to write to.
+    */
+   void WSTM_LIBAPI WriteTrace (std::ostream& out);
+
+   /**
+    * Writes the events in the trace buffers to the given file, see WriteTrace (std::ostream&).
+    *
+    * @param fileName The file to write.
+    *
+    * @return true if the file was written, false if it couldn't be.
+    */
+   bool WSTM_LIBAPI WriteTrace (const std::string& fileName);
    ///@}
+
+   /**
+    * Turns commit combining on or off, it is off by default. Normally each transaction that sets
+    * something takes the commit lock in turn. With combining on, a transaction that finds the lock
+    * taken leaves its changes for the thread holding the lock, which commits them along with any
+    * others that are waiting in one pass before releasing the lock. This helps when lots of threads
+    * commit small transactions at the same time. Transactions that read or set variables that
+    * compare values (see WCompareValues) or keep history (see WVarHistory), or that add to a
+    * WCounter without reading it, always commit themselves. Only the lock commit engine combines
+    * commits, with the other engines this does nothing.
+    *
+    * @param combine Whether to combine commits.
+    */
+   void WSTM_LIBAPI SetCommitCombining (const bool combine);
    
    /**
     * Constant that denotes an unlimited number of tries.
@@ -173,7 +410,15 @@ namespace WSTM
        * The operation will be run with all other writes locked out thus guaranteeing that the
        * operation can complete successfully
        */
-      RUN_LOCKED	
+      RUN_LOCKED,
+      /**
+       * The operation will be run as the *inevitable* transaction, which is guaranteed to
+       * complete successfully. Only one transaction can be inevitable at a time. Other
+       * transactions keep running and committing as long as they don't change anything that the
+       * inevitable transaction has read, those that would have to wait for it to finish. Calling
+       * Retry in the inevitable transaction gives up being inevitable.
+       */
+      RUN_INEVITABLE
    };
 
    /**
@@ -245,6 +490,9 @@ namespace WSTM
 #endif //_DEBUG
 
       struct WTransactionData;
+      struct WCommitWaiter;
+      struct WHistory;
+      struct WVarCoreBase;
 
       //Thrown by WVarCoreBase::Validate when validation fails
       struct WSTM_CLASSAPI WFailedValidationException
@@ -255,7 +503,13 @@ namespace WSTM
          size_t m_version;
 
          WValueBase (const size_t version);
-         ~WValueBase ();
+         virtual ~WValueBase ();
+
+         //Values that hold a change to make to the variable instead of a new value (see WCounter)
+         //turn themselves into the new value here, given the variable that they are being
+         //committed to. This is only called for transactions that have such values, the caller
+         //must be holding whatever lock the commit engine needs for writing the variable.
+         virtual void ApplyDelta (const WVarCoreBase& core);
       };
 
       template <typename Type_t>
@@ -272,43 +526,296 @@ namespace WSTM
          m_value (value)
       {}
 
-      struct WSTM_CLASSAPI WVarCoreBase
+      //Trivially copyable types that are no bigger than this are stored inline in their core
+      //instead of in a separately allocated WValue (see WVarCore).
+      const size_t INLINE_VALUE_MAX_SIZE = 16;
+      //The size of the memory slots that transactions keep their copies of inline values in.
+      const size_t INLINE_VALUE_SLOT_SIZE = 32;
+
+      template <typename Type_t>
+      struct WIsInlineValue :
+         public std::integral_constant<bool,
+                                       std::is_trivially_copyable<Type_t>::value &&
+                                       std::is_default_constructible<Type_t>::value &&
+                                       sizeof (Type_t) <= INLINE_VALUE_MAX_SIZE>
+      {};
+
+      //A transaction's copy of an inline value, either one that it read or one that it set. These
+      //are constructed in memory owned by the root transaction (see
+      //WAtomic::AllocateInlineValue) so deleting them doesn't free anything.
+      template <typename Type_t>
+      struct WInlineValue : public WValue<Type_t>
+      {
+         WInlineValue (const size_t version, const Type_t& value):
+            WValue<Type_t> (version, value)
+         {}
+
+         void operator delete (void*) {}
+      };
+
+      //Transactions only keep raw pointers to the cores that they have read, a core that is no
+      //longer used by its WVar is handed to RetireCore so that it isn't freed until no transaction
+      //could still be reading it.
+      struct WSTM_CLASSAPI WVarCoreBase : public std::enable_shared_from_this<WVarCoreBase>
       {
-         virtual bool Validate (const WValueBase& val) const = 0;
-         virtual std::shared_ptr<WValueBase> Commit (const std::shared_ptr<WValueBase>& val_p) = 0;
+         explicit WVarCoreBase (std::unique_ptr<WValueBase>&& val_p);
          virtual ~WVarCoreBase ();
+
+         WVarCoreBase (const WVarCoreBase&) = delete;
+         WVarCoreBase& operator=(const WVarCoreBase&) = delete;
+
+#ifndef WSTM_CLOCK_ENGINE
+         //Checks that the value with the given version is still the current value of the
+         //variable. The caller must be pinned in the reclamation epoch.
+         bool Validate (const size_t version) const;
+         //Same as above but also checks the value itself if the versions differ and the variable
+         //compares values (see m_isCurrentValue_p).
+         bool Validate (const WValueBase& val) const;
+         //Gets the version of the current value. The caller must be pinned in the reclamation
+         //epoch.
+         size_t GetVersion () const;
+#endif //!WSTM_CLOCK_ENGINE
+         //Installs a new value and returns the old one. The caller must be holding whatever lock
+         //the commit engine requires for writing this variable. The old value can't be freed until
+         //the reclamation epoch says that no transaction can still be reading it. Not used for
+         //inline cores, see CommitInline.
+         std::unique_ptr<WValueBase> Commit (std::unique_ptr<WValueBase>&& val_p);
+
+         //These are only used for inline cores. ReadInline constructs a copy of the current value
+         //(with its version) in the given INLINE_VALUE_SLOT_SIZE bytes of memory and CommitInline
+         //copies the given value (and version) into the core, it has the same locking
+         //requirements as Commit.
+         virtual const WValueBase* ReadInline (void* slot_p) const;
+         virtual size_t GetInlineVersion () const;
+         virtual void CommitInline (const WValueBase& val);
+         //Gets a heap allocated copy of the current inline value, used for keeping history.
+         virtual std::unique_ptr<WValueBase> CopyInline () const;
+
+         //Makes the core keep up to the given number of old values around for read-only
+         //transactions (see WVarHistory). Must be called before the core is shared.
+         void EnableHistory (const size_t maxVersions);
+         //The number of old values currently being kept.
+         size_t GetHistoryLength () const;
+         //The approximate number of bytes used for keeping history given the size of the values.
+         size_t GetHistoryMemory (const size_t valueSize) const;
+
+         //The current value, owned by the core. Readers load this without taking any locks, only
+         //the commit engine in stm.cpp should touch it directly. This is null for inline cores.
+         std::atomic<WValueBase*> m_value_p;
+
+#if defined (WSTM_CLOCK_ENGINE) && !defined (WSTM_STRIPED_LOCKS)
+         //Versioned write lock used by the version clock engine. The low bit is the lock bit, the
+         //rest is the global clock value at which the current value was committed. With striped
+         //locks this lives in a shared table in stm.cpp instead.
+         mutable std::atomic<uint64_t> m_versionLock;
+#endif //WSTM_CLOCK_ENGINE && !WSTM_STRIPED_LOCKS
+
+         //The old values, null unless EnableHistory has been called. Only stm.cpp should touch
+         //this.
+         WHistory* m_history_p;
+         //Checks if the current value is equal to the given value, null unless the variable was
+         //created with WCompareValues. Must be set before the core is shared. The caller must be
+         //pinned in the reclamation epoch.
+         bool (*m_isCurrentValue_p)(const WVarCoreBase& core, const WValueBase& val);
+
+         //The number of threads that are blocked in Retry until this variable changes. The waiters
+         //themselves are kept in a table in stm.cpp so that variables that nobody waits on don't
+         //pay for a list, commits that write the variable only look in the table when this is
+         //non-zero. Only stm.cpp should touch this.
+         std::atomic<unsigned int> m_numWaiters;
+         //Whether the value is stored in the core itself.
+         const bool m_inline;
+         //Whether the variable has been given a name (see WVar::SetName). The names are kept in a
+         //table in stm.cpp so that variables without names don't pay for them. Only stm.cpp should
+         //touch this.
+         bool m_named;
+         //Whether conflict attribution has recorded an abort caused by the variable (see
+         //SetConflictAttribution), its counts are kept in a table in stm.cpp. Set while that table
+         //is locked. Only stm.cpp should touch this.
+         mutable bool m_attributed;
+
+      protected:
+         //Used by inline cores
+         WVarCoreBase ();
       };
 
-      template <typename Type_t>
+      //Releases a WVar's reference to its core, the core is freed once no transaction that might
+      //have read it is still running.
+      void WSTM_LIBAPI RetireCore (std::shared_ptr<WVarCoreBase>&& core_p);
+
+      //Names used in conflict attribution reports, see WVar::SetName.
+      void WSTM_LIBAPI SetVarName (WVarCoreBase& core, const std::string& name);
+      std::string WSTM_LIBAPI GetVarName (const WVarCoreBase& core);
+
+      template <typename Type_t, bool Inline_v = WIsInlineValue<Type_t>::value>
       struct WVarCore : public WVarCoreBase
       {
-         virtual bool Validate (const WValueBase& val) const override
+         explicit WVarCore(const Type_t& value);
+      };
+         
+      template<typename Type_t, bool Inline_v>
+      WVarCore<Type_t, Inline_v>::WVarCore(const Type_t& value):
+         WVarCoreBase (std::make_unique<WValue<Type_t>>(0, value))
+      {}
+
+      //Core for small trivially copyable types (counters, flags and the like). The value and its
+      //version are kept in the core and protected by a sequence lock: commits make the sequence
+      //number odd while they write and readers copy the value out and then check that the sequence
+      //number didn't change. This means that commits don't need to allocate a new value and
+      //readers don't need to worry about the value being freed.
+      template <typename Type_t>
+      struct WVarCore<Type_t, true> : public WVarCoreBase
+      {
+         static_assert (sizeof (WInlineValue<Type_t>) <= INLINE_VALUE_SLOT_SIZE &&
+                        alignof (WInlineValue<Type_t>) <= alignof (std::max_align_t),
+                        "inline value doesn't fit in a slot");
+         
+         explicit WVarCore(const Type_t& value);
+
+         virtual const WValueBase* ReadInline (void* slot_p) const override;
+         virtual size_t GetInlineVersion () const override;
+         virtual void CommitInline (const WValueBase& val) override;
+         virtual std::unique_ptr<WValueBase> CopyInline () const override;
+
+         //Gets a consistent copy of the value, returns its version.
+         size_t Load (Type_t& value) const;
+         
+      private:
+         void Store (const Type_t& value, const size_t version);
+
+         static const size_t NUM_WORDS = (sizeof (Type_t) + sizeof (uint64_t) - 1)/sizeof (uint64_t);
+         
+         std::atomic<uint64_t> m_sequence;
+         std::atomic<size_t> m_version;
+         std::atomic<uint64_t> m_words[NUM_WORDS];
+      };
+
+      template<typename Type_t>
+      WVarCore<Type_t, true>::WVarCore(const Type_t& value):
+         m_sequence (0),
+         m_version (0)
+      {
+         Store (value, 0);
+      }
+
+      template<typename Type_t>
+      const WValueBase* WVarCore<Type_t, true>::ReadInline (void* slot_p) const
+      {
+         Type_t value;
+         const auto version = Load (value);
+         return new (slot_p) WInlineValue<Type_t>(version, value);
+      }
+      
+      template<typename Type_t>
+      size_t WVarCore<Type_t, true>::GetInlineVersion () const
+      {
+         Type_t value;
+         return Load (value);
+      }
+      
+      template<typename Type_t>
+      void WVarCore<Type_t, true>::CommitInline (const WValueBase& val)
+      {
+         Store (static_cast<const WValue<Type_t>&>(val).m_value, val.m_version);
+      }
+      
+      template<typename Type_t>
+      std::unique_ptr<WValueBase> WVarCore<Type_t, true>::CopyInline () const
+      {
+         Type_t value;
+         const auto version = Load (value);
+         return std::make_unique<WValue<Type_t>>(version, value);
+      }
+      
+      template<typename Type_t>
+      size_t WVarCore<Type_t, true>::Load (Type_t& value) const
+      {
+         uint64_t words[NUM_WORDS];
+         for (;;)
          {
-            //have to define here, else we get C4505 from VC++
-            return (val.m_version == m_value_p->m_version);
+            const auto pre = m_sequence.load (std::memory_order_acquire);
+            if (pre & 1)
+            {
+               //a commit is writing the value, it only takes a moment
+               continue;
+            }
+            for (size_t i = 0; i < NUM_WORDS; ++i)
+            {
+               words[i] = m_words[i].load (std::memory_order_relaxed);
+            }
+            const auto version = m_version.load (std::memory_order_relaxed);
+            std::atomic_thread_fence (std::memory_order_acquire);
+            if (m_sequence.load (std::memory_order_relaxed) == pre)
+            {
+               std::memcpy (&value, words, sizeof (Type_t));
+               return version;
+            }
          }
-         
-         virtual std::shared_ptr<WValueBase> Commit (const std::shared_ptr<WValueBase>& val_p) override
+      }
+      
+      template<typename Type_t>
+      void WVarCore<Type_t, true>::Store (const Type_t& value, const size_t version)
+      {
+         uint64_t words[NUM_WORDS] = {};
+         std::memcpy (words, &value, sizeof (Type_t));
+         //There is only ever one writer at a time so the sequence number doesn't need a
+         //read-modify-write.
+         const auto sequence = m_sequence.load (std::memory_order_relaxed);
+         m_sequence.store (sequence + 1, std::memory_order_relaxed);
+         std::atomic_thread_fence (std::memory_order_release);
+         for (size_t i = 0; i < NUM_WORDS; ++i)
          {
-            //have to define here, else we get C4505 from VC++
-            std::shared_ptr<WValueBase> old_p = m_value_p;
-#ifdef _DEBUG
-            const auto oldPtr_p = static_cast<const WValue<Type_t>*>(old_p.get ());
-            (void) oldPtr_p;
-#endif
-            m_value_p = std::static_pointer_cast<WValue<Type_t> >(val_p);
-            return old_p;
+            m_words[i].store (words[i], std::memory_order_relaxed);
          }
-         
-         explicit WVarCore(std::shared_ptr<WValue<Type_t>>&& val_p);
+         m_version.store (version, std::memory_order_relaxed);
+         m_sequence.store (sequence + 2, std::memory_order_release);
+      }
+      
+      //Used for WVarCoreBase::m_isCurrentValue_p.
+      template <typename Type_t>
+      bool CurrentValueEquals (const WVarCore<Type_t, false>& core, const Type_t& value)
+      {
+         return static_cast<const WValue<Type_t>*>(core.m_value_p.load (std::memory_order_acquire))->m_value == value;
+      }
+
+      template <typename Type_t>
+      bool CurrentValueEquals (const WVarCore<Type_t, true>& core, const Type_t& value)
+      {
+         Type_t current;
+         core.Load (current);
+         return current == value;
+      }
 
-         typename std::shared_ptr<WValue<Type_t>> m_value_p;
+      template <typename Type_t>
+      bool IsCurrentValue (const WVarCoreBase& core, const WValueBase& val)
+      {
+         return CurrentValueEquals (static_cast<const WVarCore<Type_t>&>(core), static_cast<const WValue<Type_t>&>(val).m_value);
+      }
+      
+      //A WCounter's value in a transaction's write set. Unless the transaction has read the
+      //counter this holds the amount to add to the counter, which is applied when the transaction
+      //commits. These live in inline value slots like WInlineValue.
+      template <typename Type_t>
+      struct WCounterValue : public WInlineValue<Type_t>
+      {
+         bool m_delta;
+
+         WCounterValue (const Type_t& value, const bool delta):
+            WInlineValue<Type_t> (0, value),
+            m_delta (delta)
+         {}
+
+         virtual void ApplyDelta (const WVarCoreBase& core) override
+         {
+            if (m_delta)
+            {
+               Type_t current;
+               static_cast<const WVarCore<Type_t>&>(core).Load (current);
+               this->m_value += current;
+               m_delta = false;
+            }
+         }
       };
-         
-      template<typename Type_t>
-      WVarCore<Type_t>::WVarCore(std::shared_ptr<WValue<Type_t>>&& val_p):
-         m_value_p (std::move (val_p))
-      {}
       
       struct WSTM_CLASSAPI WLocalValueBase
       {
@@ -317,6 +824,47 @@ namespace WSTM
       };
 
       uint64_t WSTM_LIBAPI GetTransactionLocalKey ();
+
+#ifdef WSTM_CLOCK_ENGINE
+      //With the version clock engine reads don't take a lock, instead this "gate" is used to keep
+      //commits out when a transaction explicitly asks for a read lock or is running with commits
+      //locked out (WConflictResolution::RUN_LOCKED). It models the parts of boost::upgrade_mutex
+      //that the lock guards use.
+      class WSTM_CLASSAPI WCommitGate
+      {
+      public:
+         WCommitGate ();
+
+         WCommitGate (const WCommitGate&) = delete;
+         WCommitGate& operator=(const WCommitGate&) = delete;
+
+         void lock_shared ();
+         bool try_lock_shared ();
+         void unlock_shared ();
+
+         void lock_upgrade ();
+         bool try_lock_upgrade ();
+         void unlock_upgrade ();
+
+         //Checks whether commits are currently allowed. ownHolds is the number of holds that the
+         //calling thread has on the gate (a RUN_LOCKED transaction can still commit).
+         bool IsOpen (const int ownHolds) const;
+         //Waits until the gate opens.
+         void WaitOpen (const int ownHolds);
+
+      private:
+         void Release ();
+
+         std::atomic<int> m_holds;
+         std::mutex m_upgradeMutex;
+         std::mutex m_waitMutex;
+         std::condition_variable m_opened;
+      };
+
+      using WReadMutex = WCommitGate;
+#else
+      using WReadMutex = boost::upgrade_mutex;
+#endif //WSTM_CLOCK_ENGINE
    }
 
    /**
@@ -467,6 +1015,207 @@ namespace WSTM
       //! The retry time limit.
       WTimeArg m_value;
    };
+
+   /**
+    * Marks a transaction as read-only (pass WReadOnly (true) to Atomically). Read-only transactions
+    * can't call WVar::Set (doing so throws WReadOnlyException). In exchange the values that they
+    * read are checked to be a consistent snapshot as they are read so the transaction commits
+    * without any validation or locking. Child transactions of a read-only transaction are
+    * read-only as well.
+    *
+    * @see Atomically, WReadOnlyException
+    */
+   struct WSTM_CLASSAPI WReadOnly
+   {
+      /**
+       * Creates an object that leaves the transaction read-write.
+       */
+      WReadOnly ();
+      
+      /**
+       * Creates an object that makes the transaction read-only or not.
+       *
+       * @param readOnly Whether the transaction should be read-only.
+       */
+      WReadOnly (const bool readOnly);
+      
+      //! Whether the transaction is read-only.
+      bool m_value;
+   };
+
+   /**
+    * Makes a transaction elastic (pass WElastic (window) to Atomically). An elastic transaction
+    * only keeps the last window variables that it read in its read set, older reads are released
+    * as if WVar::Release had been called on them. Long walks over linked structures can then run
+    * alongside transactions that change the parts of the structure that have already been passed.
+    * Only the most recent reads are consistent with each other so this should only be used when
+    * that is all the transaction depends on. Only has an effect on top-level transactions, reads
+    * done by child transactions count towards the top-level transaction's window.
+    *
+    * @see Atomically, WVar::Release
+    */
+   struct WSTM_CLASSAPI WElastic
+   {
+      /**
+       * Creates an object that leaves the transaction's reads alone.
+       */
+      WElastic ();
+      
+      /**
+       * Creates an object that makes the transaction elastic.
+       *
+       * @param window The number of most recent reads to keep, 0 means keep them all.
+       */
+      WElastic (const unsigned int window);
+      
+      //! The number of reads to keep, 0 if the transaction isn't elastic.
+      unsigned int m_value;
+   };
+
+   /**
+    * Names the place that a transaction is started from (pass WCallSite ("name") to
+    * Atomically). Conflict attribution uses this to report which transactions were aborted, see
+    * GetHotVariables. WSTM_CALL_SITE makes one from the current file and line.
+    *
+    * @see Atomically, SetConflictAttribution
+    */
+   struct WSTM_CLASSAPI WCallSite
+   {
+      /**
+       * Creates an object that doesn't name a call site.
+       */
+      WCallSite ();
+      
+      /**
+       * Creates an object with the given name.
+       *
+       * @param name The name of the call site. Only the pointer is kept so this must last as long
+       * as the program does, a string literal is best.
+       */
+      WCallSite (const char* name);
+      
+      //! The name of the call site, null if there isn't one.
+      const char* m_value;
+   };
+
+#define WSTM_CALL_SITE_STRING2(x) #x
+#define WSTM_CALL_SITE_STRING(x) WSTM_CALL_SITE_STRING2 (x)
+   /**
+    * Makes a WCallSite named after the file and line that it is used on.
+    */
+#define WSTM_CALL_SITE WSTM::WCallSite (__FILE__ ":" WSTM_CALL_SITE_STRING (__LINE__))
+
+   /**
+    * What a contention policy knows about a transaction that has had a conflict.
+    *
+    * @see WContentionPolicy
+    */
+   struct WSTM_CLASSAPI WContentionInfo
+   {
+      //! The number of conflicts that the transaction has had so far.
+      unsigned int m_conflicts;
+      //! The number of variables that were read or set in all the runs of the transaction so far.
+      size_t m_karma;
+      //! Orders transactions by when they were started, lower values were started earlier.
+      uint64_t m_timestamp;
+      //! Policies can keep what they like in here for the life of the transaction, it starts as 0.
+      uint64_t m_policyData;
+      /**
+       * Identifies the variable that the most recent conflict was over (the first one found to have
+       * changed), null if that isn't known. This is only good for telling variables apart, the
+       * variable might not exist anymore.
+       */
+      const void* m_conflict;
+   };
+
+   /**
+    * Interface for deciding what a transaction does after it has a conflict, before it is run
+    * again. The transaction doesn't hold on to any values or locks while the policy runs. The same
+    * policy object is used by every thread that passes it to Atomically so implementations must be
+    * thread safe.
+    *
+    * @see WContentionManager
+    */
+   class WSTM_CLASSAPI WContentionPolicy
+   {
+   public:
+      virtual ~WContentionPolicy ();
+
+      /**
+       * Called each time the transaction has a conflict. Any waiting that the policy wants done
+       * before the transaction is run again should be done here.
+       *
+       * @param info Information about the transaction.
+       */
+      virtual void OnConflict (WContentionInfo& info) = 0;
+
+      /**
+       * Called when a transaction that has had at least one conflict finishes, whether it
+       * committed or not. The default does nothing.
+       *
+       * @param info Information about the transaction.
+       */
+      virtual void OnFinish (WContentionInfo& info);
+   };
+   
+   /**
+    * Sets the contention policy used by a transaction. By default a transaction that has a
+    * conflict is run again straight away, under heavy contention this can lead to transactions
+    * repeatedly causing each other to conflict until WMaxConflicts kicks in.
+    *
+    * @see Atomically, WContentionPolicy, WMaxConflicts
+    */
+   struct WSTM_CLASSAPI WContentionManager
+   {
+      /**
+       * Creates an object that has transactions run again as soon as they have a conflict.
+       */
+      WContentionManager ();
+
+      /**
+       * Creates an object that uses the given policy.
+       *
+       * @param policy_p The policy to use, null means run again straight away.
+       */
+      WContentionManager (std::shared_ptr<WContentionPolicy> policy_p);
+
+      /**
+       * Waits a random amount of time before running the transaction again. The upper limit on the
+       * wait doubles with each conflict (starting at minDelay) until it reaches maxDelay.
+       *
+       * @param minDelay The upper limit on the wait after the first conflict.
+       * @param maxDelay The largest upper limit on the wait.
+       */
+      static WContentionManager Backoff (const std::chrono::microseconds minDelay = std::chrono::microseconds (1),
+                                         const std::chrono::microseconds maxDelay = std::chrono::microseconds (1000));
+
+      /**
+       * Favors the transactions that have done the most work (read or set the most variables over
+       * all their runs). Transactions that conflict while one with more work done is also having
+       * conflicts wait a bit for it to finish before running again.
+       */
+      static WContentionManager Karma ();
+
+      /**
+       * Favors the transactions that were started first. Transactions that conflict while an
+       * older transaction is also having conflicts wait a bit for it to finish before running
+       * again.
+       */
+      static WContentionManager Timestamp ();
+
+      /**
+       * Runs transactions that keep conflicting over the same variables one after another instead
+       * of letting them abort each other. The policy learns which variables conflicts are
+       * happening over. Once a variable has had several conflicts in quick succession, a
+       * transaction that conflicts over it waits for the others that are being run again after
+       * conflicting over it (or for a while, in case one of them is blocked). Transactions that
+       * conflict over other variables aren't held up.
+       */
+      static WContentionManager Serialize ();
+      
+      //! The policy to use.
+      std::shared_ptr<WContentionPolicy> m_policy_p;
+   };
    ///@}
 
    /**
@@ -477,6 +1226,7 @@ namespace WSTM
    class WSTM_CLASSAPI WAtomic
    {
       template <typename> friend class WVar;
+      template <typename> friend class WCounter;
       template <typename> friend class WTransactionLocalValue;
 
      public:
@@ -492,10 +1242,10 @@ namespace WSTM
       void Validate() const;
 				
       /**
-       * Causes the transaction to acquire a read lock. Normally during the course of reading a WVar
-       * a read lock is acquired and released. This can be a performance problem when a lot of WVars
-       * need to be read. In those cases this method should be called so that one read lock will be
-       * held while doing the reads. The lock will be held until either readUnlock has been called
+       * Causes the transaction to acquire a read lock. Reading a WVar doesn't take any locks so
+       * other transactions can commit in between reads. If that is a problem (e.g. a lot of WVars
+       * need to be read and conflicts are likely) then this method can be called so that commits
+       * are held off while doing the reads. The lock will be held until either readUnlock has been called
        * an equal number of times as readLock or the transaction ends. Normally WReadLockGuard
        * should be used instead of calling this directly.
        */
@@ -546,9 +1296,26 @@ namespace WSTM
        * commits.  This may be much later than you expect.  Take steps to make sure that the data
        * you think will be around when the function runs will still be around by using shared_ptr or
        * something similar.
+       *
+       * The function (along with anything that it captures) is freed once it and the transaction's
+       * other after functions have run. The values that the transaction replaced are not
+       * necessarily freed by then, if other threads could still be reading them they are freed when
+       * the last transaction that could be reading them finishes (on whatever thread that
+       * transaction runs on).
        */
       void After(WAfterFunc func);
 
+      /**
+       * Like After except that the function (along with anything that it captures) is kept until
+       * the values that the transaction replaced have been freed instead of being freed as soon as
+       * it has run. Use this when what the function captures must not be freed before those values
+       * are, e.g. WChannelReader uses it to make sure that long chains of channel nodes are freed
+       * one at a time instead of recursively.
+       *
+       * @param func The function to call after the top-level transaction commits.
+       */
+      void AfterOutlivingValues (WAfterFunc func);
+
       /**
        * Type of functions that can be passed to OnFail.
        */
@@ -571,9 +1338,19 @@ namespace WSTM
       static void AtomicallyImpl(Internal::WAtomicOp& op,
                                  const WMaxConflicts& maxConflicts,
                                  const WMaxRetries& maxRetries,
-                                 const WMaxRetryWait& maxRetryWait);
+                                 const WMaxRetryWait& maxRetryWait,
+                                 const WReadOnly& readOnly,
+                                 const WContentionManager& contention,
+                                 const WElastic& elastic,
+                                 const WCallSite& callSite);
       //@}
 
+      /**
+       * This method is used internally, just ignore it. You should be looking at AtomicallyBatch
+       * instead.
+       */
+      static std::vector<std::exception_ptr> AtomicallyBatchImpl (const std::vector<std::function<void (WAtomic&)>>& ops);
+
       /**
        * Destroys the object.
        */
@@ -608,6 +1385,12 @@ namespace WSTM
       void Abort();
       //Clears the transaction and gets it ready to run again
       void Restart ();
+      //Restarts after a conflict, the contention policy (if there is one) is run once the
+      //transaction has been cleared out.
+      void RestartAfterConflict (WContentionPolicy* policy_p, WContentionInfo& info);
+      //Restarts a child transaction on its own after a conflict, returns false if its ancestors'
+      //reads are no longer valid (so the whole transaction has to be restarted).
+      bool RestartChild ();
       //Runs the "on fail" handlers.
       void RunOnFails ();
       //waits for one of the Vars read by this transaction
@@ -615,18 +1398,32 @@ namespace WSTM
       bool WaitForChanges(const WTimeArg& timeout);
 
       //Gets the value for the given WVar, this will be null if a
-      //value has not been "gotten" or "set" for this WVar in this transaction.
-      const Internal::WValueBase* GetVarValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p);
+      //value has not been "gotten" or "set" for this WVar in this transaction. If fromSet_p isn't
+      //null it is set to whether the value is a "set" value.
+      const Internal::WValueBase* GetVarValue (const Internal::WVarCoreBase* core_p, bool* fromSet_p = nullptr);
+      //Reads the committed value of the given WVar and records it as "gotten" in this
+      //transaction. The transaction only keeps a raw pointer to the core, it is kept alive by
+      //RetireCore instead of a reference count.
+      const Internal::WValueBase* ReadVarValue (Internal::WVarCoreBase* core_p);
       //Gets the value that has been "gotten" for the given WVar, this will be null if a value has
       //not been "gotten" for the WVar in this transaction. 
-      const Internal::WValueBase* GetVarGotValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p);
-      //Sets the "gotten" value for the given WVar in this transaction.
-      void  SetVarGetValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p, std::shared_ptr<Internal::WValueBase>&& value_p);
+      const Internal::WValueBase* GetVarGotValue (const Internal::WVarCoreBase* core_p);
+      //Throws WFailedValidationException if the "gotten" value for the given WVar is no longer
+      //valid. 
+      void ValidateVar (const Internal::WVarCoreBase* core_p);
+      //Removes the "gotten" value for the given WVar from this transaction and its parents.
+      void ReleaseVar (const Internal::WVarCoreBase* core_p);
       //Gets the value that has been set for the WVar, or null if no
       //value has been set.
-      Internal::WValueBase* GetVarSetValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p);
-      //Sets the given WVar's value in the transaction. 
-      void SetVarValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p, std::shared_ptr<Internal::WValueBase>&& value_p);
+      Internal::WValueBase* GetVarSetValue (const Internal::WVarCoreBase* core_p);
+      //Sets the given WVar's value in the transaction. The transaction holds a reference to the
+      //cores that it writes until it is done committing.
+      void SetVarValue (const std::shared_ptr<Internal::WVarCoreBase>& core_p, std::unique_ptr<Internal::WValueBase>&& value_p);
+      //Sets a value that needs WValueBase::ApplyDelta called on it when the transaction commits.
+      void SetVarDelta (const std::shared_ptr<Internal::WVarCoreBase>& core_p, std::unique_ptr<Internal::WValueBase>&& value_p);
+      //Gets memory for a copy of an inline value (INLINE_VALUE_SLOT_SIZE bytes). The memory stays
+      //good until the top-level transaction ends.
+      void* AllocateInlineValue ();
 
       //Used by WTransactionLocalValue
       Internal::WLocalValueBase* GetLocalValue (uint64_t key);
@@ -642,6 +1439,8 @@ namespace WSTM
     */
    class WSTM_CLASSAPI WInconsistent
    {
+      template <typename> friend class WVar;
+
    public:
       /**
        * This is used internally, you want to look at Inconsistently instead.
@@ -649,10 +1448,10 @@ namespace WSTM
       static void InconsistentlyImpl(Internal::WInconsistentOp& op);
 
       /**
-       * Causes the transaction to acquire a read lock. Normally during the course of reading a WVar
-       * a read lock is acquired and released. This can be a performance problem when a lot of WVars
-       * need to be read. In those cases this method should be called so that one read lock will be
-       * held while doing the reads. The lock will be held until either readUnlock has been called
+       * Causes the transaction to acquire a read lock. Reading a WVar doesn't take any locks so
+       * other transactions can commit in between reads. If that is a problem (e.g. a lot of WVars
+       * need to be read and conflicts are likely) then this method can be called so that commits
+       * are held off while doing the reads. The lock will be held until either readUnlock has been called
        * an equal number of times as readLock or the transaction ends. Normally WReadLockGuard
        * should be used instead of calling this directly.
        */
@@ -678,7 +1477,10 @@ namespace WSTM
       WInconsistent (const WInconsistent&);
       WInconsistent& operator= (const WInconsistent&);
 
-      boost::shared_lock<boost::upgrade_mutex> m_lock;
+      //Gets the last committed value of the given WVar.
+      const Internal::WValueBase* GetVarValue (const Internal::WVarCoreBase& core);
+      
+      boost::shared_lock<Internal::WReadMutex> m_lock;
       size_t m_lockCount;
    };
 
@@ -822,6 +1624,21 @@ namespace WSTM
       {}
    };
 
+   /**
+    * Exception thrown when WVar::Set is called in a read-only transaction.
+    *
+    * @see WReadOnly
+    */
+   struct WSTM_CLASSAPI WReadOnlyException : public WCantContinueException
+   {
+      /**
+       * Creates an exception object.
+       */
+      WReadOnlyException():
+         WCantContinueException("Tried to set a variable in a read-only transaction")
+      {}
+   };
+
    //@{
    /**
     * Runs the given operation in an atomic fashion. This means that when the operation runs any
@@ -849,7 +1666,7 @@ namespace WSTM
       typename std::enable_if<std::is_same<void, decltype (op (std::declval<WAtomic&>()))>::value, void>::type
    {
       auto voidOp = Internal::MakeVoidOp<WAtomic> (op);
-      WAtomic::AtomicallyImpl(voidOp, findArg<WMaxConflicts>(options...), findArg<WMaxRetries>(options...), findArg<WMaxRetryWait>(options...));
+      WAtomic::AtomicallyImpl(voidOp, findArg<WMaxConflicts>(options...), findArg<WMaxRetries>(options...), findArg<WMaxRetryWait>(options...), findArg<WReadOnly>(options...), findArg<WContentionManager>(options...), findArg<WElastic>(options...), findArg<WCallSite>(options...));
    }
                    
    template <typename Op_t, typename ... Options_t>
@@ -857,7 +1674,7 @@ namespace WSTM
       typename std::enable_if<!std::is_same<void, decltype (op (std::declval<WAtomic&>()))>::value, decltype (op (std::declval<WAtomic&>()))>::type
    {
       auto valOp = Internal::MakeValOp<WAtomic> (op);
-      WAtomic::AtomicallyImpl(valOp, findArg<WMaxConflicts>(options...), findArg<WMaxRetries>(options...), findArg<WMaxRetryWait>(options...));
+      WAtomic::AtomicallyImpl(valOp, findArg<WMaxConflicts>(options...), findArg<WMaxRetries>(options...), findArg<WMaxRetryWait>(options...), findArg<WReadOnly>(options...), findArg<WContentionManager>(options...), findArg<WElastic>(options...), findArg<WCallSite>(options...));
       return valOp.GetResult();
    }   
    //@}
@@ -926,6 +1743,46 @@ namespace WSTM
     * in the function's definition.
     */
 #define NO_ATOMIC_IMPL const ::WSTM::WNoAtomic&
+
+   /**
+    * Type of the operations passed to AtomicallyBatch.
+    */
+   using WBatchOp = std::function<void (WAtomic&)>;
+
+   /**
+    * Runs a number of independent operations as if Atomically had been called on each of them in
+    * turn, but commits them together so that the commit locking is only paid for once. This is
+    * meant for threads that run lots of tiny transactions. Each operation is run in a transaction
+    * of its own, the operations don't see each other's changes until they are committed. The
+    * transactions are committed in order and each one is checked against the commits of the ones
+    * before it, so the ones that don't conflict are committed while the ones that do (including
+    * ones that read something that an earlier operation in the batch set) are run again on their
+    * own once the batch has committed. Operations that call Retry are also run on their own after
+    * the batch has committed. Operations that are run on their own end up running after the
+    * operations that followed them in the batch, so don't put an operation ahead of operations that
+    * depend on its effects.
+    *
+    * @param ops The operations to run, see Atomically.
+    *
+    * @return An exception_ptr for each operation, holding the exception that the operation threw
+    * (its changes are thrown away, the rest of the batch still commits) or null if the operation
+    * committed.
+    */
+   WSTM_LIBAPI std::vector<std::exception_ptr> AtomicallyBatch (const std::vector<WBatchOp>& ops, NO_ATOMIC);
+
+   namespace Internal
+   {
+      //Thrown out of Atomically when a transaction that is being run by AtomicallyAsync calls
+      //Retry, the transaction will be run again once one of the variables that it read changes.
+      struct WParkedException
+      {};
+
+      //Runs a transaction for AtomicallyAsync on one of the library's worker threads. If the
+      //transaction times out in Retry then onTimeout is called instead of running it again.
+      WSTM_LIBAPI void RunAsync (std::function<void ()> run, std::function<void ()> onTimeout);
+      //Runs the given function on one of the AtomicallyAsync worker threads.
+      WSTM_LIBAPI void PostAsync (std::function<void ()> f);
+   }
             
    //@{
    /**
@@ -982,6 +1839,40 @@ namespace WSTM
    */
    WSTM_LIBAPI void Retry(WAtomic& at, const WTimeArg& timeout = WTimeArg::Unlimited ());
 
+   /**
+    * Passed to the WVar constructor to have the variable keep some of its old values around for
+    * read-only transactions (see WReadOnly). A read-only transaction that reads a variable that has
+    * changed since the transaction started uses the value that was current when it started instead
+    * of being restarted, as long as that value is still around. Old values are only kept while
+    * there is a read-only transaction running that might need them, so this costs an extra
+    * allocation per commit of the variable and the memory for the old values (see
+    * WVar::GetHistoryMemory) while long read-only transactions are running.
+    */
+   struct WSTM_CLASSAPI WVarHistory
+   {
+      /**
+       * Creates an object.
+       *
+       * @param maxVersions The maximum number of old values to keep.
+       */
+      explicit WVarHistory (const size_t maxVersions);
+
+      //! The maximum number of old values to keep.
+      size_t m_maxVersions;
+   };
+   
+   /**
+    * Pass to the WVar constructor to have the variable compare values instead of only looking at
+    * when they were committed. Committing a value that is equal to the variable's current value
+    * then doesn't change the variable at all (so transactions that read it don't conflict and
+    * threads waiting in Retry aren't woken up), and a transaction that read the variable is still
+    * valid if the variable has been changed back to the value that it read. This is meant for flags
+    * and the like that get set to the value that they already have a lot. The type stored must be
+    * comparable with ==, the comparisons are done while committing so they should be cheap.
+    */
+   struct WCompareValues
+   {};
+   
    /**
     * A transactional variable.  Access to the contents of the variable is restricted to functions
     * passed to Atomically, see the description of Atomically for details on what "transactional"
@@ -1012,7 +1903,7 @@ namespace WSTM
        * Default Constructor.  This can only be used if Type_t has a default constructor.
        */
       WVar():
-         m_core_p(std::make_shared<Internal::WVarCore<Type_t>>(std::make_shared<Internal::WValue<Type_t>> (0, Type_t ())))
+         m_core_p(std::make_shared<Internal::WVarCore<Type_t>>(Type_t ()))
       {}
 
       /**
@@ -1021,9 +1912,32 @@ namespace WSTM
        *  @param val The initial value for the variable.
        */
       explicit WVar(param_type val):
-         m_core_p(std::make_shared<Internal::WVarCore<Type_t>>(std::make_shared<Internal::WValue<Type_t>> (0, val)))
+         m_core_p(std::make_shared<Internal::WVarCore<Type_t>>(val))
       {}
 
+      /**
+       * Constructor for variables that keep history.
+       *
+       * @param val The initial value for the variable.
+       * @param history How much history to keep.
+       */
+      WVar(param_type val, const WVarHistory& history):
+         m_core_p(std::make_shared<Internal::WVarCore<Type_t>>(val))
+      {
+         m_core_p->EnableHistory (history.m_maxVersions);
+      }
+
+      /**
+       * Constructor for variables that compare values.
+       *
+       * @param val The initial value for the variable.
+       */
+      WVar(param_type val, const WCompareValues&):
+         m_core_p(std::make_shared<Internal::WVarCore<Type_t>>(val))
+      {
+         m_core_p->m_isCurrentValue_p = &Internal::IsCurrentValue<Type_t>;
+      }
+
       //! No copying.
       WVar (const WVar&) = delete;
       //! No copying.
@@ -1042,10 +1956,23 @@ namespace WSTM
 
       WVar& operator=(WVar&& var)
       {
-         m_core_p = std::move (var.m_core_p);
+         if (&var != this)
+         {
+            Internal::RetireCore (std::move (m_core_p));
+            m_core_p = std::move (var.m_core_p);
+         }
          return *this;
       }
       //@}
+
+      /**
+       * Destroys the variable. The value is freed once no running transaction could still be
+       * reading it.
+       */
+      ~WVar ()
+      {
+         Internal::RetireCore (std::move (m_core_p));
+      }
       
       /**
        * Gets the variable's current value.
@@ -1062,14 +1989,10 @@ namespace WSTM
        */
       param_type Get(WAtomic& at) const
       {
-         auto val_p = static_cast<const Internal::WValue<Type_t>*>(at.GetVarValue (m_core_p));
+         auto val_p = static_cast<const Internal::WValue<Type_t>*>(at.GetVarValue (m_core_p.get ()));
          if (!val_p)
          {
-            WReadLockGuard<WAtomic> lock (at);
-            auto value_p = m_core_p->m_value_p;
-            lock.Unlock ();
-            val_p = value_p.get ();
-            at.SetVarGetValue (m_core_p, std::move (value_p));
+            val_p = static_cast<const Internal::WValue<Type_t>*>(at.ReadVarValue (m_core_p.get ()));
          }
          return val_p->m_value;
       }
@@ -1085,10 +2008,7 @@ namespace WSTM
        */
       Type GetInconsistent(WInconsistent& ins) const
       {
-         WReadLockGuard<WInconsistent> lock (ins);
-         const std::shared_ptr<const Internal::WValue<Type_t>> val_p = m_core_p->m_value_p;
-         lock.Unlock ();
-         return val_p->m_value;
+         return GetInconsistent (ins, Internal::WIsInlineValue<Type_t>());
       }
 
       /**
@@ -1118,14 +2038,11 @@ namespace WSTM
          //moved into a WVar and then the transaction gets restarted
          //the object that we need to move from is now in its
          //post-move state and unusable.
-         auto val_p = static_cast<Internal::WValue<Type_t>*>(at.GetVarSetValue (m_core_p));
+         auto val_p = static_cast<Internal::WValue<Type_t>*>(at.GetVarSetValue (m_core_p.get ()));
          if (!val_p)
          {
-            WReadLockGuard<WAtomic> lock (at);
-            const auto oldVersion = m_core_p->m_value_p->m_version;
-            lock.Unlock ();            
-            auto newVal_p = std::make_shared<Internal::WValue<Type_t>>(oldVersion + 1, val);
-            at.SetVarValue (m_core_p, std::move (newVal_p));
+            //the version is filled in when the transaction commits
+            at.SetVarValue (m_core_p, NewSetValue (val, at, Internal::WIsInlineValue<Type_t>()));
          }
          else
          {
@@ -1155,21 +2072,245 @@ namespace WSTM
        */
       void Validate (WAtomic& at) const
       {
-         const auto val_p = at.GetVarGotValue (m_core_p);
-         if (val_p)
+         at.ValidateVar (m_core_p.get ());
+      }
+
+      /**
+       * Releases the variable from the transaction's reads (early release). The variable will not
+       * be validated when the transaction commits, so other transactions can change it without
+       * conflicting with this one. This is useful when walking linked structures where the links
+       * that have been passed no longer matter. If the variable is read again in the transaction
+       * the latest committed value will be read, which may be different from the value read
+       * before. Any value set for the variable in the transaction is not affected.
+       *
+       * Only the read done at the current nesting level is released. If an enclosing transaction
+       * (or a child transaction that has already finished) read the variable then that read is
+       * kept and is still validated, so a helper that runs in a child transaction can't drop
+       * reads that its caller depends on.
+       *
+       * @param at The current transaction.
+       */
+      void Release (WAtomic& at) const
+      {
+         at.ReleaseVar (m_core_p.get ());
+      }
+
+      /**
+       * Gets the number of old values that the variable is currently keeping, this is always 0
+       * unless the variable was constructed with a WVarHistory.
+       */
+      size_t GetHistoryLength () const
+      {
+         return m_core_p->GetHistoryLength ();
+      }
+
+      /**
+       * Gets the approximate amount of memory (in bytes) being used to keep the variable's old
+       * values. Memory that the values themselves own is not included.
+       */
+      size_t GetHistoryMemory () const
+      {
+         return m_core_p->GetHistoryMemory (sizeof (Internal::WValue<Type_t>));
+      }
+
+      /**
+       * Names the variable. Conflict attribution reports (see GetHotVariables) use the name to
+       * say which variable caused the conflicts. Variables don't have names unless this is called.
+       *
+       * @param name The name.
+       */
+      void SetName (const std::string& name)
+      {
+         Internal::SetVarName (*m_core_p, name);
+      }
+
+      /**
+       * Gets the variable's name.
+       *
+       * @return The name given to SetName, or an empty string if the variable hasn't been named.
+       */
+      std::string GetName () const
+      {
+         return Internal::GetVarName (*m_core_p);
+      }
+      
+   private:
+      Type GetInconsistent (WInconsistent& ins, std::false_type) const
+      {
+         const auto val_p = ins.GetVarValue (*m_core_p);
+         return static_cast<const Internal::WValue<Type_t>*>(val_p)->m_value;
+      }
+
+      Type GetInconsistent (WInconsistent&, std::true_type) const
+      {
+         Type_t value;
+         m_core_p->Load (value);
+         return value;
+      }
+
+      static std::unique_ptr<Internal::WValueBase> NewSetValue (param_type val, WAtomic&, std::false_type)
+      {
+         return std::make_unique<Internal::WValue<Type_t>>(0, val);
+      }
+
+      static std::unique_ptr<Internal::WValueBase> NewSetValue (param_type val, WAtomic& at, std::true_type)
+      {
+         return std::unique_ptr<Internal::WValueBase>(new (at.AllocateInlineValue ()) Internal::WInlineValue<Type_t>(0, val));
+      }
+      
+      typename std::shared_ptr<Internal::WVarCore<Type_t>> m_core_p;
+   };
+
+   /**
+    * A transactional counter. Add doesn't read the counter, it records the amount to add which is
+    * applied when the transaction commits. So transactions that only add to a counter don't
+    * conflict with each other (they only conflict with transactions that read it). Reading the
+    * counter with Get in a transaction that has already added to it turns the additions into a
+    * normal read and write of the counter.
+    *
+    * @param Type_t The type of the counter, this must be an arithmetic type no bigger than 8
+    * bytes.
+    */
+   template <typename Type_t>
+   class WCounter
+   {
+      static_assert (std::is_arithmetic<Type_t>::value && !std::is_same<Type_t, bool>::value &&
+                     sizeof (Type_t) <= sizeof (uint64_t),
+                     "WCounter needs an arithmetic type no bigger than 8 bytes");
+      using Value = Internal::WCounterValue<Type_t>;
+      static_assert (sizeof (Value) <= Internal::INLINE_VALUE_SLOT_SIZE, "counter value doesn't fit in a slot");
+      
+   public:
+      //! The type stored in the counter.
+      using Type = Type_t;
+      
+      /**
+       * Constructor.
+       *
+       * @param val The initial value for the counter.
+       */
+      explicit WCounter (const Type_t val = Type_t ()):
+         m_core_p (std::make_shared<Internal::WVarCore<Type_t>>(val))
+      {}
+
+      //! No copying.
+      WCounter (const WCounter&) = delete;
+      //! No copying.
+      WCounter& operator= (const WCounter&) = delete;
+
+      /**
+       * Destroys the counter.
+       */
+      ~WCounter ()
+      {
+         Internal::RetireCore (std::move (m_core_p));
+      }
+
+      /**
+       * Gets the counter's value, including anything added to it in the transaction so far.
+       *
+       * @param at The transaction to use.
+       */
+      Type_t Get (WAtomic& at) const
+      {
+         auto fromSet = false;
+         const auto val_p = at.GetVarValue (m_core_p.get (), &fromSet);
+         if (val_p && !(fromSet && static_cast<const Value*>(val_p)->m_delta))
          {
-            WReadLockGuard<WAtomic> lock (at);
-            const auto valid = m_core_p->Validate (*val_p);
-            lock.Unlock ();
-            if (!valid)
-            {
-               throw Internal::WFailedValidationException();
-            }
+            return static_cast<const Internal::WValue<Type_t>*>(val_p)->m_value;
+         }
+
+         //anything that has been added so far is added to the current value
+         const auto read_p = static_cast<const Internal::WValue<Type_t>*>(at.ReadVarValue (m_core_p.get ()));
+         if (!val_p)
+         {
+            return read_p->m_value;
+         }
+         const auto value = static_cast<Type_t>(read_p->m_value + static_cast<const Value*>(val_p)->m_value);
+         SetValue (value, false, at);
+         return value;
+      }
+
+      /**
+       * Gets the counter's value outside of a transaction.
+       */
+      Type_t GetReadOnly () const
+      {
+         return Atomically ([&](WAtomic& at){return Get (at);});
+      }
+
+      /**
+       * Adds to the counter without reading it.
+       *
+       * @param delta The amount to add, can be negative.
+       * @param at The transaction to use.
+       */
+      void Add (const Type_t delta, WAtomic& at)
+      {
+         const auto set_p = static_cast<Value*>(at.GetVarSetValue (m_core_p.get ()));
+         if (set_p)
+         {
+            set_p->m_value += delta;
+            return;
+         }
+
+         //this transaction's value has to include whatever its parents have done
+         auto fromSet = false;
+         const auto val_p = at.GetVarValue (m_core_p.get (), &fromSet);
+         if (!val_p)
+         {
+            SetValue (delta, true, at);
+         }
+         else
+         {
+            const auto value = static_cast<Type_t>(static_cast<const Internal::WValue<Type_t>*>(val_p)->m_value + delta);
+            SetValue (value, fromSet && static_cast<const Value*>(val_p)->m_delta, at);
          }
       }
+
+      /**
+       * Adds to the counter in its own transaction.
+       *
+       * @param delta The amount to add, can be negative.
+       */
+      void Add (const Type_t delta)
+      {
+         Atomically ([&](WAtomic& at){Add (delta, at);});
+      }
+
+      /**
+       * Sets the counter's value.
+       *
+       * @param val The new value.
+       * @param at The transaction to use.
+       */
+      void Set (const Type_t val, WAtomic& at)
+      {
+         SetValue (val, false, at);
+      }
       
    private:
-      typename std::shared_ptr<Internal::WVarCore<Type_t>> m_core_p;
+      void SetValue (const Type_t value, const bool delta, WAtomic& at) const
+      {
+         const auto set_p = static_cast<Value*>(at.GetVarSetValue (m_core_p.get ()));
+         if (set_p)
+         {
+            set_p->m_value = value;
+            set_p->m_delta = delta;
+            return;
+         }
+         auto value_p = std::unique_ptr<Internal::WValueBase>(new (at.AllocateInlineValue ()) Value (value, delta));
+         if (delta)
+         {
+            at.SetVarDelta (m_core_p, std::move (value_p));
+         }
+         else
+         {
+            at.SetVarValue (m_core_p, std::move (value_p));
+         }
+      }
+      
+      std::shared_ptr<Internal::WVarCore<Type_t>> m_core_p;
    };
 
    /**